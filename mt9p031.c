@@ -10,10 +10,18 @@
 #include <linux/videodev2.h>
 #include <linux/clk.h>
 #include <media/v4l2-device.h>
+#include <media/v4l2-dev.h>
+#include <media/v4l2-ioctl.h>
+#include <media/v4l2-ctrls.h>
 #include <media/v4l2-chip-ident.h>
 #include <media/v4l2-mediabus.h>//linux-3.0
 #include <linux/io.h>
 #include <linux/gpio.h>
+#include <linux/interrupt.h>
+#include <linux/ktime.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/pm_runtime.h>
 #include <mach/sys_config.h>
 #include <linux/regulator/consumer.h>
 #include <mach/system.h>
@@ -100,8 +108,243 @@ MODULE_LICENSE("GPL");
 #define REG_MT9P031_RED_GAIN			0x2d
 #define REG_MT9P031_GREEN_2_GAIN		0x2e
 #define REG_MT9P031_GLOBAL_GAIN			0x35
+#define REG_MT9P031_ROW_BLACK_TARGET		0x49
+#define REG_MT9P031_ROW_BLACK_DEF_OFFSET	0x4b
+#define REG_MT9P031_BLC_SAMPLE_SIZE		0x5b
+#define REG_MT9P031_GREEN_1_OFFSET		0x60
+#define REG_MT9P031_GREEN_2_OFFSET		0x61
+#define REG_MT9P031_BLACK_LEVEL_CALIBRATION	0x62
+#define REG_MT9P031_RED_OFFSET			0x63
+#define REG_MT9P031_BLUE_OFFSET			0x64
+#define REG_MT9P031_TEST_PATTERN		0xa0
+#define REG_MT9P031_TEST_PATTERN_GREEN		0xa1
+#define REG_MT9P031_TEST_PATTERN_RED		0xa2
+#define REG_MT9P031_TEST_PATTERN_BLUE		0xa3
+#define REG_MT9P031_TEST_PATTERN_BAR_WIDTH	0xa4
 #define REG_MT9P031_CHIP_VERSION_ALT	        0x0FF
 
+/* Restart (0x0b) bits */
+#define MT9P031_RESTART_RESTART			(1 << 0)
+#define MT9P031_RESTART_PAUSE			(1 << 1)
+
+/* Output Control (0x07) bits */
+#define MT9P031_OUTPUT_CONTROL_SYN		(1 << 0)
+#define MT9P031_OUTPUT_CONTROL_CEN		(1 << 1)
+
+/* PLL Control (0x10) bits */
+#define MT9P031_PLL_CTRL_DEF			0x0050
+#define MT9P031_PLL_CTRL_PWRUP			(1 << 0)
+#define MT9P031_PLL_CTRL_USE_PLL		(1 << 1)
+
+/* Pixel Clock Control (0x0a) bits */
+#define MT9P031_PCLK_CTRL_DIVIDE_MASK		0x007f
+
+/* Read Mode 1 (0x1e) bits */
+#define MT9P031_READ_MODE1_STROBE_INVERT	(1 << 5)
+#define MT9P031_READ_MODE1_STROBE_ENABLE	(1 << 4)
+#define MT9P031_READ_MODE1_STROBE_START_SHIFT	2
+#define MT9P031_READ_MODE1_STROBE_END_SHIFT	0
+#define MT9P031_STROBE_ALL_EXPOSING		1	/* Last row starts exposing */
+#define MT9P031_STROBE_SHUTTER_WIDTH		2	/* First row stops */
+#define MT9P031_READ_MODE1_DEF						\
+	((MT9P031_STROBE_ALL_EXPOSING << MT9P031_READ_MODE1_STROBE_START_SHIFT) | \
+	 (MT9P031_STROBE_SHUTTER_WIDTH << MT9P031_READ_MODE1_STROBE_END_SHIFT))
+
+/* Read Mode 2 (0x20) bits */
+#define MT9P031_READ_MODE2_ROW_MIRROR		(1 << 15)
+#define MT9P031_READ_MODE2_COL_MIRROR		(1 << 14)
+#define MT9P031_READ_MODE2_ROW_BLC		(1 << 6)
+
+/* Global Gain (0x35) bits */
+#define MT9P031_GAIN_ANALOG_MULT		(1 << 6)
+
+/* Black Level Calibration (0x62) bits */
+#define MT9P031_BLC_MANUAL			(1 << 0)
+#define MT9P031_BLC_RECALCULATE			(1 << 12)
+
+/* Test Pattern Control (0xa0) bits */
+#define MT9P031_TEST_PATTERN_SHIFT		3
+#define MT9P031_TEST_PATTERN_ENABLE		(1 << 0)
+
+#define MT9P031_ROW_BLACK_DEF_OFFSET_DEF	0x0028
+#define MT9P031_ROW_BLACK_TARGET_DEF		0x00a8
+#define MT9P031_BLC_ANALOG_OFFSET_DEF		32
+
+/*
+ * Controls that linux-3.4 does not know about yet, numbered as upstream
+ * so that userspace built against newer headers keeps working.
+ */
+#ifndef V4L2_CID_IMAGE_SOURCE_CLASS_BASE
+#define V4L2_CID_IMAGE_SOURCE_CLASS_BASE	(0x009e0000 | 0x900)
+#define V4L2_CID_VBLANK				(V4L2_CID_IMAGE_SOURCE_CLASS_BASE + 1)
+#define V4L2_CID_HBLANK				(V4L2_CID_IMAGE_SOURCE_CLASS_BASE + 2)
+#endif
+#ifndef V4L2_CID_IMAGE_PROC_CLASS_BASE
+#define V4L2_CID_IMAGE_PROC_CLASS_BASE		(0x009f0000 | 0x900)
+#define V4L2_CID_PIXEL_RATE			(V4L2_CID_IMAGE_PROC_CLASS_BASE + 2)
+#endif
+#ifndef V4L2_CID_TEST_PATTERN
+#define V4L2_CID_TEST_PATTERN			(V4L2_CID_IMAGE_PROC_CLASS_BASE + 3)
+#endif
+#ifndef V4L2_CID_TEST_PATTERN_RED
+#define V4L2_CID_TEST_PATTERN_RED		(V4L2_CID_IMAGE_SOURCE_CLASS_BASE + 3)
+#define V4L2_CID_TEST_PATTERN_GREENR		(V4L2_CID_IMAGE_SOURCE_CLASS_BASE + 4)
+#define V4L2_CID_TEST_PATTERN_BLUE		(V4L2_CID_IMAGE_SOURCE_CLASS_BASE + 5)
+#endif
+
+/* Driver private controls */
+#define V4L2_CID_MT9P031_BASE			(V4L2_CID_USER_BASE | 0x1000)
+#define V4L2_CID_MT9P031_TEST_PATTERN_BAR_WIDTH	(V4L2_CID_MT9P031_BASE + 0)
+#define V4L2_CID_MT9P031_FRAME_PERIOD		(V4L2_CID_MT9P031_BASE + 1)
+#define V4L2_CID_MT9P031_FRAME_SYNC		(V4L2_CID_MT9P031_BASE + 2)
+#define V4L2_CID_MT9P031_FRAME_SYNC_TARGET	(V4L2_CID_MT9P031_BASE + 3)
+#define V4L2_CID_MT9P031_FRAME_COUNT		(V4L2_CID_MT9P031_BASE + 4)
+#define V4L2_CID_MT9P031_FRAME_SYNC_LAST	(V4L2_CID_MT9P031_BASE + 5)
+#define V4L2_CID_MT9P031_STEREO_SYNC		(V4L2_CID_MT9P031_BASE + 6)
+#define V4L2_CID_MT9P031_STEREO_SKEW		(V4L2_CID_MT9P031_BASE + 7)
+#define V4L2_CID_MT9P031_BLC_AUTO		(V4L2_CID_MT9P031_BASE + 8)
+#define V4L2_CID_MT9P031_BLC_TARGET		(V4L2_CID_MT9P031_BASE + 9)
+#define V4L2_CID_MT9P031_BLC_ANALOG_OFFSET	(V4L2_CID_MT9P031_BASE + 10)
+#define V4L2_CID_MT9P031_BLC_DIGITAL_OFFSET	(V4L2_CID_MT9P031_BASE + 11)
+#define V4L2_CID_MT9P031_BLC_SAMPLE_SIZE	(V4L2_CID_MT9P031_BASE + 12)
+#define V4L2_CID_MT9P031_BLC_RECALCULATE	(V4L2_CID_MT9P031_BASE + 13)
+#define V4L2_CID_MT9P031_BLC_SETTLE_RATIO	(V4L2_CID_MT9P031_BASE + 14)
+#define V4L2_CID_MT9P031_LOW_LATENCY		(V4L2_CID_MT9P031_BASE + 15)
+#define V4L2_CID_MT9P031_READOUT_TIME		(V4L2_CID_MT9P031_BASE + 16)
+#define V4L2_CID_MT9P031_LATENCY		(V4L2_CID_MT9P031_BASE + 17)
+#define V4L2_CID_MT9P031_MIN_FPS		(V4L2_CID_MT9P031_BASE + 18)
+#define V4L2_CID_MT9P031_METERING		(V4L2_CID_MT9P031_BASE + 19)
+#define V4L2_CID_MT9P031_AE_TARGET		(V4L2_CID_MT9P031_BASE + 20)
+#define V4L2_CID_MT9P031_STROBE_WIDTH		(V4L2_CID_MT9P031_BASE + 21)
+
+/*
+ * Per buffer frame information.  The CSI host asks for it through the
+ * subdev ioctl for every buffer it completes, passing the completion time
+ * so the buffer can be matched with the frame the sensor produced.  All
+ * times are CLOCK_MONOTONIC nanoseconds.
+ *
+ * The host does not pass private ioctls on from its video node, so this
+ * and the MT9P031_CMD_* ioctls below also work on the sensor's own
+ * v4l-subdev node, see mt9p031_registered().
+ *
+ * The settings are the ones the frame was exposed and read out with.
+ * Gains are register values; Global_Gain (R0x35) writes all four of them.
+ * The window is in pixel array coordinates.  A frame read out across a
+ * Row_Start or window size write is corrupt, the sensor has no way of
+ * masking it, and is flagged MT9P031_FRAME_BAD.
+ */
+#define MT9P031_FRAME_BAD	0x0001
+
+struct mt9p031_frame_settings {
+	__u32 shutter_width;		/* Rows, R0x08/R0x09 */
+	__u16 gain[4];			/* R0x2B-R0x2E: green1, blue, red, green2 */
+	__u16 row_start;
+	__u16 col_start;
+	__u16 height;
+	__u16 width;
+	__u32 frame_period_us;		/* 0 = not known yet */
+	__u16 roi;			/* Window of the MT9P031_CMD_S_ROI set, 0 without one */
+	__u16 flags;			/* MT9P031_FRAME_* */
+};
+
+struct mt9p031_frame_info {
+	__s64 timestamp;		/* in: buffer completion, 0 = now */
+	__u32 sequence;			/* out: sensor frame number */
+	__u32 dropped;			/* out: frames lost since the previous buffer */
+	__s64 sof;			/* out: FRAME_VALID rising edge */
+	__s64 exposure_start;		/* out: start of exposure of the first row */
+	__u32 exposure_ns;
+	__u32 readout_ns;
+	struct mt9p031_frame_settings settings;
+};
+
+#define MT9P031_CMD_G_FRAME_INFO	_IOWR('V', BASE_VIDIOC_PRIVATE + 0x20, struct mt9p031_frame_info)
+
+/*
+ * Row statistics for the flicker detector.  The sensor never sees its
+ * pixels, whoever does (the CSI host or the application) hands in the
+ * mean level of every row_step-th row of a frame together with the
+ * frame's start time from MT9P031_CMD_G_FRAME_INFO.
+ */
+#define MT9P031_ROW_MEANS	64
+
+struct mt9p031_row_means {
+	__s64 sof;			/* in: FRAME_VALID rising edge */
+	__u16 first_row;		/* in: row of mean[0], in output rows */
+	__u16 row_step;			/* in: rows between entries */
+	__u16 count;			/* in: entries used, at least 8 */
+	__u16 detected;			/* out: mains frequency found, 0 = none yet */
+	__u16 mean[MT9P031_ROW_MEANS];
+};
+
+#define MT9P031_CMD_S_ROW_MEANS		_IOWR('V', BASE_VIDIOC_PRIVATE + 0x21, struct mt9p031_row_means)
+
+/*
+ * Metering for V4L2_CID_EXPOSURE_AUTO.  The statistics come in the same
+ * way as the row means: a grid of zone means over the output frame,
+ * 16 bit full scale, which the driver weighs by V4L2_CID_MT9P031_METERING
+ * and steers towards V4L2_CID_MT9P031_AE_TARGET.  Spot and grid weights
+ * are set with MT9P031_CMD_S_METERING.
+ */
+#define MT9P031_ZONES_MAX	256	/* 16 x 16 */
+#define MT9P031_WEIGHTS_MAX	64	/* 8 x 8 */
+
+enum mt9p031_metering_mode {
+	MT9P031_METERING_AVERAGE,
+	MT9P031_METERING_CENTER,
+	MT9P031_METERING_SPOT,
+	MT9P031_METERING_GRID,
+};
+
+struct mt9p031_metering {
+	__u16 spot_x;			/* Spot centre, per mille of the frame */
+	__u16 spot_y;
+	__u16 spot_width;		/* Spot size, per mille of the frame */
+	__u16 spot_height;
+	__u8 cols;			/* Weight grid, up to 8 x 8 ... */
+	__u8 rows;
+	__u16 reserved;
+	__u8 weight[MT9P031_WEIGHTS_MAX];	/* ... row by row */
+};
+
+struct mt9p031_zone_means {
+	__u8 cols;			/* in: zone grid, up to 16 x 16 */
+	__u8 rows;
+	__u16 level;			/* out: metered level */
+	__u32 shutter_width;		/* out: rows, after the AE step */
+	__u16 gain;			/* out: in V4L2_CID_GAIN units */
+	__u16 reserved;
+	__u16 mean[MT9P031_ZONES_MAX];	/* in: row by row */
+};
+
+#define MT9P031_CMD_S_METERING		_IOW('V', BASE_VIDIOC_PRIVATE + 0x22, struct mt9p031_metering)
+#define MT9P031_CMD_S_ZONE_MEANS	_IOWR('V', BASE_VIDIOC_PRIVATE + 0x23, struct mt9p031_zone_means)
+
+/*
+ * Alternating windows.  Successive frames are read out at each start of
+ * the set in turn, and each frame's settings carry the index.  The VGA
+ * and 720p modes bin, a set moves them to a full resolution window of
+ * the same size; other modes keep theirs.  Either way the host keeps
+ * its format.
+ * Starts are even, which keeps the Bayer order.  A new row start costs a
+ * frame flagged MT9P031_FRAME_BAD, so such a window is held for a second
+ * frame.  A count of 0 goes back to the mode's own window.  Needs the
+ * vsync interrupt.
+ */
+#define MT9P031_ROI_MAX		4
+
+struct mt9p031_roi {
+	__u16 row_start;		/* Pixel array coordinates */
+	__u16 col_start;
+};
+
+struct mt9p031_roi_set {
+	__u32 count;			/* 0, or 2 to MT9P031_ROI_MAX */
+	struct mt9p031_roi roi[MT9P031_ROI_MAX];
+};
+
+#define MT9P031_CMD_S_ROI		_IOW('V', BASE_VIDIOC_PRIVATE + 0x24, struct mt9p031_roi_set)
+
 
 /*
  * Our nominal (default) frame rate.
@@ -116,9 +359,150 @@ MODULE_LICENSE("GPL");
 /* Registers */
 
 
+/*
+ * Frame synchronous control queue.  Controls are held until the next
+ * FRAME_VALID rising edge on the CSI vsync line and written from the
+ * threaded half of that interrupt, so the write completes inside a frame
+ * and takes effect on the following one.
+ */
+#define MT9P031_FS_QUEUE_LEN	16
+
+struct mt9p031_fs_entry {
+	u32 id;
+	s32 value;
+	u32 write_frame;		/* Frame during which the write is issued */
+	u32 frame;			/* Frame the control becomes effective on */
+};
+
+/*
+ * Sensor timing as derived from the clock and window registers, see the
+ * "Frame Rate" and "PLL-Generated Master Clock" sections of the datasheet.
+ * Lengths are in PIXCLKs per row and rows per frame, blanking is whatever
+ * remains of them once the active window has been read out.
+ */
+struct mt9p031_timing {
+	u32 pixel_rate;			/* PIXCLK, Hz */
+	u32 width;			/* Active pixels per row */
+	u32 height;			/* Active rows per frame */
+	u32 line_length;		/* PIXCLKs per row (tROW) */
+	u32 frame_length;		/* Rows per frame (tFRAME / tROW) */
+	u32 hblank;			/* line_length - width */
+	u32 vblank;			/* frame_length - height */
+	u32 row_time_ns;
+	u32 frame_period_us;
+	u32 shutter_width;		/* SW, rows */
+	u32 exposure_ns;		/* tEXP */
+	u32 readout_ns;			/* First to last active row */
+};
+
+/* PLL factors as in the datasheet, PIXCLK = EXTCLK * m / (n * p1) */
+struct mt9p031_pll {
+	u32 m;
+	u32 n;
+	u32 p1;
+};
+
+/* A mode, clock and blanking combination chosen by mt9p031_solve() */
+struct mt9p031_config {
+	int mode;			/* Index into mt9p031_supported_formats */
+	struct mt9p031_pll pll;
+	u16 hblank;			/* REG_MT9P031_HBLANK */
+	u16 vblank;			/* REG_MT9P031_VBLANK */
+	struct mt9p031_timing timing;
+};
+
+/* Flicker detector accumulators, see mt9p031_s_row_means() */
+#define MT9P031_FLICKER_FRAMES		8	/* Reports per verdict */
+#define MT9P031_FLICKER_MIN_SCORE	10	/* Below this there is no flicker */
+#define MT9P031_FLICKER_VOTES		2	/* Verdicts in a row to switch */
+
+struct mt9p031_flicker {
+	s64 t0;				/* sof of the window's first report */
+	s64 i[2];			/* 100 Hz and 120 Hz correlations, Q14 */
+	s64 q[2];
+	u64 power;
+	u32 samples;
+	int frames;
+	int candidate;			/* Last verdict and how often in a row */
+	int votes;
+	u32 score[2];			/* Of the last window */
+	u32 windows;
+};
+
+/* What the vsync interrupt remembers about each frame start */
+#define MT9P031_FRAME_HISTORY	8
+
+struct mt9p031_frame_rec {
+	u32 sequence;
+	u32 exposure_ns;
+	u32 readout_ns;
+	s64 sof;
+	struct mt9p031_frame_settings settings;
+};
+
+/* What an operation cost on the bus, see mt9p031_bus_xfer() */
+struct mt9p031_bus_cost {
+	u32 xfers;			/* i2c messages, retries included */
+	u32 bytes;
+	u32 bits;			/* On the wire */
+	u32 delay_us;			/* Waited out in mdelay/msleep/udelay */
+};
+
+struct mt9p031_bus_stats {
+	u32 id;				/* Control ID, for controls */
+	const char *name;
+	u32 calls;
+	u32 over;			/* Runs over the budget */
+	struct mt9p031_bus_cost last;
+	struct mt9p031_bus_cost worst;
+};
+
+enum {
+	MT9P031_OP_PWR_ON,
+	MT9P031_OP_PWR_OFF,
+	MT9P031_OP_STBY_ON,
+	MT9P031_OP_STBY_OFF,
+	MT9P031_OP_INIT,
+	MT9P031_NUM_OPS
+};
+
+#define MT9P031_BUS_CTRLS	48
+
+/* A copy of the register map saved through debugfs */
+#define MT9P031_NUM_REGS	256
+#define MT9P031_SNAPSHOT_NAME	16
+#define MT9P031_MAX_SNAPSHOTS	8
+
+struct mt9p031_snapshot {
+	struct list_head list;
+	char name[MT9P031_SNAPSHOT_NAME];
+	u16 regs[MT9P031_NUM_REGS];
+};
+
 /*
  * Information we maintain about a known sensor.
  */
+enum mt9p031_image_size {
+	VGA_BIN_30FPS,
+	HDV_720P_30FPS,
+	//HDV_720P_60FPS,
+	//HDV_720P_60FPS_LVB,
+	HDV_1080P_30FPS,
+	MT9P031_THREE_MP,
+	MT9P031_2M5P,
+	MT9P031_2M7P,
+	MT9P031_FIVE_MP,
+	VGA_WIN_30FPS,
+	HDV_720P_WIN_30FPS,
+	MT9P031_NUM_MODES
+};
+
+/* Exposure and gains a mode starts with, see mt9p031_warm_start() */
+struct mt9p031_warm {
+	u32 shutter_width;		/* 0 = nothing saved */
+	u16 gain[4];			/* R0x2B-R0x2E */
+};
+
 struct sensor_format_struct;  /* coming later */
 __csi_subdev_info_t ccm_info_con = 
 {
@@ -143,13 +527,127 @@ struct sensor_info {
 	int vflip;
 	int gain;
 	int autogain;
-	int exp;
+	int exp;			/* Shutter width as fitted and written ... */
+	int exp_req;			/* ... and as asked for, refits start here */
 	enum v4l2_exposure_auto_type autoexp;
 	int autowb;
 	enum v4l2_whiteblance wb;
 	enum v4l2_colorfx clrfx;
 	enum v4l2_flash_mode flash_mode;
 	u8 clkrc;			/* Clock divider value */
+	int mode;			/* Index into mt9p031_supported_formats */
+	struct mt9p031_pll pll;		/* Clock and blanking for the mode */
+	u16 hblank;
+	u16 vblank;
+	struct v4l2_fract interval;	/* Requested through s_parm */
+	int low_latency;		/* Fastest frame whatever the interval */
+	int auto_fps;			/* Stretch the frame for long exposures ... */
+	int min_fps;			/* ... down to this rate */
+	u16 afr_vblank;			/* Stretched VBLANK, 0 = the solver's */
+	u32 afr_changes;
+	int power_line;			/* V4L2_CID_POWER_LINE_FREQUENCY */
+	int flicker_hz;			/* Mains frequency exposures follow, 0 = none */
+	int flicker_detected;		/* Detector verdict, 0 = none yet */
+	struct mt9p031_flicker flicker;
+	int metering;			/* V4L2_CID_MT9P031_METERING */
+	int ae_target;
+	struct mt9p031_metering meter;	/* Spot and grid weights */
+	u32 ae_level;			/* Last metered level */
+	u32 ae_steps;
+	int ae_oneshot;			/* Next step corrects in full */
+	struct mt9p031_warm warm[MT9P031_NUM_MODES];	/* Under fs_lock */
+	int warm_mode;			/* Mode the exposure was set up for, -1 = none */
+	struct mt9p031_roi roi[MT9P031_ROI_MAX];	/* Alternating windows ... */
+	int roi_count;			/* ... how many, 0 = off ... */
+	int roi_next;			/* ... and the one last written */
+	int roi_hold;			/* Its row start moved, keep it a frame longer */
+	u32 roi_switches;
+	int strobe_on;			/* Strobe_Enable as last written */
+	int strobe_invert;		/* Flash is active low, from flash_pol */
+	int strobe_width;		/* Flash pulse the shared window must fit, us */
+	u16 read_mode2;			/* Shadow of REG_MT9P031_READ_MODE2 */
+	u16 output_control;		/* Shadow of R0x07, Output_Control */
+	int test_pattern;		/* 0 = off, else Test_Pattern_Mode + 1 */
+	int tp_red;
+	int tp_green;
+	int tp_blue;
+	int tp_bar_width;
+	int blc_auto;			/* Black level calibration, see mt9p031_apply_blc() */
+	int blc_target;
+	int blc_analog_offset;
+	int blc_digital_offset;
+	int blc_sample_size;
+	int blc_settle_ratio;		/* Gain step that forces a recalculation, % */
+	u32 blc_recalcs;
+	struct v4l2_ctrl_handler hdl;
+	struct v4l2_ctrl *flip[2];	/* Clusters: hflip/vflip ... */
+	struct v4l2_ctrl *tp[5];	/* ... the test pattern controls ... */
+	struct v4l2_ctrl *blc[5];	/* ... the black level ones ... */
+	struct v4l2_ctrl *ae[3];	/* ... and auto exposure, exposure, gain */
+	int sync_depth;			/* Open Synchronize_Changes brackets */
+	struct mutex lock;		/* Serialises register writes of controls */
+	int vsync_irq;			/* 0 = not looked up yet, < 0 = unavailable */
+	int vsync_gpio;			/* Fallback line we requested, or -1 */
+	spinlock_t fs_lock;		/* Protects the frame counter and queue */
+	u32 frame_count;		/* FRAME_VALID rising edges seen */
+	int frame_sync;			/* Queue controls instead of writing them */
+	u32 fs_target;			/* Requested effective frame, 0 = next */
+	u32 fs_last_frame;		/* Effective frame of the last queued control */
+	u32 fs_late;			/* Writes drained after their frame */
+	struct mt9p031_fs_entry fs_queue[MT9P031_FS_QUEUE_LEN];
+	unsigned int fs_head;
+	unsigned int fs_count;
+	struct mt9p031_timing timing;	/* Last read back, for interrupt context */
+	u32 exp_pending_ns;		/* Exposure not yet reached the output */
+	u32 exp_pending_frame;
+	int exp_pending;
+	struct mt9p031_frame_rec frames[MT9P031_FRAME_HISTORY];
+	seqcount_t frames_seq;		/* For readers that do not take fs_lock */
+	struct mt9p031_frame_settings settings;	/* Of the frame being exposed */
+	struct mt9p031_frame_settings settings_next;	/* As last written */
+	int settings_pending;		/* 1 = gains/window, 2 = shutter width */
+	u32 settings_frame;		/* Frame the written gains/window reach */
+	u32 shutter_frame;		/* ... and the written shutter width */
+	u32 period_early_us;		/* Period from settings_frame on while the shutter is pending */
+	s64 period_min;			/* Frame start to frame start, ns */
+	s64 period_max;
+	s64 period_sum;
+	u32 period_count;
+	u32 host_sequence;		/* Frame of the last buffer the host took */
+	int host_seen;
+	u32 frames_received;
+	u32 frames_dropped;
+	struct dentry *debugfs;
+	struct video_device *node;	/* For the MT9P031_CMD_* ioctls */
+	int configured;			/* sensor_init() done since power on */
+	int standby;
+	int streaming;			/* Not held by Pause_Restart */
+	int powered;			/* Held up for the host, runtime PM reference */
+	int pm_up;			/* Sequences for runtime resume ... */
+	int pm_down;			/* ... and suspend */
+	int pm_then;			/* Run after pm_down on the same suspend, -1 = none */
+	struct list_head list;		/* On mt9p031_instances */
+	s64 stereo_skew_ns;		/* Frame start relative to the reference */
+	struct delayed_work wd_work;	/* Stall watchdog */
+	int wd_stage;			/* Recovery step taken last, MT9P031_WD_* */
+	u32 wd_last_count;		/* frame_count at the previous check */
+	ktime_t wd_stall;		/* When the stall was noticed */
+	s64 wd_outage_ns;		/* Stall to first frame, last recovery */
+	u32 wd_restarts;
+	u32 wd_resyncs;
+	u32 wd_power_cycles;
+	u32 wd_failures;
+	u32 i2c_retries[256];		/* Per register, attempts that were repeated */
+	u32 i2c_errors[256];		/* ... and accesses that gave up */
+	u8 i2c_last_reg;
+	int i2c_last_err;
+	struct list_head snapshots;	/* Saved register maps, mt9p031_snapshot */
+	int snapshot_count;
+	char diff_a[MT9P031_SNAPSHOT_NAME];	/* What "diff" compares, "" = live */
+	char diff_b[MT9P031_SNAPSHOT_NAME];
+	struct mt9p031_bus_cost bus;	/* Running totals */
+	struct mt9p031_bus_stats bus_ops[MT9P031_NUM_OPS];
+	struct mt9p031_bus_stats bus_ctrls[MT9P031_BUS_CTRLS];
 };
 
 static inline struct sensor_info *to_state(struct v4l2_subdev *sd)
@@ -184,30 +682,36 @@ struct mt9p031_format_params {
 	int shutter_delay;
 	int row_bin;
 	int col_bin;
+	int window;		/* Full resolution crop for MT9P031_CMD_S_ROI */
 };
 
-enum mt9p031_image_size {
-	VGA_BIN_30FPS,
-	HDV_720P_30FPS,
-	//HDV_720P_60FPS,
-	//HDV_720P_60FPS_LVB,
-	HDV_1080P_30FPS,
-	MT9P031_THREE_MP,
-	MT9P031_2M7P,
-	MT9P031_FIVE_MP,
-};
+/*
+ * Windows are centred in the 2592x1944 active area, which starts at row 54,
+ * column 16 of the array.  Row starts are multiples of 2 * (Row_Bin + 1).
+ * Column starts are in the unmirrored form R0x02 asks for, multiples of
+ * 4 * (Column_Bin + 1); mt9p031_col_start() moves them for Mirror_Column.
+ * The windows at the end are the size of a binned mode and only used by
+ * MT9P031_CMD_S_ROI, lookups by size skip them.
+ * mt9p031_check_modes() holds the table to this.
+ */
+#define MT9P031_ACTIVE_ROW	54
+#define MT9P031_ACTIVE_COL	16
+#define MT9P031_ACTIVE_HEIGHT	1944
+#define MT9P031_ACTIVE_WIDTH	2592
 
 const struct mt9p031_format_params mt9p031_supported_formats[] = {
-	{ 640, 480, 64, 24, 1919, 2559, 0, 0, 0x0296,  0x0033, 0x0033, 0x0060, 0, 0, 3, 3 },  // VGA_BIN_30FPS
+	{ 640, 480, 64, 32, 1919, 2559, 0, 0, 0x0296,  0x0033, 0x0033, 0x0060, 0, 0, 3, 3 },  // VGA_BIN_30FPS
 	{ 1280, 720, 64, 24, 1439, 2559, 0, 0, 0x0296, 0x0011, 0x0011, 0x0060, 0, 0, 1, 1 },  // 720P_HD_30FPS
 	//	{ 1280, 720, 0x0040, 0x0018, 0x059F, 0x09FF, 0, 0, 0x0296, 0x0011, 0x0011, 0x0060, 0, 0, 1, 1 },  // 720P_HD_60FPS
 	//	{ 1280, 720, 0x0040, 0x0018, 0x059F, 0x09FF, 0, 0x02D0, 0x0296, 0x0011, 0x0011, 0x0060, 0, 0, 1, 1 },  // 720P_HD_60FPS_LVB
-	{ 1920, 1080, 431, 335, 1079, 1919, 0, 0x0037, 0x01AC, 0, 0, 0x0040, 0, 0, 0, 0 },	// 1080P_30FPS
-	{ 2048, 1536, 431, 335, 1535, 2047, 0, 0x0037, 0x01AC, 0, 0, 0x0040, 0, 0, 0, 0 },	// 3MP CAPTURE
+	{ 1920, 1080, 486, 352, 1079, 1919, 0, 0x0037, 0x01AC, 0, 0, 0x0040, 0, 0, 0, 0 },	// 1080P_30FPS
+	{ 2048, 1536, 258, 288, 1535, 2047, 0, 0x0037, 0x01AC, 0, 0, 0x0040, 0, 0, 0, 0 },	// 3MP CAPTURE
 	//	{ 2560, 1080, 486, 32, 1079, 2559, 0, 0x0008, 0x03C0, 0, 0, 0x0040, 0, 0, 0, 0 },	// 2M7P CAPTURE
-	{ 2280, 1080, 431, 15, 1079, 2279, 0, 0x0008, 720, 0, 0, 0x0040, 0, 0, 0, 0},
-	{ 2560, 1080, 431, 15, 1079, 2559, 0, 0x0008, 720, 0, 0, 0x0040, 0, 0, 0, 0 },	// 2M7P CAPTURE
-	{ 2592, 1944, 431, 335, 1943, 2591, 0, 0x0037, 0x01AC, 0, 0, 0x0040, 0, 0, 0, 0 },	// 5MP CAPTURE
+	{ 2280, 1080, 486, 172, 1079, 2279, 0, 0x0008, 720, 0, 0, 0x0040, 0, 0, 0, 0},	// 2M5P CAPTURE
+	{ 2560, 1080, 486, 32, 1079, 2559, 0, 0x0008, 720, 0, 0, 0x0040, 0, 0, 0, 0 },	// 2M7P CAPTURE
+	{ 2592, 1944, 54, 16, 1943, 2591, 0, 0x0037, 0x01AC, 0, 0, 0x0040, 0, 0, 0, 0 },	// 5MP CAPTURE
+	{ 640, 480, 786, 992, 479, 639, 0, 0x0037, 0x01AC, 0, 0, 0x0040, 0, 0, 0, 0, 1 },	// VGA_WIN_30FPS
+	{ 1280, 720, 666, 672, 719, 1279, 0, 0x0037, 0x01AC, 0, 0, 0x0040, 0, 0, 0, 0, 1 },	// 720P_WIN_30FPS
 };
 
 static struct regval sensor_default_regs[] = {
@@ -247,8 +751,7 @@ static struct regval sensor_default_regs[] = {
 {{0x000C}, {0x0000}},		//Shutter Delay = 0
 
 //REG = 0x0035, 0x000A // Recommended minimum gain is 1.25
-//REG = 0x0049, 0x0000 	// 0x00A8 adding BLC
-//REG = 0x005B, 0x0007 	// 0x0007 sampling size BLC
+// BLC target (0x49) and sample size (0x5B) are programmed by mt9p031_apply_blc()
  
 {{0x004F}, {0x0011}}, 	// RESERVED_CORE_4F
 {{0x0029}, {0x0481}}, 	// RESERVED_CORE_29
@@ -281,7 +784,7 @@ static struct regval sensor_default_regs[] = {
 {{0x003f}, {0x0007}},		//Reserved
 {{0x0041}, {0x0003}},		//Reserved
 {{0x0048}, {0x0018}},		//Reserved
-{{0x005f}, {0x1c16}},		//Reserved
+{{0x005f}, {0x1c16}},		//BLC target thresholds
 {{0x0057}, {0x0002}},		//Reserved
 {{0x004F}, {0x0011}},		//Reserved
 
@@ -659,94 +1162,240 @@ static struct regval_list sensor_fmt_raw[] = {
  *
  */
 
+/*
+ * Register access retries a failed transfer a few times, 50us apart and
+ * doubling, so a NACK from noise on the cable costs a little latency and
+ * not the whole operation.  Retries and final failures are counted per
+ * register for debugfs.
+ */
+static unsigned int i2c_retries = 3;
+module_param(i2c_retries, uint, 0644);
+MODULE_PARM_DESC(i2c_retries, "Extra attempts for a failed register access");
+
+/* Power on / soft reset values of the registers frames are tagged with */
+static void mt9p031_settings_reset(struct mt9p031_frame_settings *s)
+{
+	memset(s, 0, sizeof(*s));
+	s->shutter_width = 0x0797;
+	s->gain[0] = s->gain[1] = s->gain[2] = s->gain[3] = 0x0008;
+	s->row_start = 0x0036;
+	s->col_start = 0x0010;
+	s->height = 1944;
+	s->width = 2592;
+}
 
 /*
- * On most platforms, we'd rather do straight i2c I/O.
+ * Follow the writes that change what a frame is tagged with.  Gains and
+ * the window apply from the next frame start, a new shutter width from
+ * the one after (see mt9p031_refresh_timing()).  A new Row_Start or
+ * window size also spoils the frame it lands on.
  */
-static int sensor_read(struct v4l2_subdev *sd, unsigned char *reg,
-		unsigned char *value)
+static void mt9p031_track_write(const struct i2c_client *client, u8 reg, u16 val)
 {
-	struct i2c_client *client = v4l2_get_subdevdata(sd);
-	u8 data[REG_STEP];
-	struct i2c_msg msg;
-	int ret,i;
-	
-	for(i = 0; i < REG_ADDR_STEP; i++)
-		data[i] = reg[i];
-	
-	data[REG_ADDR_STEP] = 0xff;
-	/*
-	 * Send out the register address...
-	 */
-	msg.addr = client->addr;
-	msg.flags = 0;
-	msg.len = REG_ADDR_STEP;
-	msg.buf = data;
-	ret = i2c_transfer(client->adapter, &msg, 1);
-	if (ret < 0) {
-		csi_dev_err("Error %d on register write\n", ret);
-		return ret;
-	}
-	/*
-	 * ...then read back the result.
-	 */
-	
-	msg.flags = I2C_M_RD;
-	msg.len = REG_DATA_STEP;
-	msg.buf = &data[REG_ADDR_STEP];
-	
-	ret = i2c_transfer(client->adapter, &msg, 1);
-	if (ret >= 0) {
-		for(i = 0; i < REG_DATA_STEP; i++)
-			value[i] = data[i+REG_ADDR_STEP];
-		ret = 0;
+	struct v4l2_subdev *sd = i2c_get_clientdata(client);
+	struct sensor_info *info;
+	struct mt9p031_frame_settings *s;
+	unsigned long flags;
+	int shutter = 0;
+
+	if (sd == NULL)
+		return;
+	info = to_state(sd);
+	s = &info->settings_next;
+
+	spin_lock_irqsave(&info->fs_lock, flags);
+	switch (reg) {
+	case REG_MT9P031_ROWSTART:
+		if (s->row_start != val)
+			s->flags |= MT9P031_FRAME_BAD;
+		s->row_start = val;
+		break;
+	case REG_MT9P031_COLSTART:
+		s->col_start = val;
+		break;
+	case REG_MT9P031_HEIGHT:
+		if (s->height != val + 1)
+			s->flags |= MT9P031_FRAME_BAD;
+		s->height = val + 1;
+		break;
+	case REG_MT9P031_WIDTH:
+		if (s->width != val + 1)
+			s->flags |= MT9P031_FRAME_BAD;
+		s->width = val + 1;
+		break;
+	case REG_MT9P031_SHUTTER_WIDTH_U:
+		s->shutter_width = (s->shutter_width & 0xffff) | (val << 16);
+		shutter = 1;
+		break;
+	case REG_MT9P031_SHUTTER_WIDTH_L:
+		s->shutter_width = (s->shutter_width & ~0xffff) | val;
+		shutter = 1;
+		break;
+	case REG_MT9P031_GREEN_1_GAIN:
+	case REG_MT9P031_BLUE_GAIN:
+	case REG_MT9P031_RED_GAIN:
+	case REG_MT9P031_GREEN_2_GAIN:
+		s->gain[reg - REG_MT9P031_GREEN_1_GAIN] = val;
+		break;
+	case REG_MT9P031_GLOBAL_GAIN:
+		s->gain[0] = s->gain[1] = s->gain[2] = s->gain[3] = val;
+		break;
+	case REG_MT9P031_RESET:
+		if (val & 1) {
+			mt9p031_settings_reset(s);
+			info->settings = *s;
+			info->settings_pending = 0;
+		}
+		spin_unlock_irqrestore(&info->fs_lock, flags);
+		return;
+	default:
+		spin_unlock_irqrestore(&info->fs_lock, flags);
+		return;
 	}
-	else {
-		csi_dev_err("Error %d on register read\n", ret);
+	if (shutter) {
+		info->shutter_frame = info->frame_count + 2;
+		info->settings_pending |= 2;
+	} else {
+		info->settings_frame = info->frame_count + 1;
+		info->settings_pending |= 1;
 	}
-	return ret;
+	spin_unlock_irqrestore(&info->fs_lock, flags);
+}
+
+/*
+ * Bus cost accounting.  Register accesses and the delays the driver
+ * waits out are added to a running total; power transitions, sensor_init()
+ * and each control take the difference over their run and compare it
+ * with mt9p031_bus_budgets[].  Bus time is modelled from the bits on the
+ * wire, 9 per byte including the address byte, plus START and STOP.
+ * The totals are only bumped and measured with info->lock held, so a
+ * measurement sees its own traffic and nothing from the vsync thread or
+ * the watchdog.
+ */
+static void mt9p031_bus_xfer(const struct i2c_client *client, int len)
+{
+	struct v4l2_subdev *sd = i2c_get_clientdata(client);
+	struct sensor_info *info;
+
+	if (sd == NULL)
+		return;
+	info = to_state(sd);
+	info->bus.xfers++;
+	info->bus.bytes += len;
+	info->bus.bits += 9 * (len + 1) + 2;
 }
 
+static void mt9p031_mdelay(struct sensor_info *info, unsigned int ms)
+{
+	mdelay(ms);
+	info->bus.delay_us += ms * 1000;
+}
 
-static int sensor_write(struct v4l2_subdev *sd, unsigned char *reg,
-		unsigned char *value)
+static void mt9p031_msleep(struct sensor_info *info, unsigned int ms)
 {
-	struct i2c_client *client = v4l2_get_subdevdata(sd);
-	struct i2c_msg msg;
-	unsigned char data[REG_STEP];
-	int ret,i;
-	
-	for(i = 0; i < REG_ADDR_STEP; i++)
-			data[i] = reg[i];
-	for(i = REG_ADDR_STEP; i < REG_STEP; i++)
-			data[i] = value[i-REG_ADDR_STEP];
-		
-	msg.addr = client->addr;
-	msg.flags = 0;
-	msg.len = REG_STEP;
-	msg.buf = data;
+	msleep(ms);
+	info->bus.delay_us += ms * 1000;
+}
 
-	
-	ret = i2c_transfer(client->adapter, &msg, 1);
-	if (ret > 0) {
-		ret = 0;
+/*
+ * What each operation may cost.  The power sequences wait 120, 80, 80 and
+ * 70 ms with all three regulators present, the figures leave 20 ms or
+ * more on top of that; a change that needs more has to raise them here.
+ */
+static const struct mt9p031_bus_budget {
+	const char *name;
+	u32 xfers;
+	u32 delay_ms;
+} mt9p031_bus_budgets[MT9P031_NUM_OPS] = {
+	[MT9P031_OP_PWR_ON]	= { "power on",		0,	150 },
+	[MT9P031_OP_PWR_OFF]	= { "power off",	0,	100 },
+	[MT9P031_OP_STBY_ON]	= { "standby on",	0,	100 },
+	[MT9P031_OP_STBY_OFF]	= { "standby off",	0,	90 },
+	[MT9P031_OP_INIT]	= { "init",		160,	260 },
+};
+
+/* Any one control, a frame synchronised write included */
+static const struct mt9p031_bus_budget mt9p031_ctrl_budget = { "control", 40, 2 };
+
+static void mt9p031_bus_end(struct sensor_info *info, struct mt9p031_bus_stats *st,
+			    const struct mt9p031_bus_budget *budget,
+			    const struct mt9p031_bus_cost *start)
+{
+	struct mt9p031_bus_cost c;
+
+	c.xfers = info->bus.xfers - start->xfers;
+	c.bytes = info->bus.bytes - start->bytes;
+	c.bits = info->bus.bits - start->bits;
+	c.delay_us = info->bus.delay_us - start->delay_us;
+
+	if (st->name == NULL)
+		st->name = budget->name;
+	st->calls++;
+	st->last = c;
+	st->worst.xfers = max(st->worst.xfers, c.xfers);
+	st->worst.bytes = max(st->worst.bytes, c.bytes);
+	st->worst.bits = max(st->worst.bits, c.bits);
+	st->worst.delay_us = max(st->worst.delay_us, c.delay_us);
+
+	if (c.xfers <= budget->xfers && c.delay_us <= budget->delay_ms * 1000)
+		return;
+	if (st->over++ == 0)
+		csi_dev_err("%s: %u transfers, %u us of delays, budget %u and %u ms\n",
+			    st->name, c.xfers, c.delay_us, budget->xfers, budget->delay_ms);
+}
+
+/* The slot a control is counted in, NULL once they are all taken */
+static struct mt9p031_bus_stats *mt9p031_bus_ctrl(struct sensor_info *info,
+						  struct v4l2_ctrl *ctrl)
+{
+	int i;
+
+	for (i = 0; i < MT9P031_BUS_CTRLS; i++) {
+		struct mt9p031_bus_stats *st = &info->bus_ctrls[i];
+
+		if (st->name == NULL) {
+			st->id = ctrl->id;
+			st->name = ctrl->name;
+		}
+		if (st->id == ctrl->id)
+			return st;
+	}
+	return NULL;
+}
+
+/* Back off and return 1 for another go, or count the failure and return 0 */
+static int mt9p031_i2c_retry(const struct i2c_client *client, u8 reg, int attempt, int err)
+{
+	struct v4l2_subdev *sd = i2c_get_clientdata(client);
+	struct sensor_info *info = sd ? to_state(sd) : NULL;
+
+	if (attempt >= i2c_retries) {
+		if (info) {
+			info->i2c_errors[reg]++;
+			info->i2c_last_reg = reg;
+			info->i2c_last_err = err;
+		}
+		return 0;
 	}
-	else if (ret < 0) {
-		csi_dev_err("sensor_write error!\n");
+	if (info) {
+		info->i2c_retries[reg]++;
+		info->bus.delay_us += min(50 << attempt, 1000);
 	}
-	return ret;
+	udelay(min(50 << attempt, 1000));
+	return 1;
 }
 
 static int mt9p031_reg_write(const struct i2c_client *client,u16 command, u16 data)
 {	
 	struct i2c_msg msg;
 	u8 buf[3];
+	int attempt;
 	int ret;
 
 	// 8-bit/ byte addressable register
 	buf[0] = command & 0xff;
-	data = swab16(data);
-	memcpy(buf + 1, &data,    2);
+	buf[1] = data >> 8;
+	buf[2] = data & 0xff;
 	msg.addr  = client->addr;
 	msg.flags = 0;
 	msg.len   = 3;
@@ -755,100 +1404,154 @@ static int mt9p031_reg_write(const struct i2c_client *client,u16 command, u16 da
 	* i2c_transfer return message length,
 	* but this function should return 0 if correct case
 	*/	
-	ret = i2c_transfer(client->adapter, &msg, 1);
-	printk(KERN_ERR "%s:ret = %d\n",__func__,ret);
-	if (ret >= 0)
-		ret = 0;
-	
+	for (attempt = 0; ; attempt++) {
+		ret = i2c_transfer(client->adapter, &msg, 1);
+		mt9p031_bus_xfer(client, msg.len);
+		if (ret == 1) {
+			mt9p031_track_write(client, buf[0], data);
+			return 0;
+		}
+		if (ret >= 0)
+			ret = -EIO;
+		if (!mt9p031_i2c_retry(client, buf[0], attempt, ret))
+			break;
+	}
+	csi_dev_err("write 0x%04x to reg 0x%02x failed %d\n", data, buf[0], ret);
 	return ret;
 }
-
 static int mt9p031_reg_read(const struct i2c_client *client, u16 command, u16 *val)
 {	
 	struct i2c_msg msg[2];
+	u8 reg = command & 0xff;
 	u8 buf[2];
+	int attempt;
 	int ret;
 
 	// 8-bit/ byte addressable register
-	buf[0] = command & 0xff;
 	msg[0].addr  = client->addr;
 	msg[0].flags = 0;
 	msg[0].len   = 1;
-	msg[0].buf   = buf ;
-	ret = i2c_transfer(client->adapter, &msg[0], 1);
-	if(ret >= 0) {
-		msg[1].addr  = client->addr;
-		msg[1].flags = I2C_M_RD;//1
-		msg[1].len   = 2;
-		msg[1].buf   = buf;
-		ret = i2c_transfer(client->adapter, &msg[1], 1);
-	}	
-
-	/*
-	* if return value of this function is < 0,
-	* it mean error.
-	* else, under 16bit is valid data.
-	*/
-	if(ret >= 0) {
-		*val = 0;
-		*val = buf[1] + (buf[0] << 8);
-		return 0;
+	msg[0].buf   = &reg;
+	msg[1].addr  = client->addr;
+	msg[1].flags = I2C_M_RD;//1
+	msg[1].len   = 2;
+	msg[1].buf   = buf;
+	for (attempt = 0; ; attempt++) {
+		ret = i2c_transfer(client->adapter, &msg[0], 1);
+		mt9p031_bus_xfer(client, msg[0].len);
+		if (ret == 1) {
+			ret = i2c_transfer(client->adapter, &msg[1], 1);
+			mt9p031_bus_xfer(client, msg[1].len);
+		}
+		if (ret == 1) {
+			*val = buf[1] + (buf[0] << 8);
+			return 0;
+		}
+		if (ret >= 0)
+			ret = -EIO;
+		if (!mt9p031_i2c_retry(client, reg, attempt, ret))
+			break;
 	}
-	printk(KERN_ERR "read from offset 0x%x error %d", command, ret);
+	csi_dev_err("read from reg 0x%02x failed %d\n", reg, ret);
 	return ret;
 }
 
 /*
- * Write a list of register settings;
+ * A register that still fails after the retries stops the table there.
+ * After a pause for the bus the write carries on from that entry, not
+ * from the start, a couple of times before the error is passed up.
  */
-static int sensor_write_array(struct v4l2_subdev *sd, struct regval_list *vals , uint size)
+static unsigned int i2c_resumes = 2;
+module_param(i2c_resumes, uint, 0644);
+MODULE_PARM_DESC(i2c_resumes, "Times a register table write resumes at the entry that failed");
+
+/*
+ * Read @count registers from @command on in one transfer, the sensor
+ * steps the register address after each value.  Used for dumps, where
+ * the 256 registers then take a handful of transactions instead of 512.
+ */
+#define MT9P031_BURST_REGS	32
+
+static int mt9p031_reg_read_burst(const struct i2c_client *client, u8 command,
+				  u16 *vals, int count)
 {
-	int i,ret;
-	struct i2c_client *client = v4l2_get_subdevdata(sd);
-	
-	if (size == 0)
+	struct i2c_msg msg[2];
+	u8 reg = command;
+	u8 buf[2 * MT9P031_BURST_REGS];
+	int attempt;
+	int ret, i;
+
+	if (count <= 0 || count > MT9P031_BURST_REGS)
 		return -EINVAL;
-	
-	for(i = 0; i < size ; i++)
-	{
-		if(vals->reg_num[0] == 0xff)
-			mdelay(vals->value[1] * 256 + vals->value[0]);
-		else {	
-			ret = sensor_write(sd, vals->reg_num, vals->value);
-			//ret = mt9p031_reg_write(client,vals->reg_num,vals->value);
-			if (ret < 0)
-				{
-					csi_dev_err("sensor_write_err!\n");
-					return ret;
-			}
+	msg[0].addr  = client->addr;
+	msg[0].flags = 0;
+	msg[0].len   = 1;
+	msg[0].buf   = &reg;
+	msg[1].addr  = client->addr;
+	msg[1].flags = I2C_M_RD;
+	msg[1].len   = 2 * count;
+	msg[1].buf   = buf;
+	for (attempt = 0; ; attempt++) {
+		/* two transfers as in mt9p031_reg_read() */
+		ret = i2c_transfer(client->adapter, &msg[0], 1);
+		mt9p031_bus_xfer(client, msg[0].len);
+		if (ret == 1) {
+			ret = i2c_transfer(client->adapter, &msg[1], 1);
+			mt9p031_bus_xfer(client, msg[1].len);
 		}
-		vals++;
+		if (ret == 1) {
+			for (i = 0; i < count; i++)
+				vals[i] = (buf[2 * i] << 8) | buf[2 * i + 1];
+			return 0;
+		}
+		if (ret >= 0)
+			ret = -EIO;
+		if (!mt9p031_i2c_retry(client, reg, attempt, ret))
+			break;
 	}
+	csi_dev_err("burst read of %d from reg 0x%02x failed %d\n", count, reg, ret);
+	return ret;
+}
 
+/* The whole map, 0x00-0xff */
+static int mt9p031_read_map(const struct i2c_client *client, u16 *regs)
+{
+	int reg, ret;
+
+	for (reg = 0; reg < MT9P031_NUM_REGS; reg += MT9P031_BURST_REGS) {
+		ret = mt9p031_reg_read_burst(client, reg, regs + reg, MT9P031_BURST_REGS);
+		if (ret < 0)
+			return ret;
+	}
 	return 0;
 }
 
 static int mt9p031_write_array(struct v4l2_subdev *sd, struct regval *vals , uint size)
 {
-	int i,ret;
+	int i = 0, ret, resumes = 0;
 	struct i2c_client *client = v4l2_get_subdevdata(sd);
 	
 	if (size == 0)
 		return -EINVAL;
 	
-	for(i = 0; i < size ; i++)
+	while (i < size)
 	{
-		if(vals->reg_num == 0xffff)
-			mdelay(vals->value);
-		else {	
-			ret = mt9p031_reg_write(client,vals->reg_num,vals->value);
-			if (ret < 0)
-				{
-					csi_dev_err("sensor_write_err!\n");
-					return ret;
+		if(vals[i].reg_num == 0xffff) {
+			mt9p031_mdelay(to_state(sd), vals[i].value);
+			i++;
+			continue;
+		}
+		ret = mt9p031_reg_write(client, vals[i].reg_num, vals[i].value);
+		if (ret < 0) {
+			if (resumes++ >= i2c_resumes) {
+				csi_dev_err("register table stopped at entry %d (reg 0x%02x)\n",
+					    i, vals[i].reg_num);
+				return ret;
 			}
+			mt9p031_msleep(to_state(sd), 1);
+			continue;
 		}
-		vals++;
+		i++;
 	}
 
 	return 0;
@@ -894,12 +1597,47 @@ static void csi_gpio_set_status(struct v4l2_subdev *sd, struct gpio_config *gpio
  * Stuff that knows about the sensor.
  */
  
-static int sensor_power(struct v4l2_subdev *sd, int on)
+/*
+ * Remember the exposure and gains of the current mode for the next time
+ * it starts.  The white balance is in the channel gains.
+ */
+static void mt9p031_warm_save(struct sensor_info *info)
 {
-	struct csi_dev *dev=(struct csi_dev *)dev_get_drvdata(sd->v4l2_dev->dev);
+	struct mt9p031_warm *w = &info->warm[info->mode];
+	unsigned long flags;
+
+	spin_lock_irqsave(&info->fs_lock, flags);
+	/* not what a strobe or the flicker rounding made of it */
+	w->shutter_width = info->exp_req ? info->exp_req : info->settings_next.shutter_width;
+	memcpy(w->gain, info->settings_next.gain, sizeof(w->gain));
+	spin_unlock_irqrestore(&info->fs_lock, flags);
+}
+
+/* The power sequences themselves, sensor_power() decides when they run */
+static int mt9p031_power_raw(struct v4l2_subdev *sd, int on)
+{
+	struct csi_dev *dev;
 	struct i2c_client *client = v4l2_get_subdevdata(sd);
+	struct sensor_info *info = to_state(sd);
+	struct mt9p031_bus_cost start;
+	int op;
 	
-	csi_dev_dbg("sensor_power on=0x%02x\n",on);
+	csi_dev_dbg("mt9p031_power_raw on=0x%02x\n",on);
+	if (on != CSI_SUBDEV_STBY_ON && on != CSI_SUBDEV_STBY_OFF &&
+	    on != CSI_SUBDEV_PWR_ON && on != CSI_SUBDEV_PWR_OFF)
+		return -EINVAL;
+	/* a late autosuspend after the host let go, its pins and clock are gone */
+	if (!sd->v4l2_dev)
+		return -ENODEV;
+	dev = (struct csi_dev *)dev_get_drvdata(sd->v4l2_dev->dev);
+	start = info->bus;
+	info->standby = (on == CSI_SUBDEV_STBY_ON);
+	/* an AE in userspace leaves what it converged to in the registers */
+	if (info->configured && info->autoexp != V4L2_EXPOSURE_AUTO &&
+	    (on == CSI_SUBDEV_STBY_ON || on == CSI_SUBDEV_PWR_OFF))
+		mt9p031_warm_save(info);
+	info->configured = 0;
+	info->warm_mode = -1;
   //make sure that no device can access i2c bus during sensor initial or power down
   //when using i2c_lock_adpater function, the following codes must not access i2c bus before calling i2c_unlock_adapter
   i2c_lock_adapter(client->adapter);
@@ -913,36 +1651,36 @@ static int sensor_power(struct v4l2_subdev *sd, int on)
 			//break;
 			//reset off io
 			//csi_gpio_write(sd,&dev->reset_io,CSI_RST_OFF);
-			mdelay(10);
+			mt9p031_mdelay(info, 10);
 			//standby on io
 			//csi_gpio_write(sd,&dev->standby_io,CSI_STBY_ON);
-			mdelay(20);
+			mt9p031_mdelay(info, 20);
 			csi_gpio_write(sd,&dev->standby_io,CSI_STBY_OFF);
-			mdelay(20);
+			mt9p031_mdelay(info, 20);
 			//csi_gpio_write(sd,&dev->standby_io,CSI_STBY_ON);
-			mdelay(20);
+			mt9p031_mdelay(info, 20);
 			//inactive mclk after stadby in
 			clk_disable(dev->csi_module_clk);
 			//reset on io
 			//csi_gpio_write(sd,&dev->reset_io,CSI_RST_ON);
-			mdelay(10);
+			mt9p031_mdelay(info, 10);
 			break;
 		case CSI_SUBDEV_STBY_OFF:
 			csi_dev_dbg("CSI_SUBDEV_STBY_OFF\n");
 			//break;
 			//active mclk before stadby out
 			clk_enable(dev->csi_module_clk);
-			mdelay(10);
+			mt9p031_mdelay(info, 10);
 			//standby off io
 			csi_gpio_write(sd,&dev->standby_io,CSI_STBY_ON);
-			mdelay(10);
+			mt9p031_mdelay(info, 10);
 			//reset off io
 			//csi_gpio_write(sd,&dev->reset_io,CSI_RST_OFF);
-			mdelay(10);
+			mt9p031_mdelay(info, 10);
 			//csi_gpio_write(sd,&dev->reset_io,CSI_RST_ON);
-			mdelay(20);
+			mt9p031_mdelay(info, 20);
 			//csi_gpio_write(sd,&dev->reset_io,CSI_RST_OFF);
-			mdelay(20);
+			mt9p031_mdelay(info, 20);
 			break;
 		case CSI_SUBDEV_PWR_ON:
 			csi_dev_dbg("CSI_SUBDEV_PWR_ON\n");
@@ -952,111 +1690,218 @@ static int sensor_power(struct v4l2_subdev *sd, int on)
 			//csi_gpio_write(sd,&dev->standby_io,CSI_STBY_ON);
 			//reset on io
 			csi_gpio_write(sd,&dev->reset_io,CSI_RST_ON);
-			mdelay(10);
+			mt9p031_mdelay(info, 10);
 			//active mclk before power on
 			clk_enable(dev->csi_module_clk);
-			mdelay(10);
+			mt9p031_mdelay(info, 10);
 			//power supply
 			csi_gpio_write(sd,&dev->power_io,CSI_PWR_ON);
-			mdelay(10);
+			mt9p031_mdelay(info, 10);
 			if(dev->dvdd) {
 				regulator_enable(dev->dvdd);
-				mdelay(10);
+				mt9p031_mdelay(info, 10);
 			}
 			if(dev->avdd) {
 				regulator_enable(dev->avdd);
-				mdelay(10);
+				mt9p031_mdelay(info, 10);
 			}
 			if(dev->iovdd) {
 				regulator_enable(dev->iovdd);
-				mdelay(10);
+				mt9p031_mdelay(info, 10);
 			}
 			//standby off io
 			//csi_gpio_write(sd,&dev->standby_io,CSI_STBY_OFF);
-			mdelay(10);
+			mt9p031_mdelay(info, 10);
 			//reset after power on
 			//csi_gpio_write(sd,&dev->reset_io,CSI_RST_OFF);
-			mdelay(10);
+			mt9p031_mdelay(info, 10);
 			//csi_gpio_write(sd,&dev->reset_io,CSI_RST_ON);
-			mdelay(20);
+			mt9p031_mdelay(info, 20);
 			csi_gpio_write(sd,&dev->reset_io,CSI_RST_OFF);
-			mdelay(20);
+			mt9p031_mdelay(info, 20);
+			mt9p031_track_write(client, REG_MT9P031_RESET, 1);
 			break;
 		case CSI_SUBDEV_PWR_OFF:
 			csi_dev_dbg("CSI_SUBDEV_PWR_OFF\n");
 			//standby and reset io
 			//csi_gpio_write(sd,&dev->standby_io,CSI_STBY_ON);
-			mdelay(20);
+			mt9p031_mdelay(info, 20);
 			csi_gpio_write(sd,&dev->reset_io,CSI_RST_ON);
-			mdelay(20);
+			mt9p031_mdelay(info, 20);
 			//power supply off
 			if(dev->iovdd) {
 				regulator_disable(dev->iovdd);
-				mdelay(10);
+				mt9p031_mdelay(info, 10);
 			}
 			if(dev->avdd) {
 				regulator_disable(dev->avdd);
-				mdelay(10);
+				mt9p031_mdelay(info, 10);
 			}
 			if(dev->dvdd) {
 				regulator_disable(dev->dvdd);
-				mdelay(10);	
+				mt9p031_mdelay(info, 10);	
 			}
 			csi_gpio_write(sd,&dev->power_io,CSI_PWR_OFF);
-			mdelay(10);
+			mt9p031_mdelay(info, 10);
 			//inactive mclk after power off
 			clk_disable(dev->csi_module_clk);
 			//set the io to hi-z
 			csi_gpio_set_status(sd,&dev->reset_io,0);//set the gpio to input
 			csi_gpio_set_status(sd,&dev->standby_io,0);//set the gpio to input
 			break;
-		default:
-			return -EINVAL;
 	}		
 
 	//remember to unlock i2c adapter, so the device can access the i2c bus again
 	i2c_unlock_adapter(client->adapter);	
+
+	op = on == CSI_SUBDEV_PWR_ON ? MT9P031_OP_PWR_ON :
+	     on == CSI_SUBDEV_PWR_OFF ? MT9P031_OP_PWR_OFF :
+	     on == CSI_SUBDEV_STBY_ON ? MT9P031_OP_STBY_ON : MT9P031_OP_STBY_OFF;
+	mt9p031_bus_end(info, &info->bus_ops[op], &mt9p031_bus_budgets[op], &start);
 	return 0;
 }
- 
-static int sensor_reset(struct v4l2_subdev *sd, u32 val)
+
+/* A power sequence serialised against sensor_init() and the watchdog */
+static int mt9p031_power(struct v4l2_subdev *sd, int on)
 {
-	struct csi_dev *dev=(struct csi_dev *)dev_get_drvdata(sd->v4l2_dev->dev);
-	
-	csi_dev_dbg("sensor_reset val =0x%02x \n",val);
+	struct sensor_info *info = to_state(sd);
+	int ret;
 
-	switch(val)
-	{
-		case CSI_SUBDEV_RST_OFF:
-			csi_dev_dbg("CSI_SUBDEV_RST_OFF\n");
-			csi_gpio_write(sd,&dev->reset_io,CSI_RST_OFF);
-			mdelay(10);
-			break;
-		case CSI_SUBDEV_RST_ON:
-			csi_dev_dbg("CSI_SUBDEV_RST_ON\n");
-			csi_gpio_write(sd,&dev->reset_io,CSI_RST_ON);
-			mdelay(10);
-			break;
-		case CSI_SUBDEV_RST_PUL:
-			csi_dev_dbg("CSI_SUBDEV_RST_PUL\n");
-			csi_gpio_write(sd,&dev->reset_io,CSI_RST_OFF);
-			mdelay(10);
-			csi_gpio_write(sd,&dev->reset_io,CSI_RST_ON);
-			mdelay(20);
-			csi_gpio_write(sd,&dev->reset_io,CSI_RST_OFF);
-			mdelay(20);
-			break;
-		default:
-			return -EINVAL;
-	}
-		
-	return 0;
+	mutex_lock(&info->lock);
+	ret = mt9p031_power_raw(sd, on);
+	mutex_unlock(&info->lock);
+	return ret;
 }
 
-static int sensor_detect(struct v4l2_subdev *sd)
+static int autosuspend_ms = 3000;
+module_param(autosuspend_ms, int, 0444);
+MODULE_PARM_DESC(autosuspend_ms, "Idle time before a closed sensor is really powered down (ms, -1 = never)");
+
+/*
+ * The host powers the sensor up on every open and down on every close.
+ * The way down is left to runtime PM and only happens once the sensor
+ * has been idle for the autosuspend delay, so a reopen in the meantime
+ * finds it powered and still configured and sensor_init() has nothing
+ * to do.  The sequence that eventually runs is the one the host asked
+ * for last, standby or power off.  A power off that arrives while the
+ * standby is still waiting for the delay is handed to the suspend
+ * callback, which runs both in order, rather than powering down behind
+ * runtime PM's back and having the timer power down again later.
+ * info->lock is taken per sequence and never across a runtime PM call,
+ * the callbacks take it themselves.
+ */
+static int sensor_power(struct v4l2_subdev *sd, int on)
 {
 	struct i2c_client *client = v4l2_get_subdevdata(sd);
-	s32 data = 0x0;
+	struct sensor_info *info = to_state(sd);
+	int ret;
+
+	csi_dev_dbg("sensor_power on=0x%02x\n",on);
+	if (!pm_runtime_enabled(&client->dev))
+		return mt9p031_power(sd, on);
+
+	switch (on) {
+	case CSI_SUBDEV_PWR_ON:
+	case CSI_SUBDEV_STBY_OFF:
+		/* already up, e.g. standby off right after power on */
+		if (info->powered)
+			return mt9p031_power(sd, on);
+		info->pm_up = on;
+		ret = pm_runtime_get_sync(&client->dev);
+		if (ret < 0) {
+			pm_runtime_put_noidle(&client->dev);
+			return ret;
+		}
+		info->powered = 1;
+		return 0;
+	case CSI_SUBDEV_PWR_OFF:
+	case CSI_SUBDEV_STBY_ON:
+		if (!info->powered) {
+			if (pm_runtime_status_suspended(&client->dev))
+				return mt9p031_power(sd, on);
+			info->pm_then = on;
+			ret = pm_runtime_suspend(&client->dev);
+			/* the timer got there first and only ran pm_down */
+			on = xchg(&info->pm_then, -1);
+			if (ret >= 0 && on >= 0)
+				ret = mt9p031_power(sd, on);
+			return ret < 0 ? ret : 0;
+		}
+		info->pm_down = on;
+		info->powered = 0;
+		pm_runtime_mark_last_busy(&client->dev);
+		pm_runtime_put_autosuspend(&client->dev);
+		return 0;
+	}
+	return -EINVAL;
+}
+
+static int mt9p031_runtime_suspend(struct device *dev)
+{
+	struct v4l2_subdev *sd = i2c_get_clientdata(to_i2c_client(dev));
+	struct sensor_info *info = to_state(sd);
+	int then;
+	int ret;
+
+	mutex_lock(&info->lock);
+	ret = mt9p031_power_raw(sd, info->pm_down);
+	then = xchg(&info->pm_then, -1);
+	if (ret == 0 && then >= 0)
+		ret = mt9p031_power_raw(sd, then);
+	mutex_unlock(&info->lock);
+	return ret;
+}
+
+static int mt9p031_runtime_resume(struct device *dev)
+{
+	struct v4l2_subdev *sd = i2c_get_clientdata(to_i2c_client(dev));
+
+	return mt9p031_power(sd, to_state(sd)->pm_up);
+}
+
+static const struct dev_pm_ops mt9p031_pm_ops = {
+	SET_RUNTIME_PM_OPS(mt9p031_runtime_suspend, mt9p031_runtime_resume, NULL)
+};
+ 
+static int sensor_reset(struct v4l2_subdev *sd, u32 val)
+{
+	struct csi_dev *dev=(struct csi_dev *)dev_get_drvdata(sd->v4l2_dev->dev);
+	struct sensor_info *info = to_state(sd);
+	
+	csi_dev_dbg("sensor_reset val =0x%02x \n",val);
+
+	switch(val)
+	{
+		case CSI_SUBDEV_RST_OFF:
+			csi_dev_dbg("CSI_SUBDEV_RST_OFF\n");
+			csi_gpio_write(sd,&dev->reset_io,CSI_RST_OFF);
+			mt9p031_mdelay(info, 10);
+			break;
+		case CSI_SUBDEV_RST_ON:
+			csi_dev_dbg("CSI_SUBDEV_RST_ON\n");
+			csi_gpio_write(sd,&dev->reset_io,CSI_RST_ON);
+			mt9p031_mdelay(info, 10);
+			break;
+		case CSI_SUBDEV_RST_PUL:
+			csi_dev_dbg("CSI_SUBDEV_RST_PUL\n");
+			csi_gpio_write(sd,&dev->reset_io,CSI_RST_OFF);
+			mt9p031_mdelay(info, 10);
+			csi_gpio_write(sd,&dev->reset_io,CSI_RST_ON);
+			mt9p031_mdelay(info, 20);
+			csi_gpio_write(sd,&dev->reset_io,CSI_RST_OFF);
+			mt9p031_mdelay(info, 20);
+			break;
+		default:
+			return -EINVAL;
+	}
+		
+	return 0;
+}
+
+static int sensor_detect(struct v4l2_subdev *sd)
+{
+	struct i2c_client *client = v4l2_get_subdevdata(sd);
+	s32 data = 0x0;
 
 
 	int ret;
@@ -1108,6 +1953,8 @@ static int sensor_detect(struct v4l2_subdev *sd)
 static enum mt9p031_image_size mt9p031_calc_size(unsigned int width)
 {
 	enum mt9p031_image_size isize;
+
+	BUILD_BUG_ON(ARRAY_SIZE(mt9p031_supported_formats) != MT9P031_NUM_MODES);
 	for (isize = VGA_BIN_30FPS; isize <= MT9P031_FIVE_MP; isize++)
 	{
 		if (mt9p031_supported_formats[isize].width >= width)
@@ -1118,6 +1965,71 @@ static enum mt9p031_image_size mt9p031_calc_size(unsigned int width)
 	return MT9P031_FIVE_MP;
 }
 
+/*
+ * The colour of the first pixel read out depends on where readout starts
+ * in the array.  Row_Start and Column_Start are rounded down to even values
+ * by the sensor, so the window start alone never changes the phase, but with
+ * row mirroring the readout begins at start + size and the sizes are always
+ * odd.  Column mirroring keeps the phase as long as Column_Start is in the
+ * mirrored form, which mt9p031_col_start() sees to.  The unmirrored phase is
+ * GRBG.
+ */
+static const enum v4l2_mbus_pixelcode mt9p031_bayer_codes[2][2] = {
+	/* [row phase][column phase] */
+	{ V4L2_MBUS_FMT_SGRBG8_1X8, V4L2_MBUS_FMT_SRGGB8_1X8 },
+	{ V4L2_MBUS_FMT_SBGGR8_1X8, V4L2_MBUS_FMT_SGBRG8_1X8 },
+};
+
+static enum v4l2_mbus_pixelcode mt9p031_bayer_code_regs(int row_start, int col_start,
+							 int row_size, int col_size,
+							 int col_bin, u16 read_mode2)
+{
+	int row = row_start & ~1;
+	int col = col_start & ~(2 * (col_bin + 1) - 1);
+
+	if (read_mode2 & MT9P031_READ_MODE2_ROW_MIRROR)
+		row += row_size | 1;
+
+	return mt9p031_bayer_codes[row & 1][col & 1];
+}
+
+static enum v4l2_mbus_pixelcode mt9p031_bayer_code(struct sensor_info *info)
+{
+	const struct mt9p031_format_params *mode = &mt9p031_supported_formats[info->mode];
+
+	return mt9p031_bayer_code_regs(mode->row_start, mode->col_start,
+				       mode->row_size, mode->col_size,
+				       (mode->col_addr_mode >> 4) & 0x3, info->read_mode2);
+}
+
+static int mt9p031_is_bayer(enum v4l2_mbus_pixelcode code)
+{
+	return code == V4L2_MBUS_FMT_SBGGR8_1X8 || code == V4L2_MBUS_FMT_SGBRG8_1X8 ||
+	       code == V4L2_MBUS_FMT_SGRBG8_1X8 || code == V4L2_MBUS_FMT_SRGGB8_1X8;
+}
+
+
+/*
+ * Column_Start as R0x02 wants it: 4n, 8n or 16n for no, 2x or 4x binning,
+ * plus half of that with Mirror_Column set.  Starts are kept in the
+ * unmirrored form and moved here on every write.
+ */
+static u16 mt9p031_col_start(struct sensor_info *info, int start, u16 read_mode2)
+{
+	const struct mt9p031_format_params *fp = &mt9p031_supported_formats[info->mode];
+
+	if (read_mode2 & MT9P031_READ_MODE2_COL_MIRROR)
+		start += 2 * (fp->col_bin + 1);
+	return start;
+}
+
+/* The column start in use, a window from MT9P031_CMD_S_ROI or the mode's */
+static int mt9p031_cur_col_start(struct sensor_info *info)
+{
+	if (info->roi_count)
+		return info->roi[info->roi_next].col_start;
+	return mt9p031_supported_formats[info->mode].col_start;
+}
 
 /** * mt9p031_set_params - sets register settings according to resolution
 * @client: pointer to standard i2c client
@@ -1128,1223 +2040,4521 @@ static int mt9p031_set_params(struct i2c_client *client, u32 width, u32 height)
 {	
 	//struct mt9p031_priv *priv = i2c_get_clientdata(client);
 	//struct v4l2_pix_format *pix = &priv->pix;
+	struct v4l2_subdev *sd = i2c_get_clientdata(client);
+	struct sensor_info *info = to_state(sd);
+	const struct mt9p031_format_params *fmt = &mt9p031_supported_formats[info->mode];
+	/* keep the mirror bits, they are owned by the flip controls */
+	u16 mode2 = fmt->read_mode_2_config |
+		(info->read_mode2 & (MT9P031_READ_MODE2_ROW_MIRROR | MT9P031_READ_MODE2_COL_MIRROR));
+	/* alternating windows keep going from the one last written */
+	const struct mt9p031_roi *roi = info->roi_count ? &info->roi[info->roi_next] : NULL;
+	struct regval regs[] = {
+		{ REG_MT9P031_ROWSTART, roi ? roi->row_start : fmt->row_start },	// ROW_WINDOW_START_REG
+		{ REG_MT9P031_COLSTART,					// COL_WINDOW_START_REG
+		  mt9p031_col_start(info, roi ? roi->col_start : fmt->col_start, mode2) },
+		{ REG_MT9P031_HEIGHT, fmt->row_size },			// ROW_WINDOW_SIZE_REG
+		{ REG_MT9P031_WIDTH, fmt->col_size },			// COL_WINDOW_SIZE_REG
+		{ REG_MT9P031_HBLANK, info->hblank },			// HORZ_BLANK, from mt9p031_solve()
+		{ REG_MT9P031_VBLANK, info->vblank },			// VERT_BLANK_REG, from mt9p031_solve()
+		{ REG_MT9P031_ROW_ADDR_MODE, fmt->row_addr_mode },	// ROW_MODE, ROW_SKIP, ROW_BIN
+		{ REG_MT9P031_COL_ADDR_MODE, fmt->col_addr_mode },	// COL_MODE, COL_SKIP, COL_BIN
+		{ REG_MT9P031_READ_MODE2, mode2 },			// READ_MODE_2, COL_SUM
+		{ REG_MT9P031_SHUTTER_WIDTH_U, fmt->shutter_width_hi },	// SHUTTER_WIDTH_HI
+		{ REG_MT9P031_SHUTTER_WIDTH_L, fmt->integ_time },	// SHUTTER_WIDTH_LOW (INTEG_TIME_REG)
+		{ REG_MT9P031_SHUTTER_DELAY,				// SHUTTER_DELAY_REG
+		  info->low_latency ? 0 : fmt->shutter_delay },
+	};
+	unsigned long flags;
 	int ret;
-	enum mt9p031_image_size i;
-	i = mt9p031_calc_size(2280);
-	//priv->pix.width = mt9p031_supported_formats[i].width;
-	//priv->pix.height = mt9p031_supported_formats[i].height;
-	ret = mt9p031_reg_write(client, REG_MT9P031_ROWSTART,mt9p031_supported_formats[i].row_start);// ROW_WINDOW_START_REG
-	ret |= mt9p031_reg_write(client, REG_MT9P031_COLSTART,mt9p031_supported_formats[i].col_start);// COL_WINDOW_START_REG
-	ret |= mt9p031_reg_write(client, REG_MT9P031_HEIGHT,mt9p031_supported_formats[i].row_size);// ROW_WINDOW_SIZE_REG=1439
-	ret |= mt9p031_reg_write(client, REG_MT9P031_WIDTH,mt9p031_supported_formats[i].col_size);// COL_WINDOW_SIZE_REG=2559
-	ret |= mt9p031_reg_write(client, REG_MT9P031_HBLANK,mt9p031_supported_formats[i].hblank);// HORZ_BLANK=0
-	ret |= mt9p031_reg_write(client, REG_MT9P031_VBLANK,mt9p031_supported_formats[i].vblank);// VERT_BLANK_REG=720
-	ret |= mt9p031_reg_write(client, REG_MT9P031_SHUTTER_WIDTH_L,0x0400);// SHUTTER_WIDTH_LOW (INTEG_TIME_REG = 1024)
-	ret |= mt9p031_reg_write(client, REG_MT9P031_ROW_ADDR_MODE,mt9p031_supported_formats[i].row_addr_mode);// ROW_MODE, ROW_SKIP=1, ROW_BIN=1
-	ret |= mt9p031_reg_write(client, REG_MT9P031_COL_ADDR_MODE,mt9p031_supported_formats[i].col_addr_mode);// COL_MODE, COL_SKIP=1, COL_BIN=1
-	ret |= mt9p031_reg_write(client, REG_MT9P031_READ_MODE2,mt9p031_supported_formats[i].read_mode_2_config);// READ_MODE_2, COL_SUM
-	ret |= mt9p031_reg_write(client, REG_MT9P031_SHUTTER_WIDTH_U,mt9p031_supported_formats[i].shutter_width_hi);// SHUTTER_WIDTH_HI
-	ret |= mt9p031_reg_write(client, REG_MT9P031_SHUTTER_WIDTH_L,mt9p031_supported_formats[i].integ_time);// SHUTTER_WIDTH_LOW (INTEG_TIME_REG)
-	ret |= mt9p031_reg_write(client, REG_MT9P031_SHUTTER_DELAY,mt9p031_supported_formats[i].shutter_delay);// SHUTTER_DELAY_REG
+
+	spin_lock_irqsave(&info->fs_lock, flags);
+	info->settings_next.roi = roi ? info->roi_next : 0;
+	spin_unlock_irqrestore(&info->fs_lock, flags);
+	ret = mt9p031_write_array(sd, regs, ARRAY_SIZE(regs));
+	if (ret >= 0)
+		info->read_mode2 = mode2;
 	return ret;
 }
 
-static u16 output_control = 0x1F82;
-
 static int mt9p031_set_output_control(struct v4l2_subdev *sd, u16 clear,u16 set)
 {
 	struct i2c_client *client = v4l2_get_subdevdata(sd);
-	u16 value = (output_control & ~clear) | set;
+	struct sensor_info *info = to_state(sd);
+	u16 value = (info->output_control & ~clear) | set;
 	int ret;
 	ret = mt9p031_reg_write(client, 0x07, value);
 	if (ret < 0)
 		return ret;
-	output_control = value;
+	info->output_control = value;
 	return 0;
 }
 
+static bool stream_on_init = 1;
+module_param(stream_on_init, bool, 0644);
+MODULE_PARM_DESC(stream_on_init, "Free-run once initialised instead of waiting for s_stream");
 
-static int mt9p031_init_camera(struct v4l2_subdev *sd)
+/*
+ * Start a new frame.  A sensor that is not streaming is held at row 0
+ * by Pause_Restart until s_stream lets it go.
+ */
+static int mt9p031_restart(struct v4l2_subdev *sd)
 {
 	struct i2c_client *client = v4l2_get_subdevdata(sd);
-	int ret;
-	
-	ret = mt9p031_reg_write(client, 0x0d, 0x0001);		// High
-	//ret = mt9p031_set_output_control(sd, 0,2);
-	mdelay(50);
-	ret |= mt9p031_reg_write(client, 0x0d, 0x0000);	// Low
-	mdelay(50);
+	u16 val = MT9P031_RESTART_RESTART;
 
-	ret |= mt9p031_reg_write(client, 0x10, 0x0051);		// PLL_CTRL; power up pll
-//	ret |= mt9p031_reg_write(client, REG_MT9P031_PLL_CONF1, 0x1801);	// PLL_CONFIG_1: m=24, n=1
-//	ret |= mt9p031_reg_write(client, REG_MT9P031_PLL_CONF2, 0x0002);	// PLL_CONFIG_2: p1=2, p2=0
-	ret |= mt9p031_reg_write(client, 0x11, 0x2503);		// PLL_CONFIG_1: m=25, n=4
-	ret |= mt9p031_reg_write(client, 0x12, 0x0002);		// PLL_CONFIG_2: p1=3
-	mdelay(10);  //wait 10 ms for VCO to lock
-	ret |= mt9p031_reg_write(client, 0x10, 0x0053);		// PLL_CONTROL; use PLL
-	ret |= mt9p031_reg_write(client, 0x07, 0x1F8E);
-	mdelay(200);
+	if (!to_state(sd)->streaming)
+		val |= MT9P031_RESTART_PAUSE;
+	return mt9p031_reg_write(client, REG_MT9P031_RESTART, val);
+}
 
-	ret |= mt9p031_reg_write(client, 0x002B, 0x0008);		// RESERVED_CORE_70
-	ret |= mt9p031_reg_write(client, 0x002C, 0x0008);		// RESERVED_CORE_71
-	ret |= mt9p031_reg_write(client, 0x002D, 0x0008);		// RESERVED_CORE_72
-	ret |= mt9p031_reg_write(client, 0x002E, 0x0008);		// RESERVED_CORE_73
-	ret |= mt9p031_reg_write(client, 0x0001, 0x01B0);		// RESERVED_CORE_74
-	ret |= mt9p031_reg_write(client, 0x0002, 0x0010);		// RESERVED_CORE_75
-	ret |= mt9p031_reg_write(client, 0x0003, 0x0437);		// RESERVED_CORE_76
-	ret |= mt9p031_reg_write(client, 0x0004, 0x077F);		// RESERVED_CORE_77
-	ret |= mt9p031_reg_write(client, 0x0005, 0x0030);		// RESERVED_CORE_78
-	ret |= mt9p031_reg_write(client, 0x0006, 0x0030);		// RESERVED_CORE_79
-	ret |= mt9p031_reg_write(client, 0x001E, 0x0006);		// RESERVED_CORE_7A
-	ret |= mt9p031_reg_write(client, 0x0020, 0x0040);		// RESERVED_CORE_7B
-	ret |= mt9p031_reg_write(client, 0x0022, 0x0000);		// RESERVED_CORE_7C
-	ret |= mt9p031_reg_write(client, 0x0023, 0x0000);		// RESERVED_CORE_7E
-	ret |= mt9p031_reg_write(client, 0x0008, 0x0000);		// RESERVED_CORE_7F
-	ret |= mt9p031_reg_write(client, 0x0009, 0x0300);		// RESERVED_CORE_29
-	ret |= mt9p031_reg_write(client, 0x000C, 0x0000);		// RESERVED_CORE_2A
-	ret |= mt9p031_reg_write(client, 0x004F, 0x0011);		// RESERVED_CORE_3E
-	ret |= mt9p031_reg_write(client, 0x0029, 0x0481);		// RESERVED_CORE_3F
-	ret |= mt9p031_reg_write(client, 0x003E, 0x0007);		// RESERVED_CORE_41
-	ret |= mt9p031_reg_write(client, 0x003F, 0x0007);		// RESERVED_CORE_48
-	ret |= mt9p031_reg_write(client, 0x0041, 0x0003);		// CAL_THRESHOLD
-	ret |= mt9p031_reg_write(client, 0x0048, 0x0018);		// RESERVED_CORE_57
+/*
+ * The PLL may only be reprogrammed in standby, so leave it alone unless
+ * the factors actually change.
+ */
+static int mt9p031_set_pll(struct v4l2_subdev *sd, const struct mt9p031_pll *pll)
+{
+	struct i2c_client *client = v4l2_get_subdevdata(sd);
+	u16 conf1 = (pll->m << 8) | (pll->n - 1);
+	u16 conf2 = pll->p1 - 1;
+	u16 ctrl, cur1, cur2;
+	int ret;
 
-	ret |= mt9p031_set_params(client,2280,1080);
-	
-	ret |= mt9p031_reg_write(client, 0x0057, 0x0002);		// RESERVED_CORE_78
-	ret |= mt9p031_reg_write(client, 0x002A, 0x7F72);		// RESERVED_CORE_79
-	ret |= mt9p031_reg_write(client, 0x001E, 0x0006);		// RESERVED_CORE_7A
-	
-	ret |= mt9p031_reg_write(client, 0x0070, 0x0079);		// RESERVED_CORE_70	
-	ret |= mt9p031_reg_write(client, 0x0071, 0x7800);		// RESERVED_CORE_71
-	ret |= mt9p031_reg_write(client, 0x0072, 0x7800);		// RESERVED_CORE_72
-	ret |= mt9p031_reg_write(client, 0x0073, 0x0300);		// RESERVED_CORE_73
-	ret |= mt9p031_reg_write(client, 0x0074, 0x0300);		// RESERVED_CORE_74
-	ret |= mt9p031_reg_write(client, 0x0075, 0x3C00);		// RESERVED_CORE_75
-	ret |= mt9p031_reg_write(client, 0x0076, 0x4E3D);		// RESERVED_CORE_76
-	ret |= mt9p031_reg_write(client, 0x0077, 0x4E3D);		// RESERVED_CORE_77
-	ret |= mt9p031_reg_write(client, 0x0078, 0x774F);		// RESERVED_CORE_78
-	ret |= mt9p031_reg_write(client, 0x0079, 0x7900);		// RESERVED_CORE_79
-	ret |= mt9p031_reg_write(client, 0x007A, 0x7900);		// RESERVED_CORE_7A
-	ret |= mt9p031_reg_write(client, 0x007B, 0x7800);		// RESERVED_CORE_7B
-	ret |= mt9p031_reg_write(client, 0x007C, 0x7800);		// RESERVED_CORE_7C
-	ret |= mt9p031_reg_write(client, 0x007E, 0x7800);		// RESERVED_CORE_7E
-	ret |= mt9p031_reg_write(client, 0x007F, 0x7800);		// RESERVED_CORE_7F
-	
-	ret |= mt9p031_reg_write(client, 0x0006, 0x0000);
-	ret |= mt9p031_reg_write(client, 0x0029, 0x0481);		// RESERVED_CORE_29
-	ret |= mt9p031_reg_write(client, 0x003E, 0x0087);		// RESERVED_CORE_3E
-	ret |= mt9p031_reg_write(client, 0x003F, 0x0007);		// RESERVED_CORE_3F
-	ret |= mt9p031_reg_write(client, 0x0041, 0x0003);		// RESERVED_CORE_41
-	ret |= mt9p031_reg_write(client, 0x0048, 0x0018);		// RESERVED_CORE_48
-	ret |= mt9p031_reg_write(client, 0x005F, 0x1C16);		// CAL_THRESHOLD
-	ret |= mt9p031_reg_write(client, 0x0057, 0x0002);		// RESERVED_CORE_57
-	
-	ret |= mt9p031_reg_write(client, 0x004F, 0x0011);		// RESERVED_CORE_57
+	ret = mt9p031_reg_read(client, REG_MT9P031_PLL_CTRL, &ctrl);
+	ret |= mt9p031_reg_read(client, REG_MT9P031_PLL_CONF1, &cur1);
+	ret |= mt9p031_reg_read(client, REG_MT9P031_PLL_CONF2, &cur2);
+	if (ret < 0)
+		return ret;
+	if ((ctrl & MT9P031_PLL_CTRL_USE_PLL) && cur1 == conf1 && (cur2 & 0x1f) == conf2)
+		return 0;
 
-	return ret>= 0 ? 0 : -EIO;
+	ret = mt9p031_set_output_control(sd, MT9P031_OUTPUT_CONTROL_CEN, 0);
+	ret |= mt9p031_reg_write(client, REG_MT9P031_PLL_CTRL,
+				 MT9P031_PLL_CTRL_DEF | MT9P031_PLL_CTRL_PWRUP);
+	ret |= mt9p031_reg_write(client, REG_MT9P031_PLL_CONF1, conf1);
+	ret |= mt9p031_reg_write(client, REG_MT9P031_PLL_CONF2, conf2);
+	mt9p031_msleep(to_state(sd), 1);	/* VCO lock */
+	ret |= mt9p031_reg_write(client, REG_MT9P031_PLL_CTRL,
+				 MT9P031_PLL_CTRL_DEF | MT9P031_PLL_CTRL_PWRUP |
+				 MT9P031_PLL_CTRL_USE_PLL);
+	ret |= mt9p031_set_output_control(sd, 0, MT9P031_OUTPUT_CONTROL_CEN);
+	/* the frame in flight when standby was entered is garbage */
+	ret |= mt9p031_restart(sd);
+	return ret;
 }
 
-
-static int sensor_init(struct v4l2_subdev *sd, u32 val)
+static int mt9p031_set_read_mode2(struct v4l2_subdev *sd, u16 clear, u16 set)
 {
+	struct i2c_client *client = v4l2_get_subdevdata(sd);
+	struct sensor_info *info = to_state(sd);
+	u16 value = (info->read_mode2 & ~clear) | set;
+	int held;
 	int ret;
+
+	/* Column_Start moves with Mirror_Column, both land on the same frame */
+	held = ((value ^ info->read_mode2) & MT9P031_READ_MODE2_COL_MIRROR) &&
+	       info->sync_depth == 0;
+	if (held)
+		mt9p031_set_output_control(sd, 0, MT9P031_OUTPUT_CONTROL_SYN);
+	ret = mt9p031_reg_write(client, REG_MT9P031_READ_MODE2, value);
+	if (ret >= 0 && ((value ^ info->read_mode2) & MT9P031_READ_MODE2_COL_MIRROR))
+		ret = mt9p031_reg_write(client, REG_MT9P031_COLSTART,
+					mt9p031_col_start(info, mt9p031_cur_col_start(info), value));
+	if (held)
+		mt9p031_set_output_control(sd, MT9P031_OUTPUT_CONTROL_SYN, 0);
+	if (ret < 0)
+		return ret;
+	info->read_mode2 = value;
+	return 0;
+}
+
+/*
+ * Program the test pattern generator from the cached settings.  The row-wise
+ * digital BLC adds a per-row offset that would break bit-exact patterns, so
+ * it is switched off while a pattern is active and restored afterwards.
+ */
+static int mt9p031_apply_test_pattern(struct v4l2_subdev *sd)
+{
 	struct i2c_client *client = v4l2_get_subdevdata(sd);
-	printk(KERN_ERR "sensor_init\n");
-	/*Make sure it is a target sensor*/
-	ret = sensor_detect(sd);
-	if (ret) {
-		csi_dev_err("chip found is not an target chip.\n");
+	struct sensor_info *info = to_state(sd);
+	u16 row_blc = mt9p031_supported_formats[info->mode].read_mode_2_config & MT9P031_READ_MODE2_ROW_BLC;
+	int ret;
+
+	if (info->test_pattern == 0) {
+		ret = mt9p031_reg_write(client, REG_MT9P031_TEST_PATTERN, 0);
+		ret |= mt9p031_reg_write(client, REG_MT9P031_ROW_BLACK_DEF_OFFSET,
+					 info->blc_digital_offset & 0x0fff);
+		ret |= mt9p031_set_read_mode2(sd, MT9P031_READ_MODE2_ROW_BLC, row_blc);
 		return ret;
 	}
-#if 0
-	ret = mt9p031_init_camera(sd);
-	if(ret!=0)
-	{
-		csi_dev_err("sensor_write_array fail\n");
+
+	ret = mt9p031_reg_write(client, REG_MT9P031_TEST_PATTERN_RED, info->tp_red);
+	ret |= mt9p031_reg_write(client, REG_MT9P031_TEST_PATTERN_GREEN, info->tp_green);
+	ret |= mt9p031_reg_write(client, REG_MT9P031_TEST_PATTERN_BLUE, info->tp_blue);
+	ret |= mt9p031_reg_write(client, REG_MT9P031_TEST_PATTERN_BAR_WIDTH, info->tp_bar_width);
+	ret |= mt9p031_set_read_mode2(sd, MT9P031_READ_MODE2_ROW_BLC, 0);
+	ret |= mt9p031_reg_write(client, REG_MT9P031_ROW_BLACK_DEF_OFFSET, 0);
+	ret |= mt9p031_reg_write(client, REG_MT9P031_TEST_PATTERN,
+				 ((info->test_pattern - 1) << MT9P031_TEST_PATTERN_SHIFT) |
+				 MT9P031_TEST_PATTERN_ENABLE);
+	return ret;
+}
+
+/*
+ * Program black level calibration from the cached settings.  In automatic
+ * mode the sensor tracks the dark rows towards the target by itself and
+ * the per colour offsets are its results, in manual mode they come from
+ * the analog offset control.  The digital offset is held at 0 while a
+ * test pattern runs, see above.
+ */
+static int mt9p031_apply_blc(struct v4l2_subdev *sd)
+{
+	struct i2c_client *client = v4l2_get_subdevdata(sd);
+	struct sensor_info *info = to_state(sd);
+	u16 offset = info->blc_analog_offset & 0x01ff;
+	int ret;
+
+	ret = mt9p031_reg_write(client, REG_MT9P031_ROW_BLACK_TARGET, info->blc_target);
+	ret |= mt9p031_reg_write(client, REG_MT9P031_BLC_SAMPLE_SIZE, info->blc_sample_size);
+	if (info->test_pattern == 0)
+		ret |= mt9p031_reg_write(client, REG_MT9P031_ROW_BLACK_DEF_OFFSET,
+					 info->blc_digital_offset & 0x0fff);
+	if (!info->blc_auto) {
+		ret |= mt9p031_reg_write(client, REG_MT9P031_GREEN_1_OFFSET, offset);
+		ret |= mt9p031_reg_write(client, REG_MT9P031_GREEN_2_OFFSET, offset);
+		ret |= mt9p031_reg_write(client, REG_MT9P031_RED_OFFSET, offset);
+		ret |= mt9p031_reg_write(client, REG_MT9P031_BLUE_OFFSET, offset);
 	}
-#else
-	ret = mt9p031_write_array(sd, sensor_default_regs , ARRAY_SIZE(sensor_default_regs));
-	if(ret!=0)
-	{
-		csi_dev_err("sensor_write_array fail\n");
+	ret |= mt9p031_reg_write(client, REG_MT9P031_BLACK_LEVEL_CALIBRATION,
+				 info->blc_auto ? 0 : MT9P031_BLC_MANUAL);
+	return ret;
+}
+
+/*
+ * Throw away the running black level average and calibrate from scratch.
+ * The offsets then settle within the next frame instead of creeping there
+ * over several, which is what a large analog gain step needs.
+ */
+static int mt9p031_blc_recalculate(struct v4l2_subdev *sd)
+{
+	struct i2c_client *client = v4l2_get_subdevdata(sd);
+	struct sensor_info *info = to_state(sd);
+	int ret;
+
+	if (!info->blc_auto)
+		return 0;
+	ret = mt9p031_reg_write(client, REG_MT9P031_BLACK_LEVEL_CALIBRATION,
+				MT9P031_BLC_RECALCULATE);
+	if (ret == 0)
+		info->blc_recalcs++;
+	return ret;
+}
+
+/*
+ * Register snapshot the timing is computed from, kept separate from the
+ * i2c access so the same arithmetic can be applied to candidate settings.
+ */
+struct mt9p031_timing_regs {
+	u16 pll_ctrl;
+	u16 pll_conf1;
+	u16 pll_conf2;
+	u16 pclk_ctrl;
+	u16 height;
+	u16 width;
+	u16 hblank;
+	u16 vblank;
+	u16 row_addr_mode;
+	u16 col_addr_mode;
+	u16 shutter_width_u;
+	u16 shutter_width_l;
+	u16 shutter_delay;
+};
+
+static void mt9p031_calc_timing(u32 extclk, const struct mt9p031_timing_regs *r,
+				struct mt9p031_timing *t)
+{
+	u32 row_skip = r->row_addr_mode & 0x7;
+	u32 row_bin = (r->row_addr_mode >> 4) & 0x3;
+	u32 col_skip = r->col_addr_mode & 0x7;
+	u32 col_bin = (r->col_addr_mode >> 4) & 0x3;
+	u32 hb, hb_min, vb, vb_min, sw, sd, so, row;
+	u64 clk = extclk;
+
+	if (r->pll_ctrl & MT9P031_PLL_CTRL_USE_PLL) {
+		clk *= (r->pll_conf1 >> 8) & 0xff;
+		do_div(clk, ((r->pll_conf1 & 0x3f) + 1) * ((r->pll_conf2 & 0x1f) + 1));
 	}
-	
-	ret |= mt9p031_set_params(client,2280,1080);
-	if(ret!=0)
-	{
-		csi_dev_err("mt9p031_set_params fail\n");
+	if (r->pclk_ctrl & MT9P031_PCLK_CTRL_DIVIDE_MASK)
+		do_div(clk, 2 * (r->pclk_ctrl & MT9P031_PCLK_CTRL_DIVIDE_MASK));
+	t->pixel_rate = clk;
+
+	/* W = 2 * ceil((Column_Size + 1) / (2 * (Column_Skip + 1))), H alike */
+	t->width = 2 * DIV_ROUND_UP(r->width + 1, 2 * (col_skip + 1));
+	t->height = 2 * DIV_ROUND_UP(r->height + 1, 2 * (row_skip + 1));
+
+	/* HBmin depends on row binning and the column bin dependent WDC */
+	hb = r->hblank + 1;
+	hb_min = 346 * (row_bin + 1) + 64 + 40 / (col_bin + 1);
+	row = t->width / 2 + max(hb, hb_min);
+	row = max_t(u32, row, 41 + 346 * (row_bin + 1) + 99);
+	t->line_length = 2 * row;
+
+	/* The frame is stretched when the shutter is longer than the window */
+	sw = max_t(u32, 1, (r->shutter_width_u << 16) | r->shutter_width_l);
+	vb = r->vblank + 1;
+	vb_min = (sw > t->height ? max_t(u32, 8, sw - t->height) : 8) + 1;
+	t->frame_length = t->height + max(vb, vb_min);
+
+	t->hblank = t->line_length - t->width;
+	t->vblank = t->frame_length - t->height;
+	t->shutter_width = sw;
+
+	if (t->pixel_rate == 0) {
+		t->row_time_ns = 0;
+		t->frame_period_us = 0;
+		t->exposure_ns = 0;
+		t->readout_ns = 0;
+		return;
 	}
-#endif
-	return ret;
+	clk = (u64)t->line_length * 1000000000;
+	do_div(clk, t->pixel_rate);
+	t->row_time_ns = clk;
+	clk = (u64)t->line_length * t->frame_length * 1000000;
+	do_div(clk, t->pixel_rate);
+	t->frame_period_us = clk;
+	clk = (u64)t->line_length * t->height * 1000000000;
+	do_div(clk, t->pixel_rate);
+	t->readout_ns = clk;
+
+	/* tEXP = SW * tROW - SO * 2 * tPIXCLK */
+	sd = r->shutter_delay + 1;
+	so = 208 * (row_bin + 1) + 98 + min_t(u32, sd, sw < 3 ? 1232 : 1504) - 94;
+	clk = (u64)sw * t->line_length;
+	clk = clk > 2 * so ? (clk - 2 * so) * 1000000000 : 0;
+	do_div(clk, t->pixel_rate);
+	t->exposure_ns = clk;
 }
 
-static long sensor_ioctl(struct v4l2_subdev *sd, unsigned int cmd, void *arg)
+/*
+ * Read back the live timing of the sensor.  Nothing is cached so the result
+ * follows whatever the mode tables, blanking and shutter writes left behind.
+ */
+static int mt9p031_get_timing(struct v4l2_subdev *sd, struct mt9p031_timing *t)
 {
-	int ret=0;
-	
-	switch(cmd){
-		case CSI_SUBDEV_CMD_GET_INFO: 
-		{
-			struct sensor_info *info = to_state(sd);
-			__csi_subdev_info_t *ccm_info = arg;
-			
-			csi_dev_dbg("CSI_SUBDEV_CMD_GET_INFO\n");
-			ccm_info->mclk 	=	info->ccm_info->mclk ;
-			ccm_info->vref 	=	info->ccm_info->vref ;
-			ccm_info->href 	=	info->ccm_info->href ;
-			ccm_info->clock	=	info->ccm_info->clock;
-			ccm_info->iocfg	=	info->ccm_info->iocfg;
-			csi_dev_dbg("ccm_info.mclk=%x\n ",info->ccm_info->mclk);
-			csi_dev_dbg("ccm_info.vref=%x\n ",info->ccm_info->vref);
-			csi_dev_dbg("ccm_info.href=%x\n ",info->ccm_info->href);
-			csi_dev_dbg("ccm_info.clock=%x\n ",info->ccm_info->clock);
-			csi_dev_dbg("ccm_info.iocfg=%x\n ",info->ccm_info->iocfg);
-			break;
-		}
-		case CSI_SUBDEV_CMD_SET_INFO:
-		{
-			struct sensor_info *info = to_state(sd);
-			__csi_subdev_info_t *ccm_info = arg;
-			
-			csi_dev_dbg("CSI_SUBDEV_CMD_SET_INFO\n");
-			info->ccm_info->mclk 	=	ccm_info->mclk 	;
-			info->ccm_info->vref 	=	ccm_info->vref 	;
-			info->ccm_info->href 	=	ccm_info->href 	;
-			info->ccm_info->clock	=	ccm_info->clock	;
-			info->ccm_info->iocfg	=	ccm_info->iocfg	;
-			csi_dev_dbg("ccm_info.mclk=%x\n ",info->ccm_info->mclk);
-			csi_dev_dbg("ccm_info.vref=%x\n ",info->ccm_info->vref);
-			csi_dev_dbg("ccm_info.href=%x\n ",info->ccm_info->href);
-			csi_dev_dbg("ccm_info.clock=%x\n ",info->ccm_info->clock);
-			csi_dev_dbg("ccm_info.iocfg=%x\n ",info->ccm_info->iocfg);
-			break;
-		}
-		default:
-			return -EINVAL;
-	}		
-		return ret;
+	struct i2c_client *client = v4l2_get_subdevdata(sd);
+	struct sensor_info *info = to_state(sd);
+	struct mt9p031_timing_regs r;
+	int ret;
+
+	ret = mt9p031_reg_read(client, REG_MT9P031_PLL_CTRL, &r.pll_ctrl);
+	ret |= mt9p031_reg_read(client, REG_MT9P031_PLL_CONF1, &r.pll_conf1);
+	ret |= mt9p031_reg_read(client, REG_MT9P031_PLL_CONF2, &r.pll_conf2);
+	ret |= mt9p031_reg_read(client, REG_MT9P031_PCLK_CTRL, &r.pclk_ctrl);
+	ret |= mt9p031_reg_read(client, REG_MT9P031_HEIGHT, &r.height);
+	ret |= mt9p031_reg_read(client, REG_MT9P031_WIDTH, &r.width);
+	ret |= mt9p031_reg_read(client, REG_MT9P031_HBLANK, &r.hblank);
+	ret |= mt9p031_reg_read(client, REG_MT9P031_VBLANK, &r.vblank);
+	ret |= mt9p031_reg_read(client, REG_MT9P031_ROW_ADDR_MODE, &r.row_addr_mode);
+	ret |= mt9p031_reg_read(client, REG_MT9P031_COL_ADDR_MODE, &r.col_addr_mode);
+	ret |= mt9p031_reg_read(client, REG_MT9P031_SHUTTER_WIDTH_U, &r.shutter_width_u);
+	ret |= mt9p031_reg_read(client, REG_MT9P031_SHUTTER_WIDTH_L, &r.shutter_width_l);
+	ret |= mt9p031_reg_read(client, REG_MT9P031_SHUTTER_DELAY, &r.shutter_delay);
+	if (ret < 0)
+		return -EIO;
+
+	mt9p031_calc_timing(info->ccm_info->mclk, &r, t);
+	return 0;
 }
 
+/*
+ * Refresh the copy of the timing the vsync interrupt works from.  A new
+ * shutter width only shows up in the frame read out two frames after the
+ * write, unless the sensor has just been restarted (@now).  A period
+ * change with the same exposure, VBLANK, shows up in the next frame.
+ */
+static void mt9p031_refresh_timing(struct v4l2_subdev *sd, int now)
+{
+	struct sensor_info *info = to_state(sd);
+	struct mt9p031_timing t;
+	unsigned long flags;
+	u32 exposure_ns;
+
+	if (mt9p031_get_timing(sd, &t) < 0)
+		return;
+
+	spin_lock_irqsave(&info->fs_lock, flags);
+	exposure_ns = info->timing.exposure_ns;
+	info->timing = t;
+	if (now) {
+		info->exp_pending = 0;
+		/* a restart begins with a whole frame */
+		info->settings_next.flags &= ~MT9P031_FRAME_BAD;
+		info->settings = info->settings_next;
+		info->settings_pending = 0;
+		info->period_early_us = 0;
+	} else if (t.exposure_ns != exposure_ns) {
+		info->timing.exposure_ns = exposure_ns;
+		info->exp_pending_ns = t.exposure_ns;
+		info->exp_pending_frame = info->frame_count + 2;
+		info->exp_pending = 1;
+	}
+	/* a longer shutter stretches the frame along with the exposure */
+	if (t.frame_period_us != info->settings_next.frame_period_us) {
+		info->settings_next.frame_period_us = t.frame_period_us;
+		if (now) {
+			info->settings.frame_period_us = t.frame_period_us;
+		} else if (t.exposure_ns != exposure_ns) {
+			info->shutter_frame = info->frame_count + 2;
+			info->settings_pending |= 2;
+		} else {
+			info->settings_frame = info->frame_count + 1;
+			info->settings_pending |= 1;
+			info->period_early_us = t.frame_period_us;
+		}
+	}
+	spin_unlock_irqrestore(&info->fs_lock, flags);
+}
 
 /*
- * Store information about the video data format. 
+ * The CSI samples the 8-bit bus once per PIXCLK, so PIXCLK is what has to
+ * stay within what the host can take.  The default is the 74MHz this board
+ * has always run at; the sensor itself goes up to 96MHz.
  */
-static struct sensor_format_struct {
-	__u8 *desc;
-	//__u32 pixelformat;
-	enum v4l2_mbus_pixelcode mbus_code;//linux-3.0
-	struct regval_list *regs;
-	int	regs_size;
-	int bpp;   /* Bytes per pixel */
-} sensor_formats[] = {
-	{
-		.desc		= "Raw RGB Bayer",
-		.mbus_code	= V4L2_MBUS_FMT_SBGGR8_1X8,//linux-3.0
-		.regs 		= sensor_fmt_raw,
-		.regs_size = ARRAY_SIZE(sensor_fmt_raw),
-		.bpp		= 1
-	},
-	{
-		.desc		= "YUYV 4:2:2",
-		.mbus_code	= V4L2_MBUS_FMT_YUYV8_2X8,//linux-3.0
-		.regs 		= sensor_fmt_yuv422_yuyv,
-		.regs_size = ARRAY_SIZE(sensor_fmt_yuv422_yuyv),
-		.bpp		= 2,
-	},
-	{
-		.desc		= "YVYU 4:2:2",
-		.mbus_code	= V4L2_MBUS_FMT_YVYU8_2X8,//linux-3.0
-		.regs 		= sensor_fmt_yuv422_yvyu,
-		.regs_size = ARRAY_SIZE(sensor_fmt_yuv422_yvyu),
-		.bpp		= 2,
-	},
-	{
-		.desc		= "UYVY 4:2:2",
-		.mbus_code	= V4L2_MBUS_FMT_UYVY8_2X8,//linux-3.0
-		.regs 		= sensor_fmt_yuv422_uyvy,
-		.regs_size = ARRAY_SIZE(sensor_fmt_yuv422_uyvy),
-		.bpp		= 2,
-	},
-	{
-		.desc		= "VYUY 4:2:2",
-		.mbus_code	= V4L2_MBUS_FMT_VYUY8_2X8,//linux-3.0
-		.regs 		= sensor_fmt_yuv422_vyuy,
-		.regs_size = ARRAY_SIZE(sensor_fmt_yuv422_vyuy),
-		.bpp		= 2,
-	},
+static unsigned int max_pixclk = 74000000;
+module_param(max_pixclk, uint, 0644);
+MODULE_PARM_DESC(max_pixclk, "Highest PIXCLK the CSI host can sample (Hz)");
 
-};
-#define N_FMTS ARRAY_SIZE(sensor_formats)
+static bool reject_unmet_rate;
+module_param(reject_unmet_rate, bool, 0644);
+MODULE_PARM_DESC(reject_unmet_rate, "Fail frame rates the bus cannot carry instead of clamping them");
 
+/*
+ * Fastest PIXCLK under @limit.  The datasheet wants 2MHz < EXTCLK / n <
+ * 13.5MHz, 180MHz < VCO < 360MHz and 16 <= m <= 255; p1 is kept even for
+ * a 50:50 system clock.  Smaller n wins a tie, for the larger PLL input.
+ */
+static int mt9p031_solve_pll(u32 extclk, u32 limit, struct mt9p031_pll *pll)
+{
+	u32 best = 0;
+	u32 n, m, p1;
+	u64 v;
+
+	for (n = 1; n <= 64; n++) {
+		if ((u64)extclk <= 2000000ULL * n || (u64)extclk * 2 >= 27000000ULL * n)
+			continue;
+		for (p1 = 2; p1 <= 32; p1 += 2) {
+			v = 360000000ULL * n - 1;
+			do_div(v, extclk);
+			m = min_t(u64, v, 255);
+			v = (u64)limit * n * p1;
+			do_div(v, extclk);
+			m = min_t(u64, v, m);
+			if (m < 16 || (u64)extclk * m <= 180000000ULL * n)
+				continue;
+			v = (u64)extclk * m;
+			do_div(v, n * p1);
+			if (v > best) {
+				best = v;
+				pll->m = m;
+				pll->n = n;
+				pll->p1 = p1;
+			}
+		}
+	}
+	return best ? 0 : -ERANGE;
+}
+
+static void mt9p031_config_timing(u32 extclk, struct mt9p031_config *cfg)
+{
+	const struct mt9p031_format_params *fp = &mt9p031_supported_formats[cfg->mode];
+	struct mt9p031_timing_regs r;
+
+	r.pll_ctrl = MT9P031_PLL_CTRL_DEF | MT9P031_PLL_CTRL_PWRUP | MT9P031_PLL_CTRL_USE_PLL;
+	r.pll_conf1 = (cfg->pll.m << 8) | (cfg->pll.n - 1);
+	r.pll_conf2 = cfg->pll.p1 - 1;
+	r.pclk_ctrl = 0;
+	r.height = fp->row_size;
+	r.width = fp->col_size;
+	r.hblank = cfg->hblank;
+	r.vblank = cfg->vblank;
+	r.row_addr_mode = fp->row_addr_mode;
+	r.col_addr_mode = fp->col_addr_mode;
+	r.shutter_width_u = fp->shutter_width_hi;
+	r.shutter_width_l = fp->integ_time;
+	r.shutter_delay = fp->shutter_delay;
+	mt9p031_calc_timing(extclk, &r, &cfg->timing);
+}
 
 /*
- * Then there is the issue of window sizes.  Try to capture the info here.
+ * Pick the fastest PIXCLK the bus allows for @mode and then pad the
+ * blanking until the frame takes @interval.  Vertical blanking is used
+ * first, it stops at 2047 rows and longer frames get longer rows as well.
+ * Returns -ERANGE when the rate cannot be reached and reject_unmet_rate
+ * is set, otherwise the fastest frame the mode can do.
  */
+static int mt9p031_solve_mode(u32 extclk, int mode,
+			      const struct v4l2_fract *interval, struct mt9p031_config *cfg)
+{
+	u64 target_ns, len;
+	u32 rows;
+	int ret;
 
+	cfg->mode = mode;
+	ret = mt9p031_solve_pll(extclk, max_pixclk, &cfg->pll);
+	if (ret < 0)
+		return ret;
 
-static struct sensor_win_size {
-	int	width;
-	int	height;
-	int	hstart;		/* Start/stop values for the camera.  Note */
-	int	hstop;		/* that they do not always make complete */
-	int	vstart;		/* sense to humans, but evidently the sensor */
-	int	vstop;		/* will do the right thing... */
-	struct regval_list *regs; /* Regs to tweak */
-	int regs_size;
-	int (*set_size) (struct v4l2_subdev *sd);
-/* h/vref stuff */
-} sensor_win_sizes[] = {
-	/* SXGA */
-	{
-		.width		= HD_WIDTH,
-		.height		= HD_HEIGHT,
-		.regs 		= sensor_uxga_regs,
-		.regs_size	= ARRAY_SIZE(sensor_uxga_regs),
-		.set_size		= NULL,
-	},
-};
+	/* Fastest frame: minimum horizontal and vertical blanking */
+	cfg->hblank = 0;
+	cfg->vblank = 8;
+	mt9p031_config_timing(extclk, cfg);
 
-#define N_WIN_SIZES (ARRAY_SIZE(sensor_win_sizes))
+	if (interval == NULL || interval->numerator == 0 || interval->denominator == 0)
+		return 0;
 
- 
- 
- 
-static int sensor_enum_fmt(struct v4l2_subdev *sd, unsigned index,
-                 enum v4l2_mbus_pixelcode *code)//linux-3.0
+	target_ns = (u64)interval->numerator * 1000000000;
+	do_div(target_ns, interval->denominator);
+	if (target_ns < (u64)cfg->timing.frame_period_us * 1000) {
+		if (reject_unmet_rate)
+			return -ERANGE;
+		return 0;
+	}
+
+	/* frame length in PIXCLKs, then spread over rows */
+	len = target_ns * cfg->timing.pixel_rate;
+	do_div(len, 1000000000);
+	rows = cfg->timing.height + 2048;
+	if (len > (u64)cfg->timing.line_length * rows) {
+		u64 line = len + rows - 1;
+
+		do_div(line, rows);
+		/* line_length = 2 * (W / 2 + HB), HB = hblank + 1 */
+		line = line / 2 - cfg->timing.width / 2 - 1;
+		cfg->hblank = min_t(u64, line, 4095);
+		mt9p031_config_timing(extclk, cfg);
+	}
+	len += cfg->timing.line_length / 2;
+	do_div(len, cfg->timing.line_length);
+	rows = len > cfg->timing.height + 9 ? len - cfg->timing.height - 1 : 8;
+	cfg->vblank = clamp_t(u32, rows, 8, 2047);
+	mt9p031_config_timing(extclk, cfg);
+	return 0;
+}
+
+/*
+ * Pick the smallest mode that covers @width x @height and solve it, see
+ * mt9p031_solve_mode().  The windows are left out.
+ */
+static int mt9p031_solve(u32 extclk, u32 width, u32 height,
+			 const struct v4l2_fract *interval, struct mt9p031_config *cfg)
 {
-//	struct sensor_format_struct *ofmt;
+	const struct mt9p031_format_params *fp;
+	int i, mode = -1;
+
+	for (i = 0; i < ARRAY_SIZE(mt9p031_supported_formats); i++) {
+		fp = &mt9p031_supported_formats[i];
+		if (fp->window || fp->width < width || fp->height < height)
+			continue;
+		if (mode < 0 ||
+		    fp->width * fp->height <
+		    mt9p031_supported_formats[mode].width * mt9p031_supported_formats[mode].height)
+			mode = i;
+	}
+	if (mode < 0)	/* Larger than anything, take the largest */
+		mode = MT9P031_FIVE_MP;
+	return mt9p031_solve_mode(extclk, mode, interval, cfg);
+}
 
-	if (index >= N_FMTS)//linux-3.0
-		return -EINVAL;
+/* Solve the mode in use again if it is a window, by size otherwise */
+static int mt9p031_solve_current(struct sensor_info *info,
+				 const struct v4l2_fract *interval, struct mt9p031_config *cfg)
+{
+	if (mt9p031_supported_formats[info->mode].window)
+		return mt9p031_solve_mode(info->ccm_info->mclk, info->mode, interval, cfg);
+	return mt9p031_solve(info->ccm_info->mclk, info->width, info->height, interval, cfg);
+}
 
-	*code = sensor_formats[index].mbus_code;//linux-3.0
-//	ofmt = sensor_formats + fmt->index;
-//	fmt->flags = 0;
-//	strcpy(fmt->description, ofmt->desc);
-//	fmt->pixelformat = ofmt->pixelformat;
-	return 0;
+/* The window the size of @mode, or @mode when it has none */
+static int mt9p031_window_mode(int mode)
+{
+	const struct mt9p031_format_params *fp = &mt9p031_supported_formats[mode];
+	int i;
+
+	for (i = 0; i < MT9P031_NUM_MODES; i++)
+		if (mt9p031_supported_formats[i].window &&
+		    mt9p031_supported_formats[i].width == fp->width &&
+		    mt9p031_supported_formats[i].height == fp->height)
+			return i;
+	return mode;
 }
 
+static bool warm_oneshot;
+module_param(warm_oneshot, bool, 0644);
+MODULE_PARM_DESC(warm_oneshot, "Start auto exposure from the shortest exposure when a mode has nothing saved");
 
-static int sensor_try_fmt_internal(struct v4l2_subdev *sd,
-		//struct v4l2_format *fmt,
-		struct v4l2_mbus_framefmt *fmt,//linux-3.0
-		struct sensor_format_struct **ret_fmt,
-		struct sensor_win_size **ret_wsize)
+#define MT9P031_ONESHOT_ROWS	32
+
+static int sensor_s_exp(struct v4l2_subdev *sd, int value);
+
+/* V4L2_CID_GAIN value of a gain register, see sensor_s_gain() */
+static int mt9p031_gain_value(u16 reg)
 {
-	int index;
-	struct sensor_win_size *wsize;
-	enum mt9p031_image_size isize;
-//	struct v4l2_pix_format *pix = &fmt->fmt.pix;//linux-3.0
+	int gain = reg & 0x3f;
 
-	isize = mt9p031_calc_size(2280);
+	if (reg & MT9P031_GAIN_ANALOG_MULT)
+		gain *= 2;
+	return clamp(DIV_ROUND_CLOSEST(gain, 8), 1, 8);
+}
 
-	csi_dev_dbg("sensor_try_fmt_internal,fmt->code:0x%x\n",fmt->code);
-	for (index = 0; index < N_FMTS; index++)
-		if (sensor_formats[index].mbus_code == fmt->code)//linux-3.0
-			break;
-	
-	if (index >= N_FMTS) {
-		/* default to first format */
-		index = 0;
-		fmt->code = sensor_formats[0].mbus_code;//linux-3.0
+/*
+ * Start a mode from the exposure and gains it last converged to instead
+ * of the defaults.  The gains are written here, the shutter width is
+ * left in info->exp_req for the caller to fit to the frame.  With nothing
+ * saved and warm_oneshot set, auto exposure starts from a short
+ * exposure that does not clip and its first step corrects in full.
+ * Returns 1 when a saved entry was used.
+ */
+static int mt9p031_warm_start(struct v4l2_subdev *sd)
+{
+	struct sensor_info *info = to_state(sd);
+	struct regval regs[4];
+	struct mt9p031_warm w;
+	unsigned long flags;
+	int i, ret;
+
+	if (info->warm_mode == info->mode)
+		return 0;
+	info->warm_mode = info->mode;
+
+	spin_lock_irqsave(&info->fs_lock, flags);
+	w = info->warm[info->mode];
+	spin_unlock_irqrestore(&info->fs_lock, flags);
+	if (w.shutter_width == 0) {
+		if (warm_oneshot && info->autoexp == V4L2_EXPOSURE_AUTO) {
+			info->exp_req = MT9P031_ONESHOT_ROWS;
+			info->ae_oneshot = 1;
+		}
+		return 0;
 	}
-	
-	if (ret_fmt != NULL)
-		*ret_fmt = sensor_formats + index;
-		
-	/*
-	 * Fields: the sensor devices claim to be progressive.
-	 */
-	fmt->field = V4L2_FIELD_NONE;//linux-3.0
-	
-	
-	/*
-	 * Round requested image size down to the nearest
-	 * we support, but not below the smallest.
-	 */
-	for (wsize = sensor_win_sizes; wsize < sensor_win_sizes + N_WIN_SIZES;
-	     wsize++)
-		if (fmt->width >= wsize->width && fmt->height >= wsize->height)//linux-3.0
-			break;
-	
-	if (wsize >= sensor_win_sizes + N_WIN_SIZES)
-		wsize--;   /* Take the smallest one */
-		
-	if (ret_wsize != NULL)
-	{
-		csi_dev_dbg("ret_wsize is not null\n");
-		*ret_wsize = wsize;
+
+	/* green1, blue, red, green2 */
+	for (i = 0; i < ARRAY_SIZE(regs); i++) {
+		regs[i].reg_num = REG_MT9P031_GREEN_1_GAIN + i;
+		regs[i].value = w.gain[i];
 	}
-	/*
-	 * Note the size we'll actually handle.
-	 */
-	//fmt->width = wsize->width;//linux-3.0
-	//fmt->height = wsize->height;//linux-3.0
-	fmt->width = mt9p031_supported_formats[isize].width;
-	fmt->height = mt9p031_supported_formats[isize].height;
-	csi_dev_dbg("fmt->width:%d ,fmt->height:%d,size:%d\n",fmt->width,fmt->height,wsize->regs_size);
-	//pix->bytesperline = pix->width*sensor_formats[index].bpp;//linux-3.0
-	//pix->sizeimage = pix->height*pix->bytesperline;//linux-3.0
-	
-	return 0;
+	ret = mt9p031_write_array(sd, regs, ARRAY_SIZE(regs));
+	if (ret < 0)
+		return ret;
+	info->exp_req = w.shutter_width;
+	info->gain = mt9p031_gain_value(w.gain[0]);
+	info->ae_oneshot = 0;
+	csi_dev_dbg("mode %d warm start, shutter %u\n", info->mode, w.shutter_width);
+	return 1;
 }
 
-static int sensor_try_fmt(struct v4l2_subdev *sd, 
-             struct v4l2_mbus_framefmt *fmt)//linux-3.0
+/*
+ * Program what mt9p031_solve() chose.  Everything but the PLL is frame
+ * synchronised, a PLL change costs a trip through standby.  The
+ * exposure is fitted to the new frame again.
+ */
+static int mt9p031_apply_config(struct v4l2_subdev *sd)
 {
-	return sensor_try_fmt_internal(sd, fmt, NULL, NULL);
+	struct i2c_client *client = v4l2_get_subdevdata(sd);
+	struct sensor_info *info = to_state(sd);
+	int ret;
+
+	ret = mt9p031_set_pll(sd, &info->pll);
+	ret |= mt9p031_set_params(client, info->width, info->height);
+	if (ret < 0)
+		return ret;
+	ret = mt9p031_warm_start(sd);
+	if (ret < 0)
+		return ret;
+	mt9p031_refresh_timing(sd, 1);
+	if (info->exp_req)
+		return sensor_s_exp(sd, info->exp_req);
+	return 0;
 }
 
 /*
- * Set a format.
+ * The frame interval the solver works towards.  Low latency mode asks
+ * for the fastest frame the bus allows: highest PIXCLK, least blanking.
  */
-static int sensor_s_fmt(struct v4l2_subdev *sd, 
-             struct v4l2_mbus_framefmt *fmt)//linux-3.0
+static const struct v4l2_fract *mt9p031_target_interval(struct sensor_info *info,
+							const struct v4l2_fract *interval)
 {
-	int ret;
-	struct sensor_format_struct *sensor_fmt;
-	struct sensor_win_size *wsize;
-	struct sensor_info *info = to_state(sd);
-	csi_dev_err("sensor_s_fmt\n");
-	ret = sensor_try_fmt_internal(sd, fmt, &sensor_fmt, &wsize);
-	if (ret)
+	return info->low_latency ? NULL : interval;
+}
+
+static void mt9p031_commit_config(struct sensor_info *info, const struct mt9p031_config *cfg)
+{
+	/* the alternating windows were checked against the old mode's size */
+	if (cfg->mode != info->mode)
+		info->roi_count = 0;
+	info->mode = cfg->mode;
+	info->pll = cfg->pll;
+	info->hblank = cfg->hblank;
+	info->vblank = cfg->vblank;
+	info->afr_vblank = 0;
+	info->width = mt9p031_supported_formats[cfg->mode].width;
+	info->height = mt9p031_supported_formats[cfg->mode].height;
+}
+
+/* Lamps flicker at twice the mains frequency, ns per flicker period */
+static u32 mt9p031_flicker_period(int hz)
+{
+	return hz ? NSEC_PER_SEC / (2 * hz) : 0;
+}
+
+/* Rows of the shortest frame of at least @rows lasting whole flicker periods */
+static u32 mt9p031_flicker_rows(u32 rows, u32 row_ns, u32 period_ns)
+{
+	u64 ns = (u64)rows * row_ns + period_ns - 1;
+
+	do_div(ns, period_ns);
+	ns = ns * period_ns + row_ns / 2;
+	do_div(ns, row_ns);
+	return max_t(u32, ns, rows);
+}
+
+/*
+ * Shutter width nearest to @rows that lasts whole flicker periods, at
+ * most @max_rows.  Exposures shorter than a period cannot escape the
+ * bands and are left alone.
+ */
+static u32 mt9p031_flicker_shutter(u32 rows, u32 max_rows, u32 row_ns, u32 period_ns)
+{
+	u64 ns = (u64)rows * row_ns;
+	u64 k;
+
+	if (ns < period_ns || (u64)max_rows * row_ns < period_ns)
+		return rows;
+	k = ns + period_ns / 2;
+	do_div(k, period_ns);
+	if (k * period_ns > (u64)max_rows * row_ns)
+		k--;
+	ns = k * period_ns + row_ns / 2;
+	do_div(ns, row_ns);
+	return ns;
+}
+
+/*
+ * Under mains lighting make the frame last whole flicker periods, every
+ * frame then starts at the same phase of the light and the bands stay
+ * put instead of rolling through the picture.  The frame only grows in
+ * rows, the phase still drifts by less than a row per frame.  Low
+ * latency mode keeps its shortest frame.
+ */
+static void mt9p031_flicker_lock(struct sensor_info *info, u32 extclk,
+				 struct mt9p031_config *cfg)
+{
+	u32 period = mt9p031_flicker_period(info->flicker_hz);
+	u32 rows;
+
+	if (period == 0 || info->low_latency || cfg->timing.row_time_ns == 0)
+		return;
+	rows = mt9p031_flicker_rows(cfg->timing.frame_length, cfg->timing.row_time_ns, period);
+	if (rows - cfg->timing.height - 1 > 2047)
+		return;
+	cfg->vblank = rows - cfg->timing.height - 1;
+	mt9p031_config_timing(extclk, cfg);
+}
+
+/*
+ * Consistency of the mode table and of what the solver makes of it: each
+ * window inside the active area with even starts, sizes that match the
+ * skip factors, widths rising for mt9p031_calc_size(), a legal PLL and
+ * blanking, and requested frame rates coming back within a row of what
+ * was asked for, or clamped to the fastest frame.  Failures go to @s when
+ * given, to the log otherwise.  Returns the number of failures.
+ */
+#define MT9P031_CHECK(cond, fmt, arg...)				\
+	do {								\
+		if (!(cond)) {						\
+			fails++;					\
+			if (s)						\
+				seq_printf(s, "FAIL " fmt "\n", ##arg);	\
+			else						\
+				csi_dev_err(fmt "\n", ##arg);		\
+		}							\
+	} while (0)
+
+static const unsigned int mt9p031_check_fps[] = { 1, 5, 10, 15, 25, 30, 60 };
+
+static int mt9p031_check_modes(struct seq_file *s, u32 extclk)
+{
+	const struct mt9p031_format_params *fp;
+	struct mt9p031_config cfg, fast;
+	struct v4l2_fract interval;
+	u64 v, pixclk;
+	int fails = 0;
+	int i, j, ret;
+
+	/* the fixed setting at the top of the PLL section */
+	v = (u64)extclk * MT9P031_PLL_M;
+	do_div(v, MT9P031_PLL_N);
+	pixclk = v;
+	do_div(pixclk, MT9P031_PLL_P1);
+	MT9P031_CHECK(extclk / MT9P031_PLL_N > 2000000 && extclk / MT9P031_PLL_N < 13500000 &&
+		      v > 180000000 && v < 360000000 && pixclk <= 96000000,
+		      "MT9P031_PLL_*: VCO %llu Hz, PIXCLK %llu Hz", v, pixclk);
+
+	for (i = 0; i < MT9P031_NUM_MODES; i++) {
+		int row_skip, col_skip;
+
+		fp = &mt9p031_supported_formats[i];
+		row_skip = fp->row_addr_mode & 0x7;
+		col_skip = fp->col_addr_mode & 0x7;
+
+		MT9P031_CHECK(fp->row_start % (2 * (fp->row_bin + 1)) == 0,
+			      "mode %d: row start %d not a multiple of %d", i,
+			      fp->row_start, 2 * (fp->row_bin + 1));
+		MT9P031_CHECK(fp->col_start % (4 * (fp->col_bin + 1)) == 0,
+			      "mode %d: column start %d not a multiple of %d", i,
+			      fp->col_start, 4 * (fp->col_bin + 1));
+		MT9P031_CHECK(fp->row_start >= MT9P031_ACTIVE_ROW &&
+			      fp->row_start + fp->row_size < MT9P031_ACTIVE_ROW + MT9P031_ACTIVE_HEIGHT,
+			      "mode %d: rows %d-%d outside the active area", i,
+			      fp->row_start, fp->row_start + fp->row_size);
+		MT9P031_CHECK(fp->col_start >= MT9P031_ACTIVE_COL &&
+			      fp->col_start + fp->col_size < MT9P031_ACTIVE_COL + MT9P031_ACTIVE_WIDTH,
+			      "mode %d: columns %d-%d outside the active area", i,
+			      fp->col_start, fp->col_start + fp->col_size);
+		MT9P031_CHECK((fp->col_size + 1) == fp->width * (col_skip + 1) &&
+			      (fp->row_size + 1) == fp->height * (row_skip + 1),
+			      "mode %d: %dx%d does not match the window and skipping", i,
+			      fp->width, fp->height);
+		MT9P031_CHECK(fp->row_bin == ((fp->row_addr_mode >> 4) & 0x3) &&
+			      fp->col_bin == ((fp->col_addr_mode >> 4) & 0x3),
+			      "mode %d: binning fields disagree with the address modes", i);
+		if (fp->window) {
+			/* the host format stays when a set moves to the window */
+			MT9P031_CHECK(i > MT9P031_FIVE_MP &&
+				      mt9p031_supported_formats[mt9p031_calc_size(fp->width)].width == fp->width &&
+				      mt9p031_supported_formats[mt9p031_calc_size(fp->width)].height == fp->height,
+				      "mode %d: window %dx%d is not the size of a mode", i,
+				      fp->width, fp->height);
+		} else {
+			MT9P031_CHECK(i == 0 || fp->width >= mt9p031_supported_formats[i - 1].width,
+				      "mode %d: width %d below the previous mode", i, fp->width);
+			MT9P031_CHECK(mt9p031_calc_size(fp->width) <= i &&
+				      mt9p031_supported_formats[mt9p031_calc_size(fp->width)].width == fp->width,
+				      "mode %d: mt9p031_calc_size(%d) picks mode %d", i, fp->width,
+				      mt9p031_calc_size(fp->width));
+		}
+
+		ret = fp->window ? mt9p031_solve_mode(extclk, i, NULL, &fast) :
+		      mt9p031_solve(extclk, fp->width, fp->height, NULL, &fast);
+		MT9P031_CHECK(ret == 0, "mode %d: no PLL setting, %d", i, ret);
+		if (ret < 0)
+			continue;
+		MT9P031_CHECK(fast.mode == i, "mode %d: %dx%d solves to mode %d", i,
+			      fp->width, fp->height, fast.mode);
+		MT9P031_CHECK(fast.pll.m >= 16 && fast.pll.m <= 255 &&
+			      fast.pll.n >= 1 && fast.pll.n <= 64 &&
+			      fast.pll.p1 >= 1 && fast.pll.p1 <= 128,
+			      "mode %d: PLL factors m=%u n=%u p1=%u", i,
+			      fast.pll.m, fast.pll.n, fast.pll.p1);
+		v = (u64)extclk * fast.pll.m;
+		do_div(v, fast.pll.n);
+		MT9P031_CHECK(v > 180000000 && v < 360000000, "mode %d: VCO %llu Hz", i, v);
+		MT9P031_CHECK(fast.timing.pixel_rate <= max_pixclk &&
+			      fast.timing.pixel_rate <= 96000000,
+			      "mode %d: PIXCLK %u Hz", i, fast.timing.pixel_rate);
+		MT9P031_CHECK(fast.timing.width == fp->width && fast.timing.height == fp->height,
+			      "mode %d: timing reads out %ux%u", i,
+			      fast.timing.width, fast.timing.height);
+		v = (u64)fast.timing.row_time_ns * fast.timing.frame_length;
+		do_div(v, 1000);
+		MT9P031_CHECK(v <= fast.timing.frame_period_us &&
+			      v + fast.timing.frame_length / 1000 + 1 >= fast.timing.frame_period_us,
+			      "mode %d: frame period %u us, %llu from the row time", i,
+			      fast.timing.frame_period_us, v);
+
+		for (j = 0; j < ARRAY_SIZE(mt9p031_check_fps); j++) {
+			u32 want_us = 1000000 / mt9p031_check_fps[j];
+			u32 got_us, slack_us;
+
+			interval.numerator = 1;
+			interval.denominator = mt9p031_check_fps[j];
+			ret = fp->window ? mt9p031_solve_mode(extclk, i, &interval, &cfg) :
+			      mt9p031_solve(extclk, fp->width, fp->height, &interval, &cfg);
+			if (want_us < fast.timing.frame_period_us) {
+				MT9P031_CHECK(reject_unmet_rate ? ret == -ERANGE :
+					      ret == 0 && cfg.timing.frame_period_us ==
+					      fast.timing.frame_period_us,
+					      "mode %d: %u fps beyond the mode not clamped", i,
+					      mt9p031_check_fps[j]);
+				continue;
+			}
+			MT9P031_CHECK(ret == 0, "mode %d: %u fps failed %d", i,
+				      mt9p031_check_fps[j], ret);
+			if (ret < 0)
+				continue;
+			MT9P031_CHECK(cfg.hblank <= 4095 && cfg.vblank >= 8 && cfg.vblank <= 2047,
+				      "mode %d: %u fps blanking %u/%u", i, mt9p031_check_fps[j],
+				      cfg.hblank, cfg.vblank);
+			/* longest frame the blanking registers can make */
+			if (cfg.vblank == 2047 && cfg.hblank == 4095)
+				continue;
+			got_us = cfg.timing.frame_period_us;
+			slack_us = cfg.timing.row_time_ns / 1000 + 1;
+			MT9P031_CHECK(got_us + slack_us >= want_us && got_us <= want_us + slack_us,
+				      "mode %d: %u fps comes out at %u us per frame", i,
+				      mt9p031_check_fps[j], got_us);
+		}
+	}
+	return fails;
+}
+
+/* Cost of mt9p031_solve() over the table and rates above, ns per call */
+static u32 mt9p031_bench_solve(u32 extclk, int rounds)
+{
+	struct mt9p031_config cfg;
+	struct v4l2_fract interval = { 1, 1 };
+	ktime_t start;
+	int r, i, j, calls = 0;
+	s64 ns;
+
+	start = ktime_get();
+	for (r = 0; r < rounds; r++)
+		for (i = 0; i < MT9P031_NUM_MODES; i++)
+			for (j = 0; j < ARRAY_SIZE(mt9p031_check_fps); j++) {
+				interval.denominator = mt9p031_check_fps[j];
+				mt9p031_solve(extclk, mt9p031_supported_formats[i].width,
+					      mt9p031_supported_formats[i].height, &interval, &cfg);
+				calls++;
+			}
+	ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+	return calls ? div_s64(ns, calls) : 0;
+}
+
+
+static int mt9p031_init_camera(struct v4l2_subdev *sd)
+{
+	struct i2c_client *client = v4l2_get_subdevdata(sd);
+	int ret;
+	
+	ret = mt9p031_reg_write(client, 0x0d, 0x0001);		// High
+	//ret = mt9p031_set_output_control(sd, 0,2);
+	mdelay(50);
+	ret |= mt9p031_reg_write(client, 0x0d, 0x0000);	// Low
+	mdelay(50);
+
+	ret |= mt9p031_reg_write(client, 0x10, 0x0051);		// PLL_CTRL; power up pll
+//	ret |= mt9p031_reg_write(client, REG_MT9P031_PLL_CONF1, 0x1801);	// PLL_CONFIG_1: m=24, n=1
+//	ret |= mt9p031_reg_write(client, REG_MT9P031_PLL_CONF2, 0x0002);	// PLL_CONFIG_2: p1=2, p2=0
+	ret |= mt9p031_reg_write(client, 0x11, 0x2503);		// PLL_CONFIG_1: m=25, n=4
+	ret |= mt9p031_reg_write(client, 0x12, 0x0002);		// PLL_CONFIG_2: p1=3
+	mdelay(10);  //wait 10 ms for VCO to lock
+	ret |= mt9p031_reg_write(client, 0x10, 0x0053);		// PLL_CONTROL; use PLL
+	ret |= mt9p031_reg_write(client, 0x07, 0x1F8E);
+	mdelay(200);
+
+	ret |= mt9p031_reg_write(client, 0x002B, 0x0008);		// RESERVED_CORE_70
+	ret |= mt9p031_reg_write(client, 0x002C, 0x0008);		// RESERVED_CORE_71
+	ret |= mt9p031_reg_write(client, 0x002D, 0x0008);		// RESERVED_CORE_72
+	ret |= mt9p031_reg_write(client, 0x002E, 0x0008);		// RESERVED_CORE_73
+	ret |= mt9p031_reg_write(client, 0x0001, 0x01B0);		// RESERVED_CORE_74
+	ret |= mt9p031_reg_write(client, 0x0002, 0x0010);		// RESERVED_CORE_75
+	ret |= mt9p031_reg_write(client, 0x0003, 0x0437);		// RESERVED_CORE_76
+	ret |= mt9p031_reg_write(client, 0x0004, 0x077F);		// RESERVED_CORE_77
+	ret |= mt9p031_reg_write(client, 0x0005, 0x0030);		// RESERVED_CORE_78
+	ret |= mt9p031_reg_write(client, 0x0006, 0x0030);		// RESERVED_CORE_79
+	ret |= mt9p031_reg_write(client, 0x001E, 0x0006);		// RESERVED_CORE_7A
+	ret |= mt9p031_reg_write(client, 0x0020, 0x0040);		// RESERVED_CORE_7B
+	ret |= mt9p031_reg_write(client, 0x0022, 0x0000);		// RESERVED_CORE_7C
+	ret |= mt9p031_reg_write(client, 0x0023, 0x0000);		// RESERVED_CORE_7E
+	ret |= mt9p031_reg_write(client, 0x0008, 0x0000);		// RESERVED_CORE_7F
+	ret |= mt9p031_reg_write(client, 0x0009, 0x0300);		// RESERVED_CORE_29
+	ret |= mt9p031_reg_write(client, 0x000C, 0x0000);		// RESERVED_CORE_2A
+	ret |= mt9p031_reg_write(client, 0x004F, 0x0011);		// RESERVED_CORE_3E
+	ret |= mt9p031_reg_write(client, 0x0029, 0x0481);		// RESERVED_CORE_3F
+	ret |= mt9p031_reg_write(client, 0x003E, 0x0007);		// RESERVED_CORE_41
+	ret |= mt9p031_reg_write(client, 0x003F, 0x0007);		// RESERVED_CORE_48
+	ret |= mt9p031_reg_write(client, 0x0041, 0x0003);		// CAL_THRESHOLD
+	ret |= mt9p031_reg_write(client, 0x0048, 0x0018);		// RESERVED_CORE_57
+
+	ret |= mt9p031_set_params(client,2280,1080);
+	
+	ret |= mt9p031_reg_write(client, 0x0057, 0x0002);		// RESERVED_CORE_78
+	ret |= mt9p031_reg_write(client, 0x002A, 0x7F72);		// RESERVED_CORE_79
+	ret |= mt9p031_reg_write(client, 0x001E, 0x0006);		// RESERVED_CORE_7A
+	
+	ret |= mt9p031_reg_write(client, 0x0070, 0x0079);		// RESERVED_CORE_70	
+	ret |= mt9p031_reg_write(client, 0x0071, 0x7800);		// RESERVED_CORE_71
+	ret |= mt9p031_reg_write(client, 0x0072, 0x7800);		// RESERVED_CORE_72
+	ret |= mt9p031_reg_write(client, 0x0073, 0x0300);		// RESERVED_CORE_73
+	ret |= mt9p031_reg_write(client, 0x0074, 0x0300);		// RESERVED_CORE_74
+	ret |= mt9p031_reg_write(client, 0x0075, 0x3C00);		// RESERVED_CORE_75
+	ret |= mt9p031_reg_write(client, 0x0076, 0x4E3D);		// RESERVED_CORE_76
+	ret |= mt9p031_reg_write(client, 0x0077, 0x4E3D);		// RESERVED_CORE_77
+	ret |= mt9p031_reg_write(client, 0x0078, 0x774F);		// RESERVED_CORE_78
+	ret |= mt9p031_reg_write(client, 0x0079, 0x7900);		// RESERVED_CORE_79
+	ret |= mt9p031_reg_write(client, 0x007A, 0x7900);		// RESERVED_CORE_7A
+	ret |= mt9p031_reg_write(client, 0x007B, 0x7800);		// RESERVED_CORE_7B
+	ret |= mt9p031_reg_write(client, 0x007C, 0x7800);		// RESERVED_CORE_7C
+	ret |= mt9p031_reg_write(client, 0x007E, 0x7800);		// RESERVED_CORE_7E
+	ret |= mt9p031_reg_write(client, 0x007F, 0x7800);		// RESERVED_CORE_7F
+	
+	ret |= mt9p031_reg_write(client, 0x0006, 0x0000);
+	ret |= mt9p031_reg_write(client, 0x0029, 0x0481);		// RESERVED_CORE_29
+	ret |= mt9p031_reg_write(client, 0x003E, 0x0087);		// RESERVED_CORE_3E
+	ret |= mt9p031_reg_write(client, 0x003F, 0x0007);		// RESERVED_CORE_3F
+	ret |= mt9p031_reg_write(client, 0x0041, 0x0003);		// RESERVED_CORE_41
+	ret |= mt9p031_reg_write(client, 0x0048, 0x0018);		// RESERVED_CORE_48
+	ret |= mt9p031_reg_write(client, 0x005F, 0x1C16);		// CAL_THRESHOLD
+	ret |= mt9p031_reg_write(client, 0x0057, 0x0002);		// RESERVED_CORE_57
+	
+	ret |= mt9p031_reg_write(client, 0x004F, 0x0011);		// RESERVED_CORE_57
+
+	return ret>= 0 ? 0 : -EIO;
+}
+
+
+static int mt9p031_vsync_init(struct v4l2_subdev *sd);
+static void mt9p031_fs_flush(struct sensor_info *info, int apply);
+static int sensor_s_gain(struct v4l2_subdev *sd, int value);
+static void mt9p031_wd_arm(struct sensor_info *info);
+static int mt9p031_apply_strobe(struct v4l2_subdev *sd, int force);
+static int mt9p031_s_row_means(struct sensor_info *info, struct mt9p031_row_means *rm);
+static int mt9p031_s_metering(struct sensor_info *info, const struct mt9p031_metering *m);
+static int mt9p031_s_zone_means(struct sensor_info *info, struct mt9p031_zone_means *zm);
+static int mt9p031_s_roi(struct sensor_info *info, const struct mt9p031_roi_set *set);
+
+/* Start a new capture session: forget frame history and drop accounting */
+static void mt9p031_frame_reset(struct sensor_info *info)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&info->fs_lock, flags);
+	write_seqcount_begin(&info->frames_seq);
+	memset(info->frames, 0, sizeof(info->frames));
+	write_seqcount_end(&info->frames_seq);
+	info->period_min = 0;
+	info->period_max = 0;
+	info->period_sum = 0;
+	info->period_count = 0;
+	info->host_seen = 0;
+	spin_unlock_irqrestore(&info->fs_lock, flags);
+}
+
+static int mt9p031_init_raw(struct v4l2_subdev *sd, u32 val)
+{
+	int ret;
+	struct i2c_client *client = v4l2_get_subdevdata(sd);
+	printk(KERN_ERR "sensor_init\n");
+	/* the close before this open never got as far as powering down */
+	if (to_state(sd)->configured) {
+		mt9p031_frame_reset(to_state(sd));
+		mt9p031_wd_arm(to_state(sd));
+		return 0;
+	}
+	/*Make sure it is a target sensor*/
+	ret = sensor_detect(sd);
+	if (ret) {
+		csi_dev_err("chip found is not an target chip.\n");
+		return ret;
+	}
+#if 0
+	ret = mt9p031_init_camera(sd);
+	if(ret!=0)
+	{
+		csi_dev_err("sensor_write_array fail\n");
+	}
+#else
+	ret = mt9p031_write_array(sd, sensor_default_regs , ARRAY_SIZE(sensor_default_regs));
+	if(ret!=0)
+	{
+		csi_dev_err("sensor_write_array fail\n");
+	}
+	
+	ret |= mt9p031_set_pll(sd, &to_state(sd)->pll);
+	ret |= mt9p031_set_params(client,2280,1080);
+	if(ret!=0)
+	{
+		csi_dev_err("mt9p031_set_params fail\n");
+	}
+#endif
+	if (ret == 0 && to_state(sd)->test_pattern)
+		ret = mt9p031_apply_test_pattern(sd);
+	if (ret == 0)
+		ret = mt9p031_apply_blc(sd);
+	if (ret == 0)
+		ret = mt9p031_warm_start(sd);
+	if (ret == 0)
+		ret = sensor_s_gain(sd, to_state(sd)->gain);
+	else if (ret > 0)
+		ret = 0;
+	/* sensor_default_regs[] left Read Mode 1 at its default */
+	if (ret == 0)
+		ret = mt9p031_apply_strobe(sd, 1);
+
+	/* whatever was queued was meant for the sensor state we just reset */
+	mt9p031_fs_flush(to_state(sd), 0);
+	mt9p031_frame_reset(to_state(sd));
+	mt9p031_refresh_timing(sd, 1);
+	if (ret == 0 && to_state(sd)->exp_req)
+		ret = sensor_s_exp(sd, to_state(sd)->exp_req);
+	mt9p031_vsync_init(sd);
+	if (ret == 0 && !to_state(sd)->streaming)
+		ret = mt9p031_restart(sd);
+	to_state(sd)->configured = (ret == 0);
+	mt9p031_wd_arm(to_state(sd));
+	return ret;
+}
+
+/* Called with info->lock held */
+static int mt9p031_init(struct v4l2_subdev *sd, u32 val)
+{
+	struct sensor_info *info = to_state(sd);
+	struct mt9p031_bus_cost start = info->bus;
+	int ret;
+
+	ret = mt9p031_init_raw(sd, val);
+	mt9p031_bus_end(info, &info->bus_ops[MT9P031_OP_INIT],
+			&mt9p031_bus_budgets[MT9P031_OP_INIT], &start);
+	return ret;
+}
+
+static int sensor_init(struct v4l2_subdev *sd, u32 val)
+{
+	struct sensor_info *info = to_state(sd);
+	int ret;
+
+	mutex_lock(&info->lock);
+	ret = mt9p031_init(sd, val);
+	mutex_unlock(&info->lock);
+	return ret;
+}
+
+/*
+ * Match a completed buffer with the frame it holds.  A buffer is done once
+ * the last row has been read out, so it belongs to the newest frame that
+ * started at least half a readout before the completion time.  Gaps in the
+ * sequence between two buffers are frames the host never received.
+ */
+static void mt9p031_fill_frame_info(struct mt9p031_frame_info *fi,
+				    const struct mt9p031_frame_rec *rec)
+{
+	fi->sequence = rec->sequence;
+	fi->sof = rec->sof;
+	fi->exposure_start = rec->sof - rec->exposure_ns;
+	fi->exposure_ns = rec->exposure_ns;
+	fi->readout_ns = rec->readout_ns;
+	fi->settings = rec->settings;
+}
+
+static int mt9p031_g_frame_info(struct sensor_info *info, struct mt9p031_frame_info *fi)
+{
+	struct mt9p031_frame_rec *rec = NULL;
+	s64 ts = fi->timestamp ? fi->timestamp : ktime_to_ns(ktime_get());
+	unsigned long flags;
+	int i;
+
+	if (info->vsync_irq <= 0)
+		return -ENODEV;
+
+	spin_lock_irqsave(&info->fs_lock, flags);
+	for (i = 0; i < MT9P031_FRAME_HISTORY; i++) {
+		struct mt9p031_frame_rec *r = &info->frames[i];
+
+		if (r->sof == 0 || r->sof > ts - r->readout_ns / 2)
+			continue;
+		if (rec == NULL || (s32)(r->sequence - rec->sequence) > 0)
+			rec = r;
+	}
+	if (rec == NULL) {
+		spin_unlock_irqrestore(&info->fs_lock, flags);
+		return -EAGAIN;
+	}
+
+	fi->dropped = 0;
+	if (info->host_seen && (s32)(rec->sequence - info->host_sequence) > 1)
+		fi->dropped = rec->sequence - info->host_sequence - 1;
+	info->frames_dropped += fi->dropped;
+	info->frames_received++;
+	info->host_sequence = rec->sequence;
+	info->host_seen = 1;
+
+	mt9p031_fill_frame_info(fi, rec);
+	spin_unlock_irqrestore(&info->fs_lock, flags);
+	return 0;
+}
+
+static long sensor_ioctl(struct v4l2_subdev *sd, unsigned int cmd, void *arg)
+{
+	int ret=0;
+	
+	switch(cmd){
+		case CSI_SUBDEV_CMD_GET_INFO: 
+		{
+			struct sensor_info *info = to_state(sd);
+			__csi_subdev_info_t *ccm_info = arg;
+			
+			csi_dev_dbg("CSI_SUBDEV_CMD_GET_INFO\n");
+			ccm_info->mclk 	=	info->ccm_info->mclk ;
+			ccm_info->vref 	=	info->ccm_info->vref ;
+			ccm_info->href 	=	info->ccm_info->href ;
+			ccm_info->clock	=	info->ccm_info->clock;
+			ccm_info->iocfg	=	info->ccm_info->iocfg;
+			csi_dev_dbg("ccm_info.mclk=%x\n ",info->ccm_info->mclk);
+			csi_dev_dbg("ccm_info.vref=%x\n ",info->ccm_info->vref);
+			csi_dev_dbg("ccm_info.href=%x\n ",info->ccm_info->href);
+			csi_dev_dbg("ccm_info.clock=%x\n ",info->ccm_info->clock);
+			csi_dev_dbg("ccm_info.iocfg=%x\n ",info->ccm_info->iocfg);
+			break;
+		}
+		case CSI_SUBDEV_CMD_SET_INFO:
+		{
+			struct sensor_info *info = to_state(sd);
+			__csi_subdev_info_t *ccm_info = arg;
+			
+			csi_dev_dbg("CSI_SUBDEV_CMD_SET_INFO\n");
+			info->ccm_info->mclk 	=	ccm_info->mclk 	;
+			info->ccm_info->vref 	=	ccm_info->vref 	;
+			info->ccm_info->href 	=	ccm_info->href 	;
+			info->ccm_info->clock	=	ccm_info->clock	;
+			info->ccm_info->iocfg	=	ccm_info->iocfg	;
+			csi_dev_dbg("ccm_info.mclk=%x\n ",info->ccm_info->mclk);
+			csi_dev_dbg("ccm_info.vref=%x\n ",info->ccm_info->vref);
+			csi_dev_dbg("ccm_info.href=%x\n ",info->ccm_info->href);
+			csi_dev_dbg("ccm_info.clock=%x\n ",info->ccm_info->clock);
+			csi_dev_dbg("ccm_info.iocfg=%x\n ",info->ccm_info->iocfg);
+			break;
+		}
+		case MT9P031_CMD_G_FRAME_INFO:
+			ret = mt9p031_g_frame_info(to_state(sd), arg);
+			break;
+		case MT9P031_CMD_S_ROW_MEANS:
+			ret = mt9p031_s_row_means(to_state(sd), arg);
+			break;
+		case MT9P031_CMD_S_METERING:
+			ret = mt9p031_s_metering(to_state(sd), arg);
+			break;
+		case MT9P031_CMD_S_ZONE_MEANS:
+			ret = mt9p031_s_zone_means(to_state(sd), arg);
+			break;
+		case MT9P031_CMD_S_ROI:
+			ret = mt9p031_s_roi(to_state(sd), arg);
+			break;
+		default:
+			return -EINVAL;
+	}		
+		return ret;
+}
+
+
+/*
+ * Store information about the video data format. 
+ */
+static struct sensor_format_struct {
+	__u8 *desc;
+	//__u32 pixelformat;
+	enum v4l2_mbus_pixelcode mbus_code;//linux-3.0
+	struct regval_list *regs;
+	int	regs_size;
+	int bpp;   /* Bytes per pixel */
+} sensor_formats[] = {
+	{
+		.desc		= "Raw RGB Bayer",
+		.mbus_code	= V4L2_MBUS_FMT_SBGGR8_1X8,//linux-3.0
+		.regs 		= sensor_fmt_raw,
+		.regs_size = ARRAY_SIZE(sensor_fmt_raw),
+		.bpp		= 1
+	},
+	{
+		.desc		= "YUYV 4:2:2",
+		.mbus_code	= V4L2_MBUS_FMT_YUYV8_2X8,//linux-3.0
+		.regs 		= sensor_fmt_yuv422_yuyv,
+		.regs_size = ARRAY_SIZE(sensor_fmt_yuv422_yuyv),
+		.bpp		= 2,
+	},
+	{
+		.desc		= "YVYU 4:2:2",
+		.mbus_code	= V4L2_MBUS_FMT_YVYU8_2X8,//linux-3.0
+		.regs 		= sensor_fmt_yuv422_yvyu,
+		.regs_size = ARRAY_SIZE(sensor_fmt_yuv422_yvyu),
+		.bpp		= 2,
+	},
+	{
+		.desc		= "UYVY 4:2:2",
+		.mbus_code	= V4L2_MBUS_FMT_UYVY8_2X8,//linux-3.0
+		.regs 		= sensor_fmt_yuv422_uyvy,
+		.regs_size = ARRAY_SIZE(sensor_fmt_yuv422_uyvy),
+		.bpp		= 2,
+	},
+	{
+		.desc		= "VYUY 4:2:2",
+		.mbus_code	= V4L2_MBUS_FMT_VYUY8_2X8,//linux-3.0
+		.regs 		= sensor_fmt_yuv422_vyuy,
+		.regs_size = ARRAY_SIZE(sensor_fmt_yuv422_vyuy),
+		.bpp		= 2,
+	},
+
+};
+#define N_FMTS ARRAY_SIZE(sensor_formats)
+
+
+/*
+ * Then there is the issue of window sizes.  Try to capture the info here.
+ */
+
+
+static struct sensor_win_size {
+	int	width;
+	int	height;
+	int	hstart;		/* Start/stop values for the camera.  Note */
+	int	hstop;		/* that they do not always make complete */
+	int	vstart;		/* sense to humans, but evidently the sensor */
+	int	vstop;		/* will do the right thing... */
+	struct regval_list *regs; /* Regs to tweak */
+	int regs_size;
+	int (*set_size) (struct v4l2_subdev *sd);
+/* h/vref stuff */
+} sensor_win_sizes[] = {
+	/* SXGA */
+	{
+		.width		= HD_WIDTH,
+		.height		= HD_HEIGHT,
+		.regs 		= sensor_uxga_regs,
+		.regs_size	= ARRAY_SIZE(sensor_uxga_regs),
+		.set_size		= NULL,
+	},
+};
+
+#define N_WIN_SIZES (ARRAY_SIZE(sensor_win_sizes))
+
+ 
+ 
+ 
+static int sensor_enum_fmt(struct v4l2_subdev *sd, unsigned index,
+                 enum v4l2_mbus_pixelcode *code)//linux-3.0
+{
+//	struct sensor_format_struct *ofmt;
+
+	if (index >= N_FMTS)//linux-3.0
+		return -EINVAL;
+
+	*code = sensor_formats[index].mbus_code;//linux-3.0
+	if (mt9p031_is_bayer(*code))
+		*code = mt9p031_bayer_code(to_state(sd));
+//	ofmt = sensor_formats + fmt->index;
+//	fmt->flags = 0;
+//	strcpy(fmt->description, ofmt->desc);
+//	fmt->pixelformat = ofmt->pixelformat;
+	return 0;
+}
+
+
+static int sensor_try_fmt_internal(struct v4l2_subdev *sd,
+		//struct v4l2_format *fmt,
+		struct v4l2_mbus_framefmt *fmt,//linux-3.0
+		struct sensor_format_struct **ret_fmt,
+		struct sensor_win_size **ret_wsize,
+		struct mt9p031_config *ret_cfg)
+{
+	int index;
+	struct sensor_win_size *wsize;
+	struct mt9p031_config cfg;
+	struct sensor_info *info = to_state(sd);
+	int ret;
+//	struct v4l2_pix_format *pix = &fmt->fmt.pix;//linux-3.0
+
+	ret = mt9p031_solve(info->ccm_info->mclk, fmt->width, fmt->height,
+			    mt9p031_target_interval(info, &info->interval), &cfg);
+	if (ret < 0)
+		return ret;
+	mt9p031_flicker_lock(info, info->ccm_info->mclk, &cfg);
+
+	csi_dev_dbg("sensor_try_fmt_internal,fmt->code:0x%x\n",fmt->code);
+	for (index = 0; index < N_FMTS; index++)
+		if (sensor_formats[index].mbus_code == fmt->code ||
+		    (mt9p031_is_bayer(sensor_formats[index].mbus_code) && mt9p031_is_bayer(fmt->code)))//linux-3.0
+			break;
+	
+	if (index >= N_FMTS) {
+		/* default to first format */
+		index = 0;
+		fmt->code = sensor_formats[0].mbus_code;//linux-3.0
+	}
+
+	/*
+	 * Any Bayer order is accepted, the one reported is the order the
+	 * sensor delivers with the current mirror settings.
+	 */
+	if (mt9p031_is_bayer(fmt->code))
+		fmt->code = mt9p031_bayer_code(info);
+	
+	if (ret_fmt != NULL)
+		*ret_fmt = sensor_formats + index;
+		
+	/*
+	 * Fields: the sensor devices claim to be progressive.
+	 */
+	fmt->field = V4L2_FIELD_NONE;//linux-3.0
+	
+	
+	/*
+	 * Round requested image size down to the nearest
+	 * we support, but not below the smallest.
+	 */
+	for (wsize = sensor_win_sizes; wsize < sensor_win_sizes + N_WIN_SIZES;
+	     wsize++)
+		if (fmt->width >= wsize->width && fmt->height >= wsize->height)//linux-3.0
+			break;
+	
+	if (wsize >= sensor_win_sizes + N_WIN_SIZES)
+		wsize--;   /* Take the smallest one */
+		
+	if (ret_wsize != NULL)
+	{
+		csi_dev_dbg("ret_wsize is not null\n");
+		*ret_wsize = wsize;
+	}
+	/*
+	 * Note the size we'll actually handle.
+	 */
+	//fmt->width = wsize->width;//linux-3.0
+	//fmt->height = wsize->height;//linux-3.0
+	fmt->width = mt9p031_supported_formats[cfg.mode].width;
+	fmt->height = mt9p031_supported_formats[cfg.mode].height;
+	if (ret_cfg != NULL)
+		*ret_cfg = cfg;
+	csi_dev_dbg("fmt->width:%d ,fmt->height:%d,size:%d\n",fmt->width,fmt->height,wsize->regs_size);
+	//pix->bytesperline = pix->width*sensor_formats[index].bpp;//linux-3.0
+	//pix->sizeimage = pix->height*pix->bytesperline;//linux-3.0
+	
+	return 0;
+}
+
+static int sensor_try_fmt(struct v4l2_subdev *sd, 
+             struct v4l2_mbus_framefmt *fmt)//linux-3.0
+{
+	return sensor_try_fmt_internal(sd, fmt, NULL, NULL, NULL);
+}
+
+/*
+ * Set a format.
+ */
+static int sensor_s_fmt(struct v4l2_subdev *sd, 
+             struct v4l2_mbus_framefmt *fmt)//linux-3.0
+{
+	int ret;
+	struct sensor_format_struct *sensor_fmt;
+	struct sensor_win_size *wsize;
+	struct mt9p031_config cfg;
+	struct sensor_info *info = to_state(sd);
+	csi_dev_err("sensor_s_fmt\n");
+	ret = sensor_try_fmt_internal(sd, fmt, &sensor_fmt, &wsize, &cfg);
+	if (ret)
+		return ret;
+	
+	csi_dev_err("sensor_try_fmt_internal\n");
+	//sensor_write_array(sd, sensor_fmt->regs , sensor_fmt->regs_size);
+	csi_dev_err("sensor_write_array\n");
+	ret = 0;
+	//if (wsize->regs)
+	//{
+	//	ret = sensor_write_array(sd, wsize->regs , wsize->regs_size);
+	//	if (ret < 0)
+	//	{
+	//		csi_dev_err("sensor_write_array fail wsize->regs_size is %d\n",wsize->regs_size);
+	//		return ret;
+	//	}
+	//}
+	//csi_dev_err("sensor_write_array2\n");
+	//if (wsize->set_size)
+	//{
+	//	ret = wsize->set_size(sd);
+	//	if (ret < 0)
+	//		return ret;
+	//}
+	
+	mutex_lock(&info->lock);
+	info->fmt = sensor_fmt;
+	mt9p031_commit_config(info, &cfg);
+
+	/* otherwise sensor_init() programs it */
+	if (info->configured)
+		ret = mt9p031_apply_config(sd);
+	mutex_unlock(&info->lock);
+	
+	return ret;
+}
+
+/*
+ * Implement G/S_PARM.  There is a "high quality" mode we could try
+ * to do someday; for now, we just do the frame rate tweak.
+ */
+static int sensor_g_parm(struct v4l2_subdev *sd, struct v4l2_streamparm *parms)
+{
+	struct v4l2_captureparm *cp = &parms->parm.capture;
+	struct mt9p031_timing t;
+
+	if (parms->type != V4L2_BUF_TYPE_VIDEO_CAPTURE)
+		return -EINVAL;
+
+	memset(cp, 0, sizeof(struct v4l2_captureparm));
+	cp->capability = V4L2_CAP_TIMEPERFRAME;
+	if (mt9p031_get_timing(sd, &t) == 0 && t.frame_period_us) {
+		cp->timeperframe.numerator = t.frame_period_us;
+		cp->timeperframe.denominator = 1000000;
+	} else {
+		/* Sensor not reachable, report the nominal rate */
+		cp->timeperframe.numerator = 1;
+		cp->timeperframe.denominator = SENSOR_FRAME_RATE;
+	}
+	
+	return 0;
+}
+
+static int sensor_s_parm(struct v4l2_subdev *sd, struct v4l2_streamparm *parms)
+{
+	struct v4l2_captureparm *cp = &parms->parm.capture;
+	struct v4l2_fract *tpf = &cp->timeperframe;
+	struct sensor_info *info = to_state(sd);
+	struct mt9p031_config cfg;
+	int ret;
+
+	if (parms->type != V4L2_BUF_TYPE_VIDEO_CAPTURE)
+		return -EINVAL;
+	if (cp->extendedmode != 0)
+		return -EINVAL;
+
+	/* 0/0 asks for the fastest rate of the mode, as does low latency mode */
+	ret = mt9p031_solve_current(info, mt9p031_target_interval(info, tpf), &cfg);
+	if (ret < 0)
+		return ret;
+	mt9p031_flicker_lock(info, info->ccm_info->mclk, &cfg);
+
+	mutex_lock(&info->lock);
+	info->interval = *tpf;
+	mt9p031_commit_config(info, &cfg);
+	if (info->configured)
+		ret = mt9p031_apply_config(sd);
+	mutex_unlock(&info->lock);
+	if (ret < 0)
+		return ret;
+
+	cp->capability = V4L2_CAP_TIMEPERFRAME;
+	tpf->numerator = cfg.timing.frame_period_us;
+	tpf->denominator = 1000000;
+	return 0;
+}
+
+/*
+ * Stopping aborts the frame in flight and parks the sensor at row 0 with
+ * Pause_Restart, so PIXCLK keeps running but FRAME_VALID and LINE_VALID
+ * stay low.  Starting clears Pause_Restart (Restart has to stay set while
+ * it does) and the first row is read out right away.  Either way it is
+ * one register write and the PLL and register contents are kept.
+ */
+static int sensor_s_stream(struct v4l2_subdev *sd, int enable)
+{
+	struct sensor_info *info = to_state(sd);
+	int changed;
+	int ret = 0;
+
+	enable = enable ? 1 : 0;
+	mutex_lock(&info->lock);
+	/* no point holding frame synchronous writes for a frame that never comes */
+	if (!enable)
+		mt9p031_fs_flush(info, 1);
+	changed = info->streaming != enable;
+	if (changed) {
+		info->streaming = enable;
+		/* before sensor_init() or in standby this is remembered for later */
+		if (info->configured && !info->standby)
+			ret = mt9p031_restart(sd);
+		if (ret < 0) {
+			csi_dev_err("mt9p031_restart err at sensor_s_stream!\n");
+			info->streaming = !enable;
+		}
+	}
+	mutex_unlock(&info->lock);
+
+	/* the gap would show up as one very long frame period */
+	if (ret == 0 && changed && enable) {
+		mt9p031_frame_reset(info);
+		mt9p031_wd_arm(info);
+	}
+	return ret;
+}
+
+
+/* 
+ * Code for dealing with controls.
+ * fill with different sensor module
+ * different sensor module has different settings here
+ * if not support the follow function ,retrun -EINVAL
+ */
+
+/* *********************************************begin of ******************************************** */
+static const char * const mt9p031_metering_menu[] = {
+	"Average",
+	"Center Weighted",
+	"Spot",
+	"Zone Grid",
+};
+
+static const char * const mt9p031_test_pattern_menu[] = {
+	"Disabled",
+	"Color Field",
+	"Horizontal Gradient",
+	"Vertical Gradient",
+	"Diagonal Gradient",
+	"Classic Test Pattern",
+	"Walking 1s",
+	"Monochrome Horizontal Bars",
+	"Monochrome Vertical Bars",
+	"Vertical Color Bars",
+};
+
+static int sensor_s_hflip(struct v4l2_subdev *sd, int value)
+{
+	int ret;
+	struct sensor_info *info = to_state(sd);
+	
+	ret = mt9p031_set_read_mode2(sd, MT9P031_READ_MODE2_COL_MIRROR,
+				     value ? MT9P031_READ_MODE2_COL_MIRROR : 0);
+	if (ret < 0) {
+		csi_dev_err("mt9p031_set_read_mode2 err at sensor_s_hflip!\n");
+		return ret;
+	}
+
+	info->hflip = value ? 1 : 0;
+	csi_dev_dbg("hflip=%d, bayer code 0x%x\n", info->hflip, mt9p031_bayer_code(info));
+	return 0;
+}
+
+static int sensor_s_vflip(struct v4l2_subdev *sd, int value)
+{
+	int ret;
+	struct sensor_info *info = to_state(sd);
+	
+	ret = mt9p031_set_read_mode2(sd, MT9P031_READ_MODE2_ROW_MIRROR,
+				     value ? MT9P031_READ_MODE2_ROW_MIRROR : 0);
+	if (ret < 0) {
+		csi_dev_err("mt9p031_set_read_mode2 err at sensor_s_vflip!\n");
+		return ret;
+	}
+
+	info->vflip = value ? 1 : 0;
+	csi_dev_dbg("vflip=%d, bayer code 0x%x\n", info->vflip, mt9p031_bayer_code(info));
+	return 0;
+}
+
+/* Both mirror bits live in Read Mode 2, set them with a single write */
+static int sensor_s_flip(struct v4l2_subdev *sd, int hflip, int vflip)
+{
+	int ret;
+	struct sensor_info *info = to_state(sd);
+
+	ret = mt9p031_set_read_mode2(sd, MT9P031_READ_MODE2_COL_MIRROR | MT9P031_READ_MODE2_ROW_MIRROR,
+				     (hflip ? MT9P031_READ_MODE2_COL_MIRROR : 0) |
+				     (vflip ? MT9P031_READ_MODE2_ROW_MIRROR : 0));
+	if (ret < 0) {
+		csi_dev_err("mt9p031_set_read_mode2 err at sensor_s_flip!\n");
+		return ret;
+	}
+
+	info->hflip = hflip ? 1 : 0;
+	info->vflip = vflip ? 1 : 0;
+	csi_dev_dbg("hflip=%d vflip=%d, bayer code 0x%x\n", info->hflip, info->vflip,
+		    mt9p031_bayer_code(info));
+	return 0;
+}
+
+/* The loop itself runs on zone means, see mt9p031_s_zone_means() */
+static int sensor_s_autoexp(struct v4l2_subdev *sd,
+		enum v4l2_exposure_auto_type value)
+{
+	struct sensor_info *info = to_state(sd);
+
+	info->autoexp = value;
+	return 0;
+}
+
+static int sensor_s_gain(struct v4l2_subdev *sd, int value)
+{
+	struct i2c_client *client = v4l2_get_subdevdata(sd);
+	struct sensor_info *info = to_state(sd);
+	int old = info->gain;
+	u16 data;
+	int ret;
+
+	/* 1/8 steps up to 4x, past that the analog x2 stage halves the resolution */
+	if (value <= 4)
+		data = value * 8;
+	else
+		data = MT9P031_GAIN_ANALOG_MULT | (value * 4);
+	ret = mt9p031_reg_write(client, REG_MT9P031_GLOBAL_GAIN, data);
+	if (ret < 0) {
+		csi_dev_err("mt9p031_reg_write err at sensor_s_gain!\n");
+		return ret;
+	}
+	info->gain = value;
+
+	/* the black level shifts with analog gain, do not let BLC creep after it */
+	if (info->blc_settle_ratio && old > 0 && value != old &&
+	    (value * 100 >= old * info->blc_settle_ratio ||
+	     old * 100 >= value * info->blc_settle_ratio))
+		ret = mt9p031_blc_recalculate(sd);
+	if (ret == 0 && info->flash_mode == V4L2_FLASH_MODE_AUTO)
+		ret = mt9p031_apply_strobe(sd, 0);
+	return ret;
+}
+/* *********************************************end of ******************************************** */
+
+/*
+ * Keep the frame rate the policy allows.  At a fixed rate the shutter
+ * width is held within the frame the solver chose, otherwise the sensor
+ * would stretch the frame by itself.  With auto_fps the frame is
+ * stretched through VBLANK to fit the exposure, down to min_fps, and
+ * given back as the exposure shortens.  Past 2047 rows of VBLANK the
+ * sensor does the stretching.  Each frame's period is in its metadata.
+ * Under mains lighting the shutter is rounded to whole flicker periods
+ * and a stretched frame keeps lasting whole periods as well.  A firing
+ * strobe needs all rows exposing at once for strobe_width, that wins
+ * over the frame rate; only the written shutter width is raised, so the
+ * exposure asked for comes back once the strobe is off.
+ *
+ * mt9p031_fit_frame() works the shutter width and VBLANK out without
+ * writing them, it returns the frame length in rows or 0 while the
+ * timing is not known and the request stands.
+ */
+static u32 mt9p031_fit_frame(struct sensor_info *info, int *value, u16 *vblank)
+{
+	struct mt9p031_timing t;
+	unsigned long flags;
+	u32 base, frame, max_frame, period;
+
+	spin_lock_irqsave(&info->fs_lock, flags);
+	t = info->timing;
+	spin_unlock_irqrestore(&info->fs_lock, flags);
+	/* not read back yet, nothing to go by */
+	if (t.pixel_rate == 0 || t.line_length == 0)
+		return 0;
+
+	base = t.height + info->vblank + 1;
+	max_frame = base;
+	if (info->auto_fps)
+		max_frame = max_t(u32, base, t.pixel_rate / info->min_fps / t.line_length);
+	if (info->strobe_on) {
+		u32 rows = t.height + max_t(u32, 1, DIV_ROUND_UP(info->strobe_width * 1000,
+								 t.row_time_ns));
+
+		*value = max_t(int, *value, rows);
+		max_frame = max(max_frame, rows + 1);
+	}
+	*value = clamp_t(int, *value, 1, max_frame - 1);
+	period = mt9p031_flicker_period(info->flicker_hz);
+	if (period && t.row_time_ns)
+		*value = mt9p031_flicker_shutter(*value, max_frame - 1, t.row_time_ns, period);
+
+	frame = clamp_t(u32, *value + 1, base, max_frame);
+	if (period && t.row_time_ns && frame > base &&
+	    mt9p031_flicker_rows(frame, t.row_time_ns, period) <= max_frame)
+		frame = mt9p031_flicker_rows(frame, t.row_time_ns, period);
+	*vblank = min_t(u32, frame - t.height - 1, 2047);
+	return frame;
+}
+
+static int mt9p031_fit_exposure(struct v4l2_subdev *sd, int *value)
+{
+	struct i2c_client *client = v4l2_get_subdevdata(sd);
+	struct sensor_info *info = to_state(sd);
+	u32 frame;
+	u16 vblank, cur;
+	int ret;
+
+	frame = mt9p031_fit_frame(info, value, &vblank);
+	if (frame == 0)
+		return 0;
+	cur = info->afr_vblank ? info->afr_vblank : info->vblank;
+	if (vblank == cur)
+		return 0;
+	ret = mt9p031_reg_write(client, REG_MT9P031_VBLANK, vblank);
+	if (ret < 0)
+		return ret;
+	/* VBLANK lands a frame ahead of the shutter width, with the old one */
+	mt9p031_refresh_timing(sd, 0);
+	info->afr_vblank = vblank == info->vblank ? 0 : vblank;
+	info->afr_changes++;
+	csi_dev_dbg("frame stretched to %u rows for a shutter of %d\n", frame, *value);
+	return 0;
+}
+
+/*
+ * The shutter width asked for is kept apart from what it was fitted to,
+ * every refit after a policy or frame change starts from the request.
+ */
+static int sensor_s_exp(struct v4l2_subdev *sd, int value)
+{
+	int ret;
+	struct i2c_client *client = v4l2_get_subdevdata(sd);
+	struct sensor_info *info = to_state(sd);
+	int req = value;
+
+	ret = mt9p031_fit_exposure(sd, &value);
+	if (ret < 0) {
+		csi_dev_err("mt9p031_fit_exposure err at sensor_s_exp!\n");
+		return ret;
+	}
+	/* the exposure is given in rows, which is what the shutter width counts */
+	//csi_dev_err("sensor_s_exp...set shutter %d\n",value);
+	ret = mt9p031_reg_write(client, REG_MT9P031_SHUTTER_WIDTH_U, (value >> 16) & 0xffff);
+	ret |= mt9p031_reg_write(client, REG_MT9P031_SHUTTER_WIDTH_L, value & 0xffff);
+	if (ret < 0) {
+		csi_dev_err("mt9p031_reg_write err at sensor_s_exp!\n");
+		return ret;
+	}
+	info->exp_req = req;
+	info->exp = value;
+	mt9p031_refresh_timing(sd, 0);
+	return 0;
+}
+
+static bool flash_strobe = 1;
+module_param(flash_strobe, bool, 0644);
+MODULE_PARM_DESC(flash_strobe, "The flash is fired by the sensor's STROBE pin rather than flash_io");
+
+/*
+ * Fire the flash from the sensor's STROBE output.  It is asserted once
+ * the last row has started exposing and negated when the first row's
+ * shutter width runs out, the only time every row sees the flash, so no
+ * half lit bands.  With the rolling shutter that window is the shutter
+ * width less the frame height, mt9p031_fit_exposure() keeps it at least
+ * strobe_width long.  AUTO starts firing once the exposure loop is out
+ * of shutter and using gain, and keeps firing until the next
+ * sensor_init(): lit by the flash the loop would soon turn it off again.
+ * @force rewrites Read Mode 1 and decides AUTO afresh.
+ */
+static int mt9p031_apply_strobe(struct v4l2_subdev *sd, int force)
+{
+	struct i2c_client *client = v4l2_get_subdevdata(sd);
+	struct sensor_info *info = to_state(sd);
+	u16 data = MT9P031_READ_MODE1_DEF;
+	int on, ret;
+
+	on = flash_strobe &&
+	     (info->flash_mode == V4L2_FLASH_MODE_ON ||
+	      (info->flash_mode == V4L2_FLASH_MODE_AUTO &&
+	       (info->gain > 1 || (info->strobe_on && !force))));
+	if (on == info->strobe_on && !force)
+		return 0;
+	if (on)
+		data |= MT9P031_READ_MODE1_STROBE_ENABLE;
+	/* also the idle level while disabled */
+	if (info->strobe_invert)
+		data |= MT9P031_READ_MODE1_STROBE_INVERT;
+	ret = mt9p031_reg_write(client, REG_MT9P031_READ_MODE1, data);
+	if (ret < 0)
+		return ret;
+	if (on == info->strobe_on)
+		return 0;
+	info->strobe_on = on;
+	csi_dev_dbg("strobe %s\n", on ? "on" : "off");
+	/* make room for the flash, or give back what was asked for */
+	if (info->exp_req)
+		ret = sensor_s_exp(sd, info->exp_req);
+	return ret;
+}
+
+static int sensor_s_flash_mode(struct v4l2_subdev *sd,
+    enum v4l2_flash_mode value)
+{
+	struct sensor_info *info = to_state(sd);
+	struct csi_dev *dev=(struct csi_dev *)dev_get_drvdata(sd->v4l2_dev->dev);
+	int flash_on,flash_off;
+	
+	flash_on = (dev->flash_pol!=0)?1:0;
+	flash_off = (flash_on==1)?0:1;
+	
+	switch (value) {
+	case V4L2_FLASH_MODE_OFF:
+		csi_gpio_write(sd,&dev->flash_io,flash_off);
+		break;
+	case V4L2_FLASH_MODE_AUTO:
+		if (!flash_strobe)
+			return -EINVAL;
+		/* fall through */
+	case V4L2_FLASH_MODE_ON:
+		/* with flash_strobe the sensor fires it, see mt9p031_apply_strobe() */
+		csi_gpio_write(sd, &dev->flash_io, flash_strobe ? flash_off : flash_on);
+		break;   
+	case V4L2_FLASH_MODE_TORCH:
+		csi_gpio_write(sd,&dev->flash_io,flash_on);
+		break;
+	case V4L2_FLASH_MODE_RED_EYE:   
+		return -EINVAL;
+		break;
+	default:
+		return -EINVAL;
+	}
+	
+	info->flash_mode = value;
+	info->strobe_invert = !flash_on;
+	/* otherwise sensor_init() programs it */
+	if (!info->configured)
+		return 0;
+	return mt9p031_apply_strobe(sd, 1);
+}
+
+static int mt9p031_store_test_pattern(struct sensor_info *info, u32 id, int value)
+{
+	switch (id) {
+	case V4L2_CID_TEST_PATTERN:
+		if (value < 0 || value >= ARRAY_SIZE(mt9p031_test_pattern_menu))
+			return -EINVAL;
+		info->test_pattern = value;
+		break;
+	case V4L2_CID_TEST_PATTERN_RED:
+	case V4L2_CID_TEST_PATTERN_GREENR:
+	case V4L2_CID_TEST_PATTERN_BLUE:
+		if (value < 0 || value > 4095)
+			return -EINVAL;
+		if (id == V4L2_CID_TEST_PATTERN_RED)
+			info->tp_red = value;
+		else if (id == V4L2_CID_TEST_PATTERN_GREENR)
+			info->tp_green = value;
+		else
+			info->tp_blue = value;
+		break;
+	case V4L2_CID_MT9P031_TEST_PATTERN_BAR_WIDTH:
+		/* the bar width must be odd */
+		if (value < 1 || value > 4095)
+			return -EINVAL;
+		info->tp_bar_width = value | 1;
+		break;
+	default:
+		return -EINVAL;
+	}
+	return 0;
+}
+
+static int sensor_s_test_pattern(struct v4l2_subdev *sd, u32 id, int value)
+{
+	int ret;
+	struct sensor_info *info = to_state(sd);
+
+	ret = mt9p031_store_test_pattern(info, id, value);
+	if (ret < 0)
+		return ret;
+
+	/* colours are only latched into the sensor while a pattern runs */
+	if (id != V4L2_CID_TEST_PATTERN && info->test_pattern == 0)
+		return 0;
+
+	ret = mt9p031_apply_test_pattern(sd);
+	if (ret < 0) {
+		csi_dev_err("mt9p031_apply_test_pattern err at sensor_s_test_pattern!\n");
+		return ret;
+	}
+	return 0;
+}
+
+static int sensor_g_timing(struct v4l2_subdev *sd, u32 id, __s32 *value)
+{
+	struct mt9p031_timing t;
+	int ret;
+
+	ret = mt9p031_get_timing(sd, &t);
+	if (ret < 0) {
+		csi_dev_err("mt9p031_get_timing err at sensor_g_timing!\n");
+		return ret;
+	}
+
+	switch (id) {
+	case V4L2_CID_PIXEL_RATE:
+		*value = t.pixel_rate;
+		break;
+	case V4L2_CID_HBLANK:
+		*value = t.hblank;
+		break;
+	case V4L2_CID_VBLANK:
+		*value = t.vblank;
+		break;
+	case V4L2_CID_MT9P031_FRAME_PERIOD:
+		*value = t.frame_period_us;
+		break;
+	case V4L2_CID_MT9P031_READOUT_TIME:
+		*value = t.readout_ns / 1000;
+		break;
+	case V4L2_CID_MT9P031_LATENCY:
+		/* the first row starts exposing, the last row is read out */
+		*value = (t.exposure_ns + t.readout_ns) / 1000;
+		break;
+	default:
+		return -EINVAL;
+	}
+	return 0;
+}
+
+/*
+ * Solve again for the current size and interval after a policy change.
+ */
+static int mt9p031_resolve(struct v4l2_subdev *sd)
+{
+	struct sensor_info *info = to_state(sd);
+	struct mt9p031_config cfg;
+	int ret;
+
+	ret = mt9p031_solve_current(info, mt9p031_target_interval(info, &info->interval), &cfg);
+	if (ret < 0)
+		return ret;
+	mt9p031_flicker_lock(info, info->ccm_info->mclk, &cfg);
+	mt9p031_commit_config(info, &cfg);
+	/* otherwise sensor_init() programs it */
+	if (info->configured)
+		ret = mt9p031_apply_config(sd);
+	return ret;
+}
+
+/*
+ * Low latency mode trades frame rate for the time a scene takes to reach
+ * memory: the solver goes for the highest PIXCLK and the least blanking,
+ * and Shutter_Delay is kept at 0 so rows start exposing as late as the
+ * shutter width allows.  With the electronic rolling shutter every row's
+ * exposure ends as it is read out, so what is left is tEXP plus the
+ * readout, see V4L2_CID_MT9P031_LATENCY.  Turning it off goes back to
+ * the interval last asked for through s_parm.  A failed switch leaves the
+ * control at its old value, so the sensor goes back to it too.
+ */
+static int sensor_s_low_latency(struct v4l2_subdev *sd, int value)
+{
+	struct sensor_info *info = to_state(sd);
+	int old = info->low_latency;
+	int ret;
+
+	info->low_latency = value;
+	ret = mt9p031_resolve(sd);
+	if (ret < 0) {
+		info->low_latency = old;
+		mt9p031_resolve(sd);
+	}
+	return ret;
+}
+
+/* A policy change refits the current exposure, a failed one is undone */
+static int sensor_s_auto_fps(struct v4l2_subdev *sd, u32 id, int value)
+{
+	struct sensor_info *info = to_state(sd);
+	int *field = id == V4L2_CID_EXPOSURE_AUTO_PRIORITY ? &info->auto_fps : &info->min_fps;
+	int old = *field;
+	int ret;
+
+	*field = value;
+	if (!info->configured || info->exp_req == 0)
+		return 0;
+	ret = sensor_s_exp(sd, info->exp_req);
+	if (ret < 0) {
+		*field = old;
+		sensor_s_exp(sd, info->exp_req);
+	}
+	return ret;
+}
+
+/* Mains frequency the setting stands for, AUTO follows the detector */
+static int mt9p031_power_line_hz(struct sensor_info *info)
+{
+	switch (info->power_line) {
+	case V4L2_CID_POWER_LINE_FREQUENCY_50HZ:
+		return 50;
+	case V4L2_CID_POWER_LINE_FREQUENCY_60HZ:
+		return 60;
+	case V4L2_CID_POWER_LINE_FREQUENCY_AUTO:
+		return info->flicker_detected;
+	default:
+		return 0;
+	}
+}
+
+/*
+ * Follow a new mains frequency: the frame is solved again to last whole
+ * flicker periods and the exposure is rounded to them, see
+ * mt9p031_flicker_lock() and mt9p031_fit_exposure().  If that fails the
+ * sensor goes back to the frequency it followed before.
+ */
+static int mt9p031_s_flicker(struct v4l2_subdev *sd)
+{
+	struct sensor_info *info = to_state(sd);
+	int hz = mt9p031_power_line_hz(info);
+	int old = info->flicker_hz;
+	int ret;
+
+	if (hz == old)
+		return 0;
+	info->flicker_hz = hz;
+	csi_dev_dbg("following %d Hz mains\n", hz);
+	ret = mt9p031_resolve(sd);
+	if (ret < 0) {
+		info->flicker_hz = old;
+		mt9p031_resolve(sd);
+	}
+	return ret;
+}
+
+static int sensor_s_power_line(struct v4l2_subdev *sd, int value)
+{
+	struct sensor_info *info = to_state(sd);
+	int old = info->power_line;
+	int ret;
+
+	info->power_line = value;
+	ret = mt9p031_s_flicker(sd);
+	if (ret < 0)
+		info->power_line = old;
+	return ret;
+}
+
+/* sin(2 pi k / 64) for the first quarter, Q14 */
+static const s16 mt9p031_sin_q14[17] = {
+	0, 1606, 3196, 4756, 6270, 7723, 9102, 10394, 11585,
+	12665, 13623, 14449, 15137, 15679, 16069, 16305, 16384,
+};
+
+/* sin(2 pi @k / 64), Q14 */
+static int mt9p031_sin64(u32 k)
+{
+	k &= 63;
+	if (k <= 16)
+		return mt9p031_sin_q14[k];
+	if (k <= 32)
+		return mt9p031_sin_q14[32 - k];
+	if (k <= 48)
+		return -mt9p031_sin_q14[k - 32];
+	return -mt9p031_sin_q14[64 - k];
+}
+
+/*
+ * Close a window of the detector.  A score is the share of the row
+ * means' power at that frequency in percent, a pure sine scores 50 and
+ * a flat or random scene about 100 / samples.  Only flicker verdicts
+ * count: once the exposure follows the right frequency the bands are
+ * gone and the detector has nothing left to see.
+ */
+static void mt9p031_flicker_decide(struct sensor_info *info)
+{
+	struct mt9p031_flicker *fl = &info->flicker;
+	u64 norm = (u64)fl->samples * fl->power;
+	int verdict = 0;
+	int k;
+
+	for (k = 0; k < 2; k++) {
+		s64 i = fl->i[k] >> 14;
+		s64 q = fl->q[k] >> 14;
+
+		fl->score[k] = norm ? div64_u64((u64)(i * i + q * q) * 100, norm) : 0;
+	}
+	k = fl->score[1] > fl->score[0];
+	if (fl->score[k] >= MT9P031_FLICKER_MIN_SCORE)
+		verdict = k ? 60 : 50;
+
+	if (verdict && verdict == fl->candidate)
+		fl->votes++;
+	else
+		fl->votes = 1;
+	fl->candidate = verdict;
+	if (verdict && fl->votes >= MT9P031_FLICKER_VOTES)
+		info->flicker_detected = verdict;
+
+	fl->windows++;
+	memset(fl->i, 0, sizeof(fl->i));
+	memset(fl->q, 0, sizeof(fl->q));
+	fl->power = 0;
+	fl->samples = 0;
+	fl->frames = 0;
+}
+
+/*
+ * Flicker detector.  Lamps on 50 or 60 Hz mains flicker at 100 or 120 Hz,
+ * which the rolling shutter turns into bands down the frame.  The row
+ * means are correlated with both frequencies at each row's readout time.
+ * Frames are summed coherently through their start times, one frame is
+ * too short to tell 100 from 120 Hz, and scene detail, which does not
+ * move with the light's phase, averages out over the window.  With the
+ * control at AUTO the verdict is applied at once.
+ */
+static int mt9p031_s_row_means(struct sensor_info *info, struct mt9p031_row_means *rm)
+{
+	static const int light_hz[2] = { 100, 120 };
+	struct mt9p031_flicker *fl = &info->flicker;
+	unsigned long flags;
+	u32 row_ns;
+	s64 sum = 0, avg, t;
+	int i, k, ret = 0;
+
+	if (rm->sof == 0 || rm->row_step == 0 ||
+	    rm->count < 8 || rm->count > MT9P031_ROW_MEANS)
+		return -EINVAL;
+
+	spin_lock_irqsave(&info->fs_lock, flags);
+	row_ns = info->timing.row_time_ns;
+	spin_unlock_irqrestore(&info->fs_lock, flags);
+	if (row_ns == 0)
+		return -EAGAIN;
+
+	mutex_lock(&info->lock);
+	/* a gap of more than a second starts over */
+	if (fl->frames == 0 || rm->sof < fl->t0 || rm->sof - fl->t0 > NSEC_PER_SEC) {
+		memset(fl->i, 0, sizeof(fl->i));
+		memset(fl->q, 0, sizeof(fl->q));
+		fl->power = 0;
+		fl->samples = 0;
+		fl->frames = 0;
+		fl->t0 = rm->sof;
+	}
+	t = rm->sof - fl->t0;
+
+	for (i = 0; i < rm->count; i++)
+		sum += rm->mean[i];
+	avg = div_s64(sum, rm->count);
+	for (i = 0; i < rm->count; i++) {
+		s64 x = rm->mean[i] - avg;
+		u64 ns = t + (u64)(rm->first_row + i * rm->row_step) * row_ns;
+
+		fl->power += x * x;
+		for (k = 0; k < 2; k++) {
+			u64 phase = ns * light_hz[k] * 64;
+
+			do_div(phase, NSEC_PER_SEC);
+			fl->i[k] += x * mt9p031_sin64(phase + 16);
+			fl->q[k] += x * mt9p031_sin64(phase);
+		}
+	}
+	fl->samples += rm->count;
+	if (++fl->frames >= MT9P031_FLICKER_FRAMES)
+		mt9p031_flicker_decide(info);
+
+	rm->detected = info->flicker_detected;
+	if (info->power_line == V4L2_CID_POWER_LINE_FREQUENCY_AUTO)
+		ret = mt9p031_s_flicker(&info->sd);
+	mutex_unlock(&info->lock);
+	return ret;
+}
+
+static int mt9p031_s_metering(struct sensor_info *info, const struct mt9p031_metering *m)
+{
+	int i, n;
+
+	if (m->spot_x > 1000 || m->spot_y > 1000 ||
+	    m->spot_width > 1000 || m->spot_height > 1000 ||
+	    m->cols == 0 || m->rows == 0 || m->cols * m->rows > MT9P031_WEIGHTS_MAX)
+		return -EINVAL;
+	for (i = n = 0; i < m->cols * m->rows; i++)
+		n += m->weight[i];
+	if (n == 0)
+		return -EINVAL;
+
+	mutex_lock(&info->lock);
+	info->meter = *m;
+	mutex_unlock(&info->lock);
+	return 0;
+}
+
+/*
+ * Weight of zone @x, @y of a @cols x @rows grid.  Center weighting goes
+ * from 8 in the middle down to 1 at the middle of the edges and beyond,
+ * a spot takes the zones whose centres it covers, the user grid is
+ * scaled onto the zones.
+ */
+static u32 mt9p031_zone_weight(struct sensor_info *info, int x, int y, int cols, int rows)
+{
+	const struct mt9p031_metering *m = &info->meter;
+	/* zone centre, per mille of the frame */
+	int cx = (2 * x + 1) * 500 / cols;
+	int cy = (2 * y + 1) * 500 / rows;
+	int r2;
+
+	switch (info->metering) {
+	case MT9P031_METERING_CENTER:
+		r2 = ((cx - 500) * (cx - 500) + (cy - 500) * (cy - 500)) / 250;
+		return r2 >= 1000 ? 1 : 8 - 7 * r2 / 1000;
+	case MT9P031_METERING_SPOT:
+		return abs(cx - m->spot_x) * 2 <= m->spot_width &&
+		       abs(cy - m->spot_y) * 2 <= m->spot_height;
+	case MT9P031_METERING_GRID:
+		return m->weight[(y * m->rows / rows) * m->cols + x * m->cols / cols];
+	default:
+		return 1;
+	}
+}
+
+/* Weighted mean of the zone means, a spot smaller than a zone takes its zone */
+static u32 mt9p031_meter(struct sensor_info *info, const struct mt9p031_zone_means *zm)
+{
+	u64 sum = 0, wsum = 0;
+	int x, y;
+
+	for (y = 0; y < zm->rows; y++)
+		for (x = 0; x < zm->cols; x++) {
+			u32 w = mt9p031_zone_weight(info, x, y, zm->cols, zm->rows);
+
+			sum += (u64)w * zm->mean[y * zm->cols + x];
+			wsum += w;
+		}
+	if (wsum == 0) {
+		x = min_t(int, info->meter.spot_x * zm->cols / 1000, zm->cols - 1);
+		y = min_t(int, info->meter.spot_y * zm->rows / 1000, zm->rows - 1);
+		return zm->mean[y * zm->cols + x];
+	}
+	return div64_u64(sum, wsum);
+}
+
+static int mt9p031_fs_latency(u32 id);
+static int mt9p031_fs_queue(struct sensor_info *info, u32 id, s32 value, int latency);
+
+/*
+ * One step of the exposure loop.  The level is taken as linear in
+ * shutter width times gain, half of the error is corrected per step and
+ * anything within 5% of the target is left alone and saved for a warm
+ * start.  Exposure goes first,
+ * as far as mt9p031_fit_exposure() lets it (the frame, min_fps with
+ * auto_fps, flicker periods), gain makes up the rest.  The EXPOSURE and
+ * GAIN controls read back what the loop wrote, see
+ * mt9p031_g_volatile_ctrl().  With frame sync on both go through the
+ * frame queue like any other write.
+ */
+static int mt9p031_ae_step(struct v4l2_subdev *sd, u32 level)
+{
+	struct sensor_info *info = to_state(sd);
+	unsigned long flags;
+	u32 exp = info->exp;
+	u64 ev, want;
+	u32 rows;
+	u16 vblank;
+	int gain = 1;
+	int fit;
+	int ret;
+
+	if (exp == 0) {
+		spin_lock_irqsave(&info->fs_lock, flags);
+		exp = info->timing.shutter_width;
+		spin_unlock_irqrestore(&info->fs_lock, flags);
+	}
+	if (exp == 0 || info->gain <= 0)
+		return 0;
+	if (abs((int)level - info->ae_target) * 20 < info->ae_target) {
+		mt9p031_warm_save(info);
+		return 0;
+	}
+
+	ev = (u64)exp * info->gain;
+	want = ev * info->ae_target;
+	do_div(want, max_t(u32, level, 1));
+	if (!info->ae_oneshot)
+		want = (ev + want) / 2;
+	info->ae_oneshot = 0;
+	rows = clamp_t(u64, want, 1, 65535 * 8);
+
+	fit = rows;
+	if (mt9p031_fit_frame(info, &fit, &vblank) && fit < rows) {
+		gain = min_t(u32, DIV_ROUND_UP(rows, fit), 8);
+		rows /= gain;
+	}
+	if (info->frame_sync) {
+		ret = mt9p031_fs_queue(info, V4L2_CID_EXPOSURE, rows,
+				       mt9p031_fs_latency(V4L2_CID_EXPOSURE));
+		if (ret == 0 && gain != info->gain)
+			ret = mt9p031_fs_queue(info, V4L2_CID_GAIN, gain,
+					       mt9p031_fs_latency(V4L2_CID_GAIN));
+	} else {
+		ret = sensor_s_exp(sd, rows);
+		if (ret == 0 && gain != info->gain)
+			ret = sensor_s_gain(sd, gain);
+	}
+	info->ae_steps++;
+	return ret;
+}
+
+static int mt9p031_s_zone_means(struct sensor_info *info, struct mt9p031_zone_means *zm)
+{
+	int ret = 0;
+
+	if (zm->cols == 0 || zm->rows == 0 || zm->cols * zm->rows > MT9P031_ZONES_MAX)
+		return -EINVAL;
+
+	mutex_lock(&info->lock);
+	info->ae_level = mt9p031_meter(info, zm);
+	if (info->autoexp == V4L2_EXPOSURE_AUTO && info->configured)
+		ret = mt9p031_ae_step(&info->sd, info->ae_level);
+	zm->level = info->ae_level;
+	zm->shutter_width = info->exp;
+	zm->gain = info->gain;
+	mutex_unlock(&info->lock);
+	return ret;
+}
+
+static int sensor_apply_ctrl(struct v4l2_subdev *sd, u32 id, s32 value)
+{
+	switch(id)
+	{
+		case V4L2_CID_GAIN:
+			return sensor_s_gain(sd, value);
+		case V4L2_CID_EXPOSURE:
+			return sensor_s_exp(sd, value);
+		case V4L2_CID_EXPOSURE_AUTO:
+			return sensor_s_autoexp(sd, value);
+		case V4L2_CID_VFLIP:
+			return sensor_s_vflip(sd, value);
+		case V4L2_CID_HFLIP:
+			return sensor_s_hflip(sd, value);
+		case V4L2_CID_TEST_PATTERN:
+		case V4L2_CID_TEST_PATTERN_RED:
+		case V4L2_CID_TEST_PATTERN_GREENR:
+		case V4L2_CID_TEST_PATTERN_BLUE:
+		case V4L2_CID_MT9P031_TEST_PATTERN_BAR_WIDTH:
+			return sensor_s_test_pattern(sd, id, value);
+	}
+	return -EINVAL;
+}
+
+/*
+ * Everything sensor_apply_ctrl() writes may go through the frame queue.
+ * The shutter registers latch one frame later than the other frame
+ * synchronised registers, hence the extra frame of latency for exposure.
+ */
+static int mt9p031_fs_latency(u32 id)
+{
+	switch (id) {
+	case V4L2_CID_EXPOSURE:
+		return 1;
+	case V4L2_CID_GAIN:
+	case V4L2_CID_VFLIP:
+	case V4L2_CID_HFLIP:
+	case V4L2_CID_TEST_PATTERN:
+	case V4L2_CID_TEST_PATTERN_RED:
+	case V4L2_CID_TEST_PATTERN_GREENR:
+	case V4L2_CID_TEST_PATTERN_BLUE:
+	case V4L2_CID_MT9P031_TEST_PATTERN_BAR_WIDTH:
+		return 0;
+	}
+	return -EINVAL;
+}
+
+static int mt9p031_fs_queue(struct sensor_info *info, u32 id, s32 value, int latency)
+{
+	struct mt9p031_fs_entry *e;
+	unsigned long flags;
+	u32 write;
+
+	spin_lock_irqsave(&info->fs_lock, flags);
+	if (info->fs_count == MT9P031_FS_QUEUE_LEN) {
+		spin_unlock_irqrestore(&info->fs_lock, flags);
+		return -EBUSY;
+	}
+
+	/*
+	 * Written in the next frame at the earliest, never ahead of what is
+	 * already queued, and later if a future frame was asked for.
+	 */
+	write = info->frame_count + 1;
+	if (info->fs_count) {
+		e = &info->fs_queue[(info->fs_head + info->fs_count - 1) % MT9P031_FS_QUEUE_LEN];
+		if ((s32)(e->write_frame - write) > 0)
+			write = e->write_frame;
+	}
+	if (info->fs_target && (s32)(info->fs_target - (write + 1 + latency)) > 0)
+		write = info->fs_target - 1 - latency;
+
+	e = &info->fs_queue[(info->fs_head + info->fs_count) % MT9P031_FS_QUEUE_LEN];
+	e->id = id;
+	e->value = value;
+	e->write_frame = write;
+	e->frame = write + 1 + latency;
+	info->fs_last_frame = e->frame;
+	info->fs_count++;
+	spin_unlock_irqrestore(&info->fs_lock, flags);
+	return 0;
+}
+
+/* Take the oldest entry off the queue if its frame has come */
+static int mt9p031_fs_pop(struct sensor_info *info, struct mt9p031_fs_entry *out, int all)
+{
+	struct mt9p031_fs_entry *e;
+	unsigned long flags;
+	int ret = 0;
+
+	spin_lock_irqsave(&info->fs_lock, flags);
+	if (info->fs_count) {
+		e = &info->fs_queue[info->fs_head];
+		if (all || (s32)(e->write_frame - info->frame_count) <= 0) {
+			if (!all && e->write_frame != info->frame_count)
+				info->fs_late++;
+			*out = *e;
+			info->fs_head = (info->fs_head + 1) % MT9P031_FS_QUEUE_LEN;
+			info->fs_count--;
+			ret = 1;
+		}
+	}
+	spin_unlock_irqrestore(&info->fs_lock, flags);
+	return ret;
+}
+
+/* Called with info->lock held */
+static void mt9p031_fs_flush(struct sensor_info *info, int apply)
+{
+	struct mt9p031_fs_entry e;
+
+	while (mt9p031_fs_pop(info, &e, 1))
+		if (apply)
+			sensor_apply_ctrl(&info->sd, e.id, e.value);
+}
+
+/*
+ * Record a frame start, called from the vsync interrupt with fs_lock held.
+ * The first row is read out at the FRAME_VALID edge, so its exposure began
+ * tEXP before it.
+ */
+static void mt9p031_frame_start(struct sensor_info *info, s64 sof)
+{
+	struct mt9p031_frame_rec *rec;
+	s64 prev, period;
+
+	if (info->exp_pending &&
+	    (s32)(info->frame_count - info->exp_pending_frame) >= 0) {
+		info->timing.exposure_ns = info->exp_pending_ns;
+		info->exp_pending = 0;
+	}
+	/* a bad frame lasts one frame */
+	info->settings.flags &= ~MT9P031_FRAME_BAD;
+	if ((info->settings_pending & 1) &&
+	    (s32)(info->frame_count - info->settings_frame) >= 0) {
+		u32 shutter_width = info->settings.shutter_width;
+		u32 frame_period_us = info->settings.frame_period_us;
+
+		info->settings = info->settings_next;
+		info->settings_next.flags &= ~MT9P031_FRAME_BAD;
+		info->settings.shutter_width = shutter_width;
+		if (info->settings_pending & 2)
+			info->settings.frame_period_us = info->period_early_us ?
+							 info->period_early_us : frame_period_us;
+		info->period_early_us = 0;
+		info->settings_pending &= ~1;
+	}
+	if ((info->settings_pending & 2) &&
+	    (s32)(info->frame_count - info->shutter_frame) >= 0) {
+		info->settings.shutter_width = info->settings_next.shutter_width;
+		info->settings.frame_period_us = info->settings_next.frame_period_us;
+		info->settings_pending &= ~2;
+	}
+
+	prev = info->frames[(info->frame_count - 1) % MT9P031_FRAME_HISTORY].sof;
+	rec = &info->frames[info->frame_count % MT9P031_FRAME_HISTORY];
+	rec->sequence = info->frame_count;
+	rec->exposure_ns = info->timing.exposure_ns;
+	rec->readout_ns = info->timing.readout_ns;
+	rec->sof = sof;
+	rec->settings = info->settings;
+
+	if (prev == 0)
+		return;
+	period = sof - prev;
+	if (info->period_count == 0 || period < info->period_min)
+		info->period_min = period;
+	if (period > info->period_max)
+		info->period_max = period;
+	info->period_sum += period;
+	info->period_count++;
+}
+
+/*
+ * Move on to the next alternating window, from the vsync thread with
+ * info->lock held.  The starts are frame synchronised: written during
+ * this frame they apply to the next one, and Synchronize_Changes makes
+ * sure both land on the same frame.  The index follows the frame's
+ * settings the same way the window does.  Row_Start is only written
+ * when it moves, and then the window stays for the frame after the bad
+ * one as well.
+ */
+static int mt9p031_roi_next(struct sensor_info *info)
+{
+	struct i2c_client *client = v4l2_get_subdevdata(&info->sd);
+	const struct mt9p031_roi *roi;
+	unsigned long flags;
+	u16 row_start;
+	int ret = 0;
+
+	if (info->roi_hold) {
+		info->roi_hold = 0;
+		return 0;
+	}
+	info->roi_next = (info->roi_next + 1) % info->roi_count;
+	roi = &info->roi[info->roi_next];
+	spin_lock_irqsave(&info->fs_lock, flags);
+	info->settings_next.roi = info->roi_next;
+	row_start = info->settings_next.row_start;
+	spin_unlock_irqrestore(&info->fs_lock, flags);
+
+	if (info->sync_depth == 0)
+		mt9p031_set_output_control(&info->sd, 0, MT9P031_OUTPUT_CONTROL_SYN);
+	if (roi->row_start != row_start) {
+		ret = mt9p031_reg_write(client, REG_MT9P031_ROWSTART, roi->row_start);
+		info->roi_hold = 1;
+	}
+	ret |= mt9p031_reg_write(client, REG_MT9P031_COLSTART,
+				 mt9p031_col_start(info, roi->col_start, info->read_mode2));
+	if (info->sync_depth == 0)
+		ret |= mt9p031_set_output_control(&info->sd, MT9P031_OUTPUT_CONTROL_SYN, 0);
+	info->roi_switches++;
+	return ret;
+}
+
+/*
+ * Set the alternating windows.  A binned mode gives way to its window
+ * mode first and comes back with a count of 0, see mt9p031_window_mode().
+ * The host format does not change, the sizes are the same.
+ */
+static int mt9p031_s_roi(struct sensor_info *info, const struct mt9p031_roi_set *set)
+{
+	struct i2c_client *client = v4l2_get_subdevdata(&info->sd);
+	const struct mt9p031_format_params *fp;
+	struct mt9p031_config cfg;
+	unsigned long flags;
+	int i, mode, ret = 0;
+
+	if (set->count == 1 || set->count > MT9P031_ROI_MAX)
+		return -EINVAL;
+	if (set->count && info->vsync_irq <= 0)
+		return -ENODEV;
+
+	mutex_lock(&info->lock);
+	mode = set->count ? mt9p031_window_mode(info->mode) : info->mode;
+	fp = &mt9p031_supported_formats[mode];
+	for (i = 0; i < set->count; i++) {
+		const struct mt9p031_roi *r = &set->roi[i];
+
+		if (r->row_start % (2 * (fp->row_bin + 1)) ||
+		    r->col_start % (4 * (fp->col_bin + 1)) ||
+		    r->row_start < MT9P031_ACTIVE_ROW ||
+		    r->row_start + fp->row_size >= MT9P031_ACTIVE_ROW + MT9P031_ACTIVE_HEIGHT ||
+		    r->col_start < MT9P031_ACTIVE_COL ||
+		    r->col_start + fp->col_size >= MT9P031_ACTIVE_COL + MT9P031_ACTIVE_WIDTH) {
+			ret = -EINVAL;
+			goto out;
+		}
+	}
+
+	if (set->count ? mode != info->mode : fp->window) {
+		if (set->count)
+			ret = mt9p031_solve_mode(info->ccm_info->mclk, mode,
+						 mt9p031_target_interval(info, &info->interval), &cfg);
+		else
+			ret = mt9p031_solve(info->ccm_info->mclk, info->width, info->height,
+					    mt9p031_target_interval(info, &info->interval), &cfg);
+		if (ret < 0)
+			goto out;
+		mt9p031_flicker_lock(info, info->ccm_info->mclk, &cfg);
+		/* drops the old set */
+		mt9p031_commit_config(info, &cfg);
+		mode = -1;
+	}
+
+	memcpy(info->roi, set->roi, sizeof(info->roi));
+	info->roi_count = set->count;
+	/* the next frame start writes the first one */
+	info->roi_next = set->count ? set->count - 1 : 0;
+	info->roi_hold = 0;
+
+	if (mode < 0) {
+		/* otherwise sensor_init() programs it */
+		if (info->configured)
+			ret = mt9p031_apply_config(&info->sd);
+	} else if (set->count == 0 && info->configured) {
+		spin_lock_irqsave(&info->fs_lock, flags);
+		info->settings_next.roi = 0;
+		spin_unlock_irqrestore(&info->fs_lock, flags);
+		ret = mt9p031_reg_write(client, REG_MT9P031_ROWSTART, fp->row_start);
+		ret |= mt9p031_reg_write(client, REG_MT9P031_COLSTART,
+					 mt9p031_col_start(info, fp->col_start, info->read_mode2));
+	}
+out:
+	mutex_unlock(&info->lock);
+	return ret;
+}
+
+static irqreturn_t mt9p031_vsync_irq(int irq, void *data)
+{
+	struct sensor_info *info = data;
+	irqreturn_t ret = IRQ_HANDLED;
+	ktime_t now = ktime_get();
+
+	spin_lock(&info->fs_lock);
+	write_seqcount_begin(&info->frames_seq);
+	info->frame_count++;
+	mt9p031_frame_start(info, ktime_to_ns(now));
+	write_seqcount_end(&info->frames_seq);
+	if (info->fs_count || info->roi_count)
+		ret = IRQ_WAKE_THREAD;
+	spin_unlock(&info->fs_lock);
+	return ret;
+}
+
+static irqreturn_t mt9p031_vsync_thread(int irq, void *data)
+{
+	struct sensor_info *info = data;
+	struct mt9p031_fs_entry e;
+
+	mutex_lock(&info->lock);
+	while (mt9p031_fs_pop(info, &e, 0))
+		if (sensor_apply_ctrl(&info->sd, e.id, e.value) < 0)
+			csi_dev_err("frame sync write of ctrl 0x%x failed at frame %u\n",
+				    e.id, e.write_frame);
+	if (info->roi_count && info->configured && mt9p031_roi_next(info) < 0)
+		csi_dev_err("window switch failed at frame %u\n", info->frame_count);
+	mutex_unlock(&info->lock);
+	return IRQ_HANDLED;
+}
+
+/*
+ * Look up the interrupt for the vsync line of our CSI port.  The A20 can
+ * only raise interrupts on the EINT capable pins, which PE03/PG03 are not,
+ * so a board may route FRAME_VALID to one of those as well and name it in
+ * csi_vsync_eint.  Without either, controls keep being written at once.
+ */
+static int mt9p031_vsync_init(struct v4l2_subdev *sd)
+{
+	struct csi_dev *dev=(struct csi_dev *)dev_get_drvdata(sd->v4l2_dev->dev);
+	struct sensor_info *info = to_state(sd);
+	script_item_u item;
+	char main_key[16];
+	int irq = -ENXIO;
+	int ret;
+
+	if (info->vsync_irq)
+		return info->vsync_irq > 0 ? 0 : info->vsync_irq;
+
+	snprintf(main_key, sizeof(main_key), "csi%d_para", dev->id);
+	if (script_get_item(main_key, "csi_vsync", &item) == SCIRPT_ITEM_VALUE_TYPE_PIO)
+		irq = gpio_to_irq(item.gpio.gpio);
+	if (irq <= 0 &&
+	    script_get_item(main_key, "csi_vsync_eint", &item) == SCIRPT_ITEM_VALUE_TYPE_PIO &&
+	    gpio_request(item.gpio.gpio, "mt9p031 vsync") == 0) {
+		info->vsync_gpio = item.gpio.gpio;
+		gpio_direction_input(info->vsync_gpio);
+		irq = gpio_to_irq(info->vsync_gpio);
+	}
+	if (irq <= 0) {
+		ret = -ENXIO;
+		goto err;
+	}
+
+	ret = request_threaded_irq(irq, mt9p031_vsync_irq, mt9p031_vsync_thread,
+				   IRQF_TRIGGER_RISING | IRQF_ONESHOT,
+				   "mt9p031 vsync", info);
+	if (ret < 0)
+		goto err;
+
+	info->vsync_irq = irq;
+	csi_dev_print("%s vsync on irq %d\n", main_key, irq);
+	return 0;
+
+err:
+	csi_dev_print("no vsync interrupt for %s, frame sync disabled\n", main_key);
+	if (info->vsync_gpio >= 0) {
+		gpio_free(info->vsync_gpio);
+		info->vsync_gpio = -1;
+	}
+	info->vsync_irq = ret;
+	return ret;
+}
+
+static int sensor_s_frame_sync(struct v4l2_subdev *sd, int value)
+{
+	struct sensor_info *info = to_state(sd);
+
+	if (value && info->vsync_irq <= 0)
+		return -ENODEV;
+
+	info->frame_sync = value ? 1 : 0;
+	if (!info->frame_sync)
+		mt9p031_fs_flush(info, 1);
+	return 0;
+}
+
+static int sensor_g_frame_sync(struct v4l2_subdev *sd, u32 id, __s32 *value)
+{
+	struct sensor_info *info = to_state(sd);
+	unsigned long flags;
+
+	spin_lock_irqsave(&info->fs_lock, flags);
+	switch (id) {
+	case V4L2_CID_MT9P031_FRAME_SYNC:
+		*value = info->frame_sync;
+		break;
+	case V4L2_CID_MT9P031_FRAME_SYNC_TARGET:
+		*value = info->fs_target;
+		break;
+	case V4L2_CID_MT9P031_FRAME_COUNT:
+		*value = info->frame_count;
+		break;
+	case V4L2_CID_MT9P031_FRAME_SYNC_LAST:
+		*value = info->fs_last_frame;
+		break;
+	}
+	spin_unlock_irqrestore(&info->fs_lock, flags);
+	return 0;
+}
+
+/*
+ * Stereo start.  All sensors that are up are parked at the start of a
+ * frame with Restart + Pause_Restart and then let go together by clearing
+ * Pause_Restart.  They sit on different i2c buses, so "together" means
+ * back to back; the frame starts seen on vsync tell how close it got.
+ * While stereo is on the skew is checked periodically and the pair is
+ * restarted again once it drifts past stereo_resync_us.
+ */
+#define MT9P031_STEREO_MAX	4
+
+static LIST_HEAD(mt9p031_instances);
+static DEFINE_MUTEX(mt9p031_instances_lock);	/* Also guards the stereo state */
+static int mt9p031_stereo_active;
+static u32 mt9p031_stereo_resyncs;
+static s64 mt9p031_stereo_release_ns;	/* First to last release write */
+
+static unsigned int stereo_resync_us = 500;
+module_param(stereo_resync_us, uint, 0644);
+MODULE_PARM_DESC(stereo_resync_us, "Restart a stereo pair whose frame starts drift further apart (us, 0 = never)");
+
+static void mt9p031_stereo_work_fn(struct work_struct *work);
+static DECLARE_DELAYED_WORK(mt9p031_stereo_work, mt9p031_stereo_work_fn);
+
+static int mt9p031_stereo_member(struct sensor_info *info)
+{
+	return info->configured && !info->standby && info->streaming;
+}
+
+static int mt9p031_stereo_start_locked(void)
+{
+	struct sensor_info *members[MT9P031_STEREO_MAX];
+	struct sensor_info *info;
+	struct i2c_client *client;
+	struct i2c_msg msg[MT9P031_STEREO_MAX];
+	u8 buf[MT9P031_STEREO_MAX][3];
+	ktime_t first, last;
+	int n = 0, i, ret = 0;
+
+	list_for_each_entry(info, &mt9p031_instances, list)
+		if (mt9p031_stereo_member(info) && n < MT9P031_STEREO_MAX)
+			members[n++] = info;
+	if (n < 2)
+		return -ENODEV;
+
+	for (i = 0; i < n; i++)
+		mutex_lock_nested(&members[i]->lock, i);
+
+	/* the restart is done within 2 tROW, then the sensor waits at row 0 */
+	for (i = 0; i < n; i++) {
+		client = v4l2_get_subdevdata(&members[i]->sd);
+		ret |= mt9p031_reg_write(client, REG_MT9P031_RESTART,
+					 MT9P031_RESTART_PAUSE | MT9P031_RESTART_RESTART);
+	}
+	msleep(2);
+
+	/* Restart has to stay set while Pause_Restart is cleared */
+	for (i = 0; i < n; i++) {
+		client = v4l2_get_subdevdata(&members[i]->sd);
+		buf[i][0] = REG_MT9P031_RESTART;
+		buf[i][1] = 0;
+		buf[i][2] = MT9P031_RESTART_RESTART;
+		msg[i].addr = client->addr;
+		msg[i].flags = 0;
+		msg[i].len = 3;
+		msg[i].buf = buf[i];
+	}
+	first = ktime_get();
+	for (i = 0; i < n; i++) {
+		client = v4l2_get_subdevdata(&members[i]->sd);
+		if (i2c_transfer(client->adapter, &msg[i], 1) < 0)
+			ret = -EIO;
+	}
+	last = ktime_get();
+	mt9p031_stereo_release_ns = ktime_to_ns(ktime_sub(last, first));
+	for (i = 0; i < n; i++)
+		mt9p031_bus_xfer(v4l2_get_subdevdata(&members[i]->sd), msg[i].len);
+
+	for (i = n - 1; i >= 0; i--)
+		mutex_unlock(&members[i]->lock);
+
+	if (ret < 0)
+		csi_dev_err("stereo start failed\n");
+	return ret < 0 ? -EIO : 0;
+}
+
+/* Offset of b's latest frame start from a's, folded into +-half a frame */
+static int mt9p031_stereo_skew(struct sensor_info *a, struct sensor_info *b, s64 *skew)
+{
+	unsigned long flags;
+	s64 sof_a, sof_b, period, d;
+
+	spin_lock_irqsave(&a->fs_lock, flags);
+	sof_a = a->frames[a->frame_count % MT9P031_FRAME_HISTORY].sof;
+	period = (s64)a->timing.frame_period_us * 1000;
+	spin_unlock_irqrestore(&a->fs_lock, flags);
+	spin_lock_irqsave(&b->fs_lock, flags);
+	sof_b = b->frames[b->frame_count % MT9P031_FRAME_HISTORY].sof;
+	spin_unlock_irqrestore(&b->fs_lock, flags);
+
+	if (sof_a == 0 || sof_b == 0 || period == 0)
+		return -EAGAIN;
+
+	d = sof_b - sof_a;
+	d -= div_s64(d, period) * period;
+	if (d > period / 2)
+		d -= period;
+	else if (d <= -period / 2)
+		d += period;
+	*skew = d;
+	return 0;
+}
+
+static void mt9p031_stereo_work_fn(struct work_struct *work)
+{
+	struct sensor_info *ref = NULL, *info;
+	int resync = 0;
+
+	mutex_lock(&mt9p031_instances_lock);
+	if (!mt9p031_stereo_active)
+		goto out;
+
+	list_for_each_entry(info, &mt9p031_instances, list) {
+		if (!mt9p031_stereo_member(info) || info->vsync_irq <= 0)
+			continue;
+		if (ref == NULL) {
+			ref = info;
+			info->stereo_skew_ns = 0;
+			continue;
+		}
+		if (mt9p031_stereo_skew(ref, info, &info->stereo_skew_ns) == 0 &&
+		    stereo_resync_us &&
+		    abs64(info->stereo_skew_ns) > (s64)stereo_resync_us * 1000)
+			resync = 1;
+	}
+	if (resync) {
+		mt9p031_stereo_resyncs++;
+		csi_dev_print("stereo skew over %u us, restarting\n", stereo_resync_us);
+		mt9p031_stereo_start_locked();
+	}
+	schedule_delayed_work(&mt9p031_stereo_work, msecs_to_jiffies(500));
+out:
+	mutex_unlock(&mt9p031_instances_lock);
+}
+
+static int sensor_s_stereo_sync(struct v4l2_subdev *sd, int value)
+{
+	int ret = 0;
+
+	mutex_lock(&mt9p031_instances_lock);
+	if (value)
+		ret = mt9p031_stereo_start_locked();
+	mt9p031_stereo_active = value && ret == 0;
+	mutex_unlock(&mt9p031_instances_lock);
+
+	if (mt9p031_stereo_active)
+		schedule_delayed_work(&mt9p031_stereo_work, msecs_to_jiffies(500));
+	else
+		cancel_delayed_work_sync(&mt9p031_stereo_work);
+	return ret;
+}
+
+static int sensor_g_stereo_sync(struct v4l2_subdev *sd, u32 id, __s32 *value)
+{
+	struct sensor_info *info = to_state(sd);
+
+	mutex_lock(&mt9p031_instances_lock);
+	if (id == V4L2_CID_MT9P031_STEREO_SYNC)
+		*value = mt9p031_stereo_active;
+	else
+		*value = div_s64(info->stereo_skew_ns, 1000);
+	mutex_unlock(&mt9p031_instances_lock);
+	return 0;
+}
+
+/*
+ * Stall watchdog.  While streaming the vsync interrupt should count a
+ * frame start every frame period; if it stops for watchdog_frames of
+ * them the sensor is kicked back into life, gently first:
+ *   1. Restart, which aborts the frame and starts a new one,
+ *   2. rewrite every register the driver keeps a copy of and Restart,
+ *      for a sensor that lost part of its state on a glitch,
+ *   3. a full power cycle and sensor_init().
+ * Each stage gets one watchdog period to show a frame before the next one
+ * is tried.  A sensor that does not come back from a power cycle is left
+ * alone until it is streamed again.
+ */
+static unsigned int watchdog_frames = 4;
+module_param(watchdog_frames, uint, 0644);
+MODULE_PARM_DESC(watchdog_frames, "Frame periods without a frame start before recovery (0 = off)");
+
+enum {
+	MT9P031_WD_OK,
+	MT9P031_WD_RESTART,
+	MT9P031_WD_RESYNC,
+	MT9P031_WD_POWER,
+	MT9P031_WD_FAILED,
+};
+
+static int mt9p031_wd_armed(struct sensor_info *info)
+{
+	return watchdog_frames && info->vsync_irq > 0 && info->streaming &&
+	       info->configured && !info->standby;
+}
+
+static unsigned long mt9p031_wd_period(struct sensor_info *info)
+{
+	u32 us;
+
+	us = max_t(u32, info->timing.frame_period_us, info->timing.exposure_ns / 1000);
+	return msecs_to_jiffies(max_t(u32, DIV_ROUND_UP(us * watchdog_frames, 1000), 10));
+}
+
+static void mt9p031_wd_arm(struct sensor_info *info)
+{
+	if (!mt9p031_wd_armed(info))
+		return;
+	info->wd_last_count = info->frame_count;
+	if (info->wd_stage == MT9P031_WD_FAILED)
+		info->wd_stage = MT9P031_WD_OK;
+	schedule_delayed_work(&info->wd_work, mt9p031_wd_period(info));
+}
+
+/* Stage 2: bring the sensor back to what the driver last programmed */
+static int mt9p031_resync(struct v4l2_subdev *sd)
+{
+	struct i2c_client *client = v4l2_get_subdevdata(sd);
+	struct sensor_info *info = to_state(sd);
+	int ret;
+
+	ret = mt9p031_set_output_control(sd, 0, 0);
+	ret |= mt9p031_set_pll(sd, &info->pll);
+	ret |= mt9p031_set_params(client, info->width, info->height);
+	ret |= mt9p031_apply_test_pattern(sd);
+	ret |= mt9p031_apply_blc(sd);
+	ret |= sensor_s_gain(sd, info->gain);
+	if (info->exp_req)
+		ret |= sensor_s_exp(sd, info->exp_req);
+	ret |= mt9p031_restart(sd);
+	return ret;
+}
+
+static void mt9p031_wd_work_fn(struct work_struct *work)
+{
+	struct sensor_info *info = container_of(to_delayed_work(work), struct sensor_info, wd_work);
+	struct v4l2_subdev *sd = &info->sd;
+	u32 count = info->frame_count;
+	int ret = 0;
+
+	if (!mt9p031_wd_armed(info))
+		return;
+
+	if (count != info->wd_last_count) {
+		if (info->wd_stage != MT9P031_WD_OK) {
+			info->wd_outage_ns = ktime_to_ns(ktime_sub(ktime_get(), info->wd_stall));
+			csi_dev_print("frames back after %lld us, stage %d\n",
+				      div_s64(info->wd_outage_ns, 1000), info->wd_stage);
+		}
+		info->wd_stage = MT9P031_WD_OK;
+		info->wd_last_count = count;
+		schedule_delayed_work(&info->wd_work, mt9p031_wd_period(info));
+		return;
+	}
+
+	switch (info->wd_stage) {
+	case MT9P031_WD_OK:
+		info->wd_stall = ktime_get();
+		info->wd_stage = MT9P031_WD_RESTART;
+		info->wd_restarts++;
+		csi_dev_err("no frame start for %u frames, restarting\n", watchdog_frames);
+		mutex_lock(&info->lock);
+		ret = mt9p031_restart(sd);
+		mutex_unlock(&info->lock);
+		break;
+	case MT9P031_WD_RESTART:
+		info->wd_stage = MT9P031_WD_RESYNC;
+		info->wd_resyncs++;
+		csi_dev_err("still stalled, rewriting registers\n");
+		mutex_lock(&info->lock);
+		ret = mt9p031_resync(sd);
+		mutex_unlock(&info->lock);
+		break;
+	case MT9P031_WD_RESYNC:
+		info->wd_stage = MT9P031_WD_POWER;
+		info->wd_power_cycles++;
+		csi_dev_err("still stalled, power cycling\n");
+		/*
+		 * Held across the lot so a host power call or sensor_init()
+		 * cannot land in the middle.  Each pair of sequences gives
+		 * back the clock reference it took, and standby on and off
+		 * drive the standby pin back to where streaming left it.
+		 */
+		mutex_lock(&info->lock);
+		ret = mt9p031_power_raw(sd, CSI_SUBDEV_PWR_OFF);
+		ret |= mt9p031_power_raw(sd, CSI_SUBDEV_PWR_ON);
+		ret |= mt9p031_power_raw(sd, CSI_SUBDEV_STBY_ON);
+		ret |= mt9p031_power_raw(sd, CSI_SUBDEV_STBY_OFF);
+		if (ret == 0)
+			ret = mt9p031_init(sd, 0);
+		mutex_unlock(&info->lock);
+		break;
+	default:
+		info->wd_stage = MT9P031_WD_FAILED;
+		info->wd_failures++;
+		csi_dev_err("sensor did not recover, giving up until the next stream on\n");
+		return;
+	}
+	if (ret < 0)
+		csi_dev_err("watchdog stage %d failed %d\n", info->wd_stage, ret);
+
+	/* sensor_init() re-armed us already */
+	if (info->wd_stage != MT9P031_WD_POWER || ret < 0)
+		schedule_delayed_work(&info->wd_work, mt9p031_wd_period(info));
+}
+
+static int mt9p031_g_volatile_ctrl(struct v4l2_ctrl *ctrl)
+{
+	struct sensor_info *info = container_of(ctrl->handler, struct sensor_info, hdl);
+
+	switch (ctrl->id) {
+	case V4L2_CID_PIXEL_RATE:
+	case V4L2_CID_HBLANK:
+	case V4L2_CID_VBLANK:
+	case V4L2_CID_MT9P031_FRAME_PERIOD:
+	case V4L2_CID_MT9P031_READOUT_TIME:
+	case V4L2_CID_MT9P031_LATENCY:
+		return sensor_g_timing(&info->sd, ctrl->id, &ctrl->val);
+	case V4L2_CID_MT9P031_FRAME_COUNT:
+	case V4L2_CID_MT9P031_FRAME_SYNC_LAST:
+		return sensor_g_frame_sync(&info->sd, ctrl->id, &ctrl->val);
+	case V4L2_CID_MT9P031_STEREO_SYNC:
+	case V4L2_CID_MT9P031_STEREO_SKEW:
+		return sensor_g_stereo_sync(&info->sd, ctrl->id, &ctrl->val);
+	/* volatile while the loop owns them */
+	case V4L2_CID_EXPOSURE:
+		if (info->exp_req)
+			ctrl->val = info->exp_req;
+		return 0;
+	case V4L2_CID_GAIN:
+		ctrl->val = info->gain;
+		return 0;
+	}
+	return -EINVAL;
+}
+
+/*
+ * Exposure and gain are clustered with V4L2_CID_EXPOSURE_AUTO.  Under AUTO
+ * the loop writes them and they read back what it wrote.  Going back to
+ * MANUAL the framework reads them once more, and both are written again so
+ * the sensor and the cached values start out the same.
+ */
+static int mt9p031_s_ae_ctrls(struct sensor_info *info)
+{
+	int was_auto = info->autoexp == V4L2_EXPOSURE_AUTO;
+	int latency;
+	int ret = 0;
+	int i;
+
+	ret = sensor_s_autoexp(&info->sd, info->ae[0]->val);
+	if (ret < 0 || info->autoexp == V4L2_EXPOSURE_AUTO)
+		return ret;
+
+	for (i = 1; i < ARRAY_SIZE(info->ae) && ret == 0; i++) {
+		struct v4l2_ctrl *c = info->ae[i];
+
+		if (!c->is_new && !was_auto)
+			continue;
+		latency = mt9p031_fs_latency(c->id);
+		if (info->frame_sync)
+			ret = mt9p031_fs_queue(info, c->id, c->val, latency);
+		else
+			ret = sensor_apply_ctrl(&info->sd, c->id, c->val);
+	}
+	return ret;
+}
+
+/*
+ * The handler keeps the current value of every control, so nothing here
+ * reads the sensor back.  A cluster comes in once, through its first
+ * control, with is_new set on the members the caller touched.  Called
+ * with info->lock held.
+ */
+static int mt9p031_s_ctrl_raw(struct v4l2_ctrl *ctrl)
+{
+	struct sensor_info *info = container_of(ctrl->handler, struct sensor_info, hdl);
+	struct v4l2_subdev *sd = &info->sd;
+	int latency;
+	int ret = 0;
+	int i;
+
+	switch (ctrl->id) {
+	case V4L2_CID_MT9P031_FRAME_SYNC:
+		return sensor_s_frame_sync(sd, ctrl->val);
+	case V4L2_CID_EXPOSURE_AUTO:
+		return mt9p031_s_ae_ctrls(info);
+	case V4L2_CID_MT9P031_FRAME_SYNC_TARGET:
+		info->fs_target = ctrl->val;
+		return 0;
+	}
+
+	latency = mt9p031_fs_latency(ctrl->id);
+	if (latency >= 0 && info->frame_sync) {
+		for (i = 0; i < ctrl->ncontrols && ret == 0; i++)
+			if (ctrl->cluster[i]->is_new)
+				ret = mt9p031_fs_queue(info, ctrl->cluster[i]->id,
+						       ctrl->cluster[i]->val, latency);
+		return ret;
+	}
+
+	switch (ctrl->id) {
+	case V4L2_CID_HFLIP:
+		ret = sensor_s_flip(sd, info->flip[0]->val, info->flip[1]->val);
+		break;
+	case V4L2_CID_TEST_PATTERN:
+		for (i = 0; i < ARRAY_SIZE(info->tp); i++)
+			if (info->tp[i]->is_new)
+				mt9p031_store_test_pattern(info, info->tp[i]->id, info->tp[i]->val);
+		if (info->tp[0]->is_new || info->test_pattern)
+			ret = mt9p031_apply_test_pattern(sd);
+		break;
+	case V4L2_CID_CAMERA_FLASH_MODE:
+		ret = sensor_s_flash_mode(sd, (enum v4l2_flash_mode)ctrl->val);
+		break;
+	case V4L2_CID_MT9P031_BLC_AUTO:
+		info->blc_auto = info->blc[0]->val;
+		info->blc_target = info->blc[1]->val;
+		info->blc_analog_offset = info->blc[2]->val;
+		info->blc_digital_offset = info->blc[3]->val;
+		info->blc_sample_size = info->blc[4]->val;
+		/* otherwise sensor_init() programs it */
+		if (info->configured)
+			ret = mt9p031_apply_blc(sd);
+		break;
+	case V4L2_CID_MT9P031_BLC_RECALCULATE:
+		ret = mt9p031_blc_recalculate(sd);
+		break;
+	case V4L2_CID_MT9P031_BLC_SETTLE_RATIO:
+		/* 0 is off, a step is at least 1:1 so anything else must be above 100 */
+		if (ctrl->val > 0 && ctrl->val <= 100)
+			return -ERANGE;
+		info->blc_settle_ratio = ctrl->val;
+		break;
+	case V4L2_CID_MT9P031_LOW_LATENCY:
+		ret = sensor_s_low_latency(sd, ctrl->val);
+		break;
+	case V4L2_CID_EXPOSURE_AUTO_PRIORITY:
+	case V4L2_CID_MT9P031_MIN_FPS:
+		ret = sensor_s_auto_fps(sd, ctrl->id, ctrl->val);
+		break;
+	case V4L2_CID_POWER_LINE_FREQUENCY:
+		ret = sensor_s_power_line(sd, ctrl->val);
+		break;
+	case V4L2_CID_MT9P031_METERING:
+		info->metering = ctrl->val;
+		break;
+	case V4L2_CID_MT9P031_AE_TARGET:
+		info->ae_target = ctrl->val;
+		break;
+	case V4L2_CID_MT9P031_STROBE_WIDTH:
+		info->strobe_width = ctrl->val;
+		if (info->configured && info->strobe_on && info->exp_req)
+			ret = sensor_s_exp(sd, info->exp_req);
+		break;
+	default:
+		ret = sensor_apply_ctrl(sd, ctrl->id, ctrl->val);
+		break;
+	}
+	return ret;
+}
+
+static int mt9p031_s_ctrl(struct v4l2_ctrl *ctrl)
+{
+	struct sensor_info *info = container_of(ctrl->handler, struct sensor_info, hdl);
+	struct mt9p031_bus_stats *st;
+	struct mt9p031_bus_cost start;
+	int ret;
+
+	/* takes every member's lock itself, and its traffic is theirs too */
+	if (ctrl->id == V4L2_CID_MT9P031_STEREO_SYNC)
+		return sensor_s_stereo_sync(&info->sd, ctrl->val);
+
+	mutex_lock(&info->lock);
+	st = mt9p031_bus_ctrl(info, ctrl);
+	start = info->bus;
+	ret = mt9p031_s_ctrl_raw(ctrl);
+	if (st)
+		mt9p031_bus_end(info, st, &mt9p031_ctrl_budget, &start);
+	mutex_unlock(&info->lock);
+	return ret;
+}
+
+static const struct v4l2_ctrl_ops mt9p031_ctrl_ops = {
+	.g_volatile_ctrl = mt9p031_g_volatile_ctrl,
+	.s_ctrl = mt9p031_s_ctrl,
+};
+
+#define MT9P031_CTRL_RO		(V4L2_CTRL_FLAG_READ_ONLY | V4L2_CTRL_FLAG_VOLATILE)
+
+/* The test pattern controls come first, they are clustered in that order */
+static const struct v4l2_ctrl_config mt9p031_ctrls[] = {
+	{
+		.ops = &mt9p031_ctrl_ops,
+		.id = V4L2_CID_TEST_PATTERN,
+		.name = "Test Pattern",
+		.type = V4L2_CTRL_TYPE_MENU,
+		.max = ARRAY_SIZE(mt9p031_test_pattern_menu) - 1,
+		.qmenu = mt9p031_test_pattern_menu,
+	},
+	{
+		.ops = &mt9p031_ctrl_ops,
+		.id = V4L2_CID_TEST_PATTERN_RED,
+		.name = "Test Pattern Red",
+		.type = V4L2_CTRL_TYPE_INTEGER,
+		.max = 4095,
+		.step = 1,
+	},
+	{
+		.ops = &mt9p031_ctrl_ops,
+		.id = V4L2_CID_TEST_PATTERN_GREENR,
+		.name = "Test Pattern Green",
+		.type = V4L2_CTRL_TYPE_INTEGER,
+		.max = 4095,
+		.step = 1,
+	},
+	{
+		.ops = &mt9p031_ctrl_ops,
+		.id = V4L2_CID_TEST_PATTERN_BLUE,
+		.name = "Test Pattern Blue",
+		.type = V4L2_CTRL_TYPE_INTEGER,
+		.max = 4095,
+		.step = 1,
+	},
+	{
+		.ops = &mt9p031_ctrl_ops,
+		.id = V4L2_CID_MT9P031_TEST_PATTERN_BAR_WIDTH,
+		.name = "Test Pattern Bar Width",
+		.type = V4L2_CTRL_TYPE_INTEGER,
+		.min = 1,
+		.max = 4095,
+		.step = 2,
+		.def = 1,
+	},
+	{
+		.ops = &mt9p031_ctrl_ops,
+		.id = V4L2_CID_CAMERA_FLASH_MODE,
+		.name = "Flash Mode",
+		.type = V4L2_CTRL_TYPE_INTEGER,
+		.max = 4,
+		.step = 1,
+	},
+	{
+		.ops = &mt9p031_ctrl_ops,
+		.id = V4L2_CID_PIXEL_RATE,
+		.name = "Pixel Rate",
+		.type = V4L2_CTRL_TYPE_INTEGER,
+		.max = 96000000,
+		.step = 1,
+		.flags = MT9P031_CTRL_RO,
+	},
+	{
+		.ops = &mt9p031_ctrl_ops,
+		.id = V4L2_CID_HBLANK,
+		.name = "Horizontal Blanking",
+		.type = V4L2_CTRL_TYPE_INTEGER,
+		.max = 65535,
+		.step = 1,
+		.flags = MT9P031_CTRL_RO,
+	},
+	{
+		.ops = &mt9p031_ctrl_ops,
+		.id = V4L2_CID_VBLANK,
+		.name = "Vertical Blanking",
+		.type = V4L2_CTRL_TYPE_INTEGER,
+		.max = 0x1fffff,
+		.step = 1,
+		.flags = MT9P031_CTRL_RO,
+	},
+	{
+		.ops = &mt9p031_ctrl_ops,
+		.id = V4L2_CID_MT9P031_FRAME_PERIOD,
+		.name = "Frame Period (us)",
+		.type = V4L2_CTRL_TYPE_INTEGER,
+		.max = 0x7fffffff,
+		.step = 1,
+		.flags = MT9P031_CTRL_RO,
+	},
+	{
+		.ops = &mt9p031_ctrl_ops,
+		.id = V4L2_CID_MT9P031_READOUT_TIME,
+		.name = "Readout Time (us)",
+		.type = V4L2_CTRL_TYPE_INTEGER,
+		.max = 0x7fffffff,
+		.step = 1,
+		.flags = MT9P031_CTRL_RO,
+	},
+	{
+		.ops = &mt9p031_ctrl_ops,
+		.id = V4L2_CID_MT9P031_LATENCY,
+		.name = "Exposure to Last Row (us)",
+		.type = V4L2_CTRL_TYPE_INTEGER,
+		.max = 0x7fffffff,
+		.step = 1,
+		.flags = MT9P031_CTRL_RO,
+	},
+	{
+		.ops = &mt9p031_ctrl_ops,
+		.id = V4L2_CID_MT9P031_LOW_LATENCY,
+		.name = "Low Latency",
+		.type = V4L2_CTRL_TYPE_BOOLEAN,
+		.max = 1,
+		.step = 1,
+	},
+	{
+		.ops = &mt9p031_ctrl_ops,
+		.id = V4L2_CID_MT9P031_MIN_FPS,
+		.name = "Minimum Frame Rate",
+		.type = V4L2_CTRL_TYPE_INTEGER,
+		.min = 1,
+		.max = 60,
+		.step = 1,
+		.def = 5,
+	},
+	{
+		.ops = &mt9p031_ctrl_ops,
+		.id = V4L2_CID_MT9P031_METERING,
+		.name = "Exposure Metering",
+		.type = V4L2_CTRL_TYPE_MENU,
+		.max = ARRAY_SIZE(mt9p031_metering_menu) - 1,
+		.def = MT9P031_METERING_CENTER,
+		.qmenu = mt9p031_metering_menu,
+	},
+	{
+		.ops = &mt9p031_ctrl_ops,
+		.id = V4L2_CID_MT9P031_AE_TARGET,
+		.name = "Exposure Target Level",
+		.type = V4L2_CTRL_TYPE_INTEGER,
+		.min = 256,
+		.max = 65280,
+		.step = 1,
+		.def = 16384,
+	},
+	{
+		.ops = &mt9p031_ctrl_ops,
+		.id = V4L2_CID_MT9P031_STROBE_WIDTH,
+		.name = "Strobe Width (us)",
+		.type = V4L2_CTRL_TYPE_INTEGER,
+		.max = 100000,
+		.step = 1,
+	},
+	{
+		.ops = &mt9p031_ctrl_ops,
+		.id = V4L2_CID_MT9P031_FRAME_SYNC,
+		.name = "Frame Synchronous Controls",
+		.type = V4L2_CTRL_TYPE_BOOLEAN,
+		.max = 1,
+		.step = 1,
+	},
+	{
+		.ops = &mt9p031_ctrl_ops,
+		.id = V4L2_CID_MT9P031_FRAME_SYNC_TARGET,
+		.name = "Frame Sync Target Frame",
+		.type = V4L2_CTRL_TYPE_INTEGER,
+		.max = 0x7fffffff,
+		.step = 1,
+	},
+	{
+		.ops = &mt9p031_ctrl_ops,
+		.id = V4L2_CID_MT9P031_FRAME_COUNT,
+		.name = "Frame Count",
+		.type = V4L2_CTRL_TYPE_INTEGER,
+		.max = 0x7fffffff,
+		.step = 1,
+		.flags = MT9P031_CTRL_RO,
+	},
+	{
+		.ops = &mt9p031_ctrl_ops,
+		.id = V4L2_CID_MT9P031_FRAME_SYNC_LAST,
+		.name = "Frame Sync Effective Frame",
+		.type = V4L2_CTRL_TYPE_INTEGER,
+		.max = 0x7fffffff,
+		.step = 1,
+		.flags = MT9P031_CTRL_RO,
+	},
+	/* volatile, another sensor going away stops stereo for both */
+	{
+		.ops = &mt9p031_ctrl_ops,
+		.id = V4L2_CID_MT9P031_STEREO_SYNC,
+		.name = "Stereo Synchronized Start",
+		.type = V4L2_CTRL_TYPE_BOOLEAN,
+		.max = 1,
+		.step = 1,
+		.flags = V4L2_CTRL_FLAG_VOLATILE,
+	},
+	{
+		.ops = &mt9p031_ctrl_ops,
+		.id = V4L2_CID_MT9P031_STEREO_SKEW,
+		.name = "Stereo Frame Skew (us)",
+		.type = V4L2_CTRL_TYPE_INTEGER,
+		.min = -0x7fffffff,
+		.max = 0x7fffffff,
+		.step = 1,
+		.flags = MT9P031_CTRL_RO,
+	},
+	{
+		.ops = &mt9p031_ctrl_ops,
+		.id = V4L2_CID_MT9P031_BLC_RECALCULATE,
+		.name = "BLC Recalculate",
+		.type = V4L2_CTRL_TYPE_BUTTON,
+	},
+	{
+		.ops = &mt9p031_ctrl_ops,
+		.id = V4L2_CID_MT9P031_BLC_SETTLE_RATIO,
+		.name = "BLC Settle Gain Step (%)",
+		.type = V4L2_CTRL_TYPE_INTEGER,
+		.max = 800,
+		.step = 1,
+		.def = 150,
+	},
+};
+
+/* Clustered in this order, the first one is the cluster master */
+static const struct v4l2_ctrl_config mt9p031_blc_ctrls[] = {
+	{
+		.ops = &mt9p031_ctrl_ops,
+		.id = V4L2_CID_MT9P031_BLC_AUTO,
+		.name = "BLC Auto",
+		.type = V4L2_CTRL_TYPE_BOOLEAN,
+		.max = 1,
+		.step = 1,
+		.def = 1,
+	},
+	{
+		.ops = &mt9p031_ctrl_ops,
+		.id = V4L2_CID_MT9P031_BLC_TARGET,
+		.name = "BLC Target Level",
+		.type = V4L2_CTRL_TYPE_INTEGER,
+		.max = 4095,
+		.step = 1,
+		.def = MT9P031_ROW_BLACK_TARGET_DEF,
+	},
+	{
+		.ops = &mt9p031_ctrl_ops,
+		.id = V4L2_CID_MT9P031_BLC_ANALOG_OFFSET,
+		.name = "BLC Analog Offset",
+		.type = V4L2_CTRL_TYPE_INTEGER,
+		.min = -255,
+		.max = 255,
+		.step = 1,
+		.def = MT9P031_BLC_ANALOG_OFFSET_DEF,
+	},
+	{
+		.ops = &mt9p031_ctrl_ops,
+		.id = V4L2_CID_MT9P031_BLC_DIGITAL_OFFSET,
+		.name = "BLC Digital Offset",
+		.type = V4L2_CTRL_TYPE_INTEGER,
+		.min = -2048,
+		.max = 2047,
+		.step = 1,
+		.def = MT9P031_ROW_BLACK_DEF_OFFSET_DEF,
+	},
+	{
+		.ops = &mt9p031_ctrl_ops,
+		.id = V4L2_CID_MT9P031_BLC_SAMPLE_SIZE,
+		.name = "BLC Sample Size",
+		.type = V4L2_CTRL_TYPE_INTEGER,
+		.max = 7,
+		.step = 1,
+		.def = 1,
+	},
+};
+
+static int mt9p031_init_controls(struct sensor_info *info)
+{
+	struct v4l2_ctrl_handler *hdl = &info->hdl;
+	struct v4l2_ctrl *ctrl;
+	int ret;
+	int i;
+
+	v4l2_ctrl_handler_init(hdl, ARRAY_SIZE(mt9p031_ctrls) + ARRAY_SIZE(mt9p031_blc_ctrls) + 7);
+	info->flip[0] = v4l2_ctrl_new_std(hdl, &mt9p031_ctrl_ops, V4L2_CID_HFLIP, 0, 1, 1, 0);
+	info->flip[1] = v4l2_ctrl_new_std(hdl, &mt9p031_ctrl_ops, V4L2_CID_VFLIP, 0, 1, 1, 0);
+	info->ae[2] = v4l2_ctrl_new_std(hdl, &mt9p031_ctrl_ops, V4L2_CID_GAIN, 1, 8, 1, 1);
+	/* past the frame only with V4L2_CID_EXPOSURE_AUTO_PRIORITY, see mt9p031_fit_exposure() */
+	info->ae[1] = v4l2_ctrl_new_std(hdl, &mt9p031_ctrl_ops, V4L2_CID_EXPOSURE, 32, 65528, 8, 800);
+	v4l2_ctrl_new_std(hdl, &mt9p031_ctrl_ops, V4L2_CID_EXPOSURE_AUTO_PRIORITY, 0, 1, 1, 0);
+	/* AUTO needs zone means, see MT9P031_CMD_S_ZONE_MEANS */
+	info->ae[0] = v4l2_ctrl_new_std_menu(hdl, &mt9p031_ctrl_ops, V4L2_CID_EXPOSURE_AUTO,
+					     V4L2_EXPOSURE_MANUAL, 0, V4L2_EXPOSURE_MANUAL);
+	/* AUTO needs row means, see MT9P031_CMD_S_ROW_MEANS */
+	v4l2_ctrl_new_std_menu(hdl, &mt9p031_ctrl_ops, V4L2_CID_POWER_LINE_FREQUENCY,
+			       V4L2_CID_POWER_LINE_FREQUENCY_AUTO, 0,
+			       V4L2_CID_POWER_LINE_FREQUENCY_DISABLED);
+	for (i = 0; i < ARRAY_SIZE(mt9p031_ctrls); i++) {
+		ctrl = v4l2_ctrl_new_custom(hdl, &mt9p031_ctrls[i], NULL);
+		if (i < ARRAY_SIZE(info->tp))
+			info->tp[i] = ctrl;
+	}
+	for (i = 0; i < ARRAY_SIZE(mt9p031_blc_ctrls); i++)
+		info->blc[i] = v4l2_ctrl_new_custom(hdl, &mt9p031_blc_ctrls[i], NULL);
+	if (hdl->error) {
+		ret = hdl->error;
+		v4l2_ctrl_handler_free(hdl);
 		return ret;
-	
-	csi_dev_err("sensor_try_fmt_internal\n");
-	//sensor_write_array(sd, sensor_fmt->regs , sensor_fmt->regs_size);
-	csi_dev_err("sensor_write_array\n");
-	ret = 0;
-	//if (wsize->regs)
-	//{
-	//	ret = sensor_write_array(sd, wsize->regs , wsize->regs_size);
-	//	if (ret < 0)
-	//	{
-	//		csi_dev_err("sensor_write_array fail wsize->regs_size is %d\n",wsize->regs_size);
-	//		return ret;
-	//	}
-	//}
-	//csi_dev_err("sensor_write_array2\n");
-	//if (wsize->set_size)
-	//{
-	//	ret = wsize->set_size(sd);
-	//	if (ret < 0)
-	//		return ret;
-	//}
-	
-	info->fmt = sensor_fmt;
-	info->width = wsize->width;
-	info->height = wsize->height;
-	
+	}
+
+	v4l2_ctrl_cluster(ARRAY_SIZE(info->flip), info->flip);
+	v4l2_ctrl_cluster(ARRAY_SIZE(info->tp), info->tp);
+	v4l2_ctrl_cluster(ARRAY_SIZE(info->blc), info->blc);
+	v4l2_ctrl_auto_cluster(ARRAY_SIZE(info->ae), info->ae, V4L2_EXPOSURE_MANUAL, true);
+	info->sd.ctrl_handler = hdl;
 	return 0;
 }
 
 /*
- * Implement G/S_PARM.  There is a "high quality" mode we could try
- * to do someday; for now, we just do the frame rate tweak.
+ * Hold or release Synchronize_Changes.  While it is set the sensor keeps
+ * writes to its frame synchronised registers aside and takes all of them
+ * at the first frame start after it is cleared again.
  */
-static int sensor_g_parm(struct v4l2_subdev *sd, struct v4l2_streamparm *parms)
+static void mt9p031_sync_changes(struct sensor_info *info, int hold)
 {
-	struct v4l2_captureparm *cp = &parms->parm.capture;
-	//struct sensor_info *info = to_state(sd);
-
-	if (parms->type != V4L2_BUF_TYPE_VIDEO_CAPTURE)
-		return -EINVAL;
-
-	memset(cp, 0, sizeof(struct v4l2_captureparm));
-	cp->capability = V4L2_CAP_TIMEPERFRAME;
-	cp->timeperframe.numerator = 1;
-	cp->timeperframe.denominator = SENSOR_FRAME_RATE;
-	
-	return 0;
+	mutex_lock(&info->lock);
+	if (hold ? info->sync_depth++ == 0 : --info->sync_depth == 0)
+		mt9p031_set_output_control(&info->sd,
+					   hold ? 0 : MT9P031_OUTPUT_CONTROL_SYN,
+					   hold ? MT9P031_OUTPUT_CONTROL_SYN : 0);
+	mutex_unlock(&info->lock);
 }
 
-static int sensor_s_parm(struct v4l2_subdev *sd, struct v4l2_streamparm *parms)
+/* A batch from S_EXT_CTRLS reaches the output in one frame, not spread over several */
+static int sensor_s_ext_ctrls(struct v4l2_subdev *sd, struct v4l2_ext_controls *ctrls)
 {
-//	struct v4l2_captureparm *cp = &parms->parm.capture;
-	//struct v4l2_fract *tpf = &cp->timeperframe;
-	//struct sensor_info *info = to_state(sd);
-	//int div;
-
-//	if (parms->type != V4L2_BUF_TYPE_VIDEO_CAPTURE)
-//		return -EINVAL;
-//	if (cp->extendedmode != 0)
-//		return -EINVAL;
-
-//	if (tpf->numerator == 0 || tpf->denominator == 0)
-//		div = 1;  /* Reset to full rate */
-//	else
-//		div = (tpf->numerator*SENSOR_FRAME_RATE)/tpf->denominator;
-//		
-//	if (div == 0)
-//		div = 1;
-//	else if (div > CLK_SCALE)
-//		div = CLK_SCALE;
-//	info->clkrc = (info->clkrc & 0x80) | div;
-//	tpf->numerator = 1;
-//	tpf->denominator = sensor_FRAME_RATE/div;
-//sensor_write(sd, REG_CLKRC, info->clkrc);
-	return 0;
-}
-
+	struct sensor_info *info = to_state(sd);
+	int batch = ctrls->count > 1 && info->configured;
+	int ret;
 
-/* 
- * Code for dealing with controls.
- * fill with different sensor module
- * different sensor module has different settings here
- * if not support the follow function ,retrun -EINVAL
- */
+	if (batch)
+		mt9p031_sync_changes(info, 1);
+	ret = v4l2_subdev_s_ext_ctrls(sd, ctrls);
+	if (batch)
+		mt9p031_sync_changes(info, 0);
+	return ret;
+}
 
-/* *********************************************begin of ******************************************** */
-static int sensor_queryctrl(struct v4l2_subdev *sd,
-		struct v4l2_queryctrl *qc)
+static int sensor_g_chip_ident(struct v4l2_subdev *sd,
+		struct v4l2_dbg_chip_ident *chip)
 {
-	/* Fill in min, max, step and default value for these controls. */
-	/* see include/linux/videodev2.h for details */
-	/* see sensor_s_parm and sensor_g_parm for the meaning of value */
-	
-	switch (qc->id) {
-//	case V4L2_CID_BRIGHTNESS:
-//		return v4l2_ctrl_query_fill(qc, -4, 4, 1, 1);
-//	case V4L2_CID_CONTRAST:
-//		return v4l2_ctrl_query_fill(qc, -4, 4, 1, 1);
-//	case V4L2_CID_SATURATION:
-//		return v4l2_ctrl_query_fill(qc, -4, 4, 1, 1);
-//	case V4L2_CID_HUE:
-//		return v4l2_ctrl_query_fill(qc, -180, 180, 5, 0);
-	case V4L2_CID_VFLIP:
-	case V4L2_CID_HFLIP:
-		return v4l2_ctrl_query_fill(qc, 0, 1, 1, 0);
-	case V4L2_CID_GAIN:
-		return v4l2_ctrl_query_fill(qc, 1, 8, 1, 2);
-//	case V4L2_CID_AUTOGAIN:
-//		return v4l2_ctrl_query_fill(qc, 0, 1, 1, 1);
-	case V4L2_CID_EXPOSURE:
-		return v4l2_ctrl_query_fill(qc, 32, 1920, 8, 800);
-//	case V4L2_CID_EXPOSURE_AUTO:
-//		return v4l2_ctrl_query_fill(qc, 0, 1, 1, 0);
-//	case V4L2_CID_DO_WHITE_BALANCE:
-//		return v4l2_ctrl_query_fill(qc, 0, 5, 1, 0);
-//	case V4L2_CID_AUTO_WHITE_BALANCE:
-//		return v4l2_ctrl_query_fill(qc, 0, 1, 1, 1);
-//	case V4L2_CID_COLORFX:
-//		return v4l2_ctrl_query_fill(qc, 0, 9, 1, 0);
-	case V4L2_CID_CAMERA_FLASH_MODE:
-	  return v4l2_ctrl_query_fill(qc, 0, 4, 1, 0);	
-	}
-	return -EINVAL;
+	struct i2c_client *client = v4l2_get_subdevdata(sd);
+
+	return v4l2_chip_ident_i2c_client(client, chip, V4L2_IDENT_SENSOR, 0);
 }
 
-static int sensor_g_hflip(struct v4l2_subdev *sd, __s32 *value)
+#ifdef CONFIG_VIDEO_ADV_DEBUG
+static int sensor_g_register(struct v4l2_subdev *sd, struct v4l2_dbg_register *reg)
 {
+	struct i2c_client *client = v4l2_get_subdevdata(sd);
+	u16 val;
 	int ret;
-	struct sensor_info *info = to_state(sd);
-	struct regval_list regs;
-	
-	regs.reg_num[0] = 0x30;
-	regs.reg_num[1] = 0x40;
-	
-	ret = sensor_read(sd, regs.reg_num, regs.value);
-	if (ret < 0) {
-		csi_dev_err("sensor_read err at sensor_g_hflip!\n");
-		return ret;
-	}
 
-	*value = (regs.value[0]>>6)&1; //bit15 is hflip
+	if (!v4l2_chip_match_i2c_client(client, &reg->match))
+		return -EINVAL;
+	if (!capable(CAP_SYS_ADMIN))
+		return -EPERM;
+	if (reg->reg >= MT9P031_NUM_REGS)
+		return -EINVAL;
+
+	ret = mt9p031_reg_read(client, reg->reg, &val);
+	if (ret < 0)
+		return ret;
+	reg->val = val;
+	reg->size = 2;
 	return 0;
 }
 
-static int sensor_s_hflip(struct v4l2_subdev *sd, int value)
+/* Goes around the control cache, a later resync puts the cached value back */
+static int sensor_s_register(struct v4l2_subdev *sd, struct v4l2_dbg_register *reg)
 {
-	int ret;
+	struct i2c_client *client = v4l2_get_subdevdata(sd);
 	struct sensor_info *info = to_state(sd);
-	struct regval_list regs;
-	
-	regs.reg_num[0] = 0x30;
-	regs.reg_num[1] = 0x40;
-	
-	ret = sensor_read(sd, regs.reg_num, regs.value);
-	if (ret < 0) {
-		csi_dev_err("sensor_read err at sensor_g_hflip!\n");
-		return ret;
-	}
+	int ret;
 
-	switch(value) {
-	case 0:
-		regs.value[0] &= 0xBf;//bit14 is hflip disable
-		break;
-	case 1:
-		regs.value[0] |= (1<<6); //bit14 is hflip enable
-		break;
-	default:
-		break;
-	}
-	
-	ret = sensor_write(sd, regs.reg_num, regs.value);
-	if (ret < 0) {
-		csi_dev_err("sensor_write err at sensor_s_hflip!\n");
-		return ret;
-	}
-	return 0;
+	if (!v4l2_chip_match_i2c_client(client, &reg->match))
+		return -EINVAL;
+	if (!capable(CAP_SYS_ADMIN))
+		return -EPERM;
+	if (reg->reg >= MT9P031_NUM_REGS || reg->val > 0xffff)
+		return -EINVAL;
+
+	mutex_lock(&info->lock);
+	ret = mt9p031_reg_write(client, reg->reg, reg->val);
+	mutex_unlock(&info->lock);
+	return ret;
 }
+#endif
+
+
+/* ----------------------------------------------------------------------- */
+
+static const struct v4l2_subdev_core_ops sensor_core_ops = {
+	.g_chip_ident = sensor_g_chip_ident,
+#ifdef CONFIG_VIDEO_ADV_DEBUG
+	.g_register = sensor_g_register,
+	.s_register = sensor_s_register,
+#endif
+	.g_ctrl = v4l2_subdev_g_ctrl,
+	.s_ctrl = v4l2_subdev_s_ctrl,
+	.g_ext_ctrls = v4l2_subdev_g_ext_ctrls,
+	.s_ext_ctrls = sensor_s_ext_ctrls,
+	.try_ext_ctrls = v4l2_subdev_try_ext_ctrls,
+	.queryctrl = v4l2_subdev_queryctrl,
+	.querymenu = v4l2_subdev_querymenu,
+	.reset = sensor_reset,
+	.init = sensor_init,
+	.s_power = sensor_power,
+	.ioctl = sensor_ioctl,
+};
+
+static const struct v4l2_subdev_video_ops sensor_video_ops = {
+	.enum_mbus_fmt = sensor_enum_fmt,//linux-3.0
+	.try_mbus_fmt = sensor_try_fmt,//linux-3.0
+	.s_mbus_fmt = sensor_s_fmt,//linux-3.0
+	.s_stream = sensor_s_stream,
+	.s_parm = sensor_s_parm,//linux-3.0
+	.g_parm = sensor_g_parm,//linux-3.0
+};
+
+static const struct v4l2_subdev_ops sensor_ops = {
+	.core = &sensor_core_ops,
+	.video = &sensor_video_ops,
+};
 
-static int sensor_g_vflip(struct v4l2_subdev *sd, __s32 *value)
+/*
+ * A v4l-subdev node for the MT9P031_CMD_* ioctls, so an application can
+ * hand in its statistics and windows.  The host never calls
+ * v4l2_device_register_subdev_nodes(), so the sensor registers the node
+ * itself once the host has taken the subdev.  Controls and formats stay
+ * with the host's video node.
+ */
+static long mt9p031_node_do_ioctl(struct file *file, unsigned int cmd, void *arg)
 {
-	int ret;
-	struct sensor_info *info = to_state(sd);
-	struct regval_list regs;
-	
-	regs.reg_num[0] = 0x30;
-	regs.reg_num[1] = 0x40;
-	
-	ret = sensor_read(sd, regs.reg_num, regs.value);
-	if (ret < 0) {
-		csi_dev_err("sensor_read err at sensor_g_hflip!\n");
-		return ret;
+	struct v4l2_subdev *sd = video_get_drvdata(video_devdata(file));
+
+	switch (cmd) {
+	case MT9P031_CMD_G_FRAME_INFO:
+	case MT9P031_CMD_S_ROW_MEANS:
+	case MT9P031_CMD_S_METERING:
+	case MT9P031_CMD_S_ZONE_MEANS:
+	case MT9P031_CMD_S_ROI:
+		return sensor_ioctl(sd, cmd, arg);
 	}
+	return -ENOTTY;
+}
 
-	*value = (regs.value[0]>>7)&1; //bit15 is hflip
-	return 0;
+static long mt9p031_node_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+	return video_usercopy(file, cmd, arg, mt9p031_node_do_ioctl);
 }
 
-static int sensor_s_vflip(struct v4l2_subdev *sd, int value)
+static const struct v4l2_file_operations mt9p031_node_fops = {
+	.owner = THIS_MODULE,
+	.unlocked_ioctl = mt9p031_node_ioctl,
+};
+
+static int mt9p031_registered(struct v4l2_subdev *sd)
 {
-	int ret;
 	struct sensor_info *info = to_state(sd);
-	struct regval_list regs;
-	
-	regs.reg_num[0] = 0x30;
-	regs.reg_num[1] = 0x40;
-	
-	ret = sensor_read(sd, regs.reg_num, regs.value);
-	if (ret < 0) {
-		csi_dev_err("sensor_read err at sensor_g_hflip!\n");
-		return ret;
-	}
+	struct video_device *vdev;
+	int ret;
 
-	switch(value) {
-	case 0:
-		regs.value[0] &= 0x7f;//bit15 is hflip disable
-		break;
-	case 1:
-		regs.value[0] |= (1<<7); //bit15 is hflip enable
-		break;
-	default:
-		break;
-	}
-	
-	ret = sensor_write(sd, regs.reg_num, regs.value);
+	vdev = video_device_alloc();
+	if (vdev == NULL)
+		return -ENOMEM;
+	strlcpy(vdev->name, sd->name, sizeof(vdev->name));
+	vdev->v4l2_dev = sd->v4l2_dev;
+	vdev->fops = &mt9p031_node_fops;
+	vdev->release = video_device_release;
+	video_set_drvdata(vdev, sd);
+	ret = video_register_device(vdev, VFL_TYPE_SUBDEV, -1);
 	if (ret < 0) {
-		csi_dev_err("sensor_write err at sensor_s_hflip!\n");
-		return ret;
+		/* the sensor works without, only the private ioctls are lost */
+		video_device_release(vdev);
+		csi_dev_err("no device node for the private ioctls, %d\n", ret);
+		return 0;
 	}
+	info->node = vdev;
+	csi_dev_print("private ioctls on %s\n", video_device_node_name(vdev));
 	return 0;
 }
 
-static int sensor_g_autogain(struct v4l2_subdev *sd, __s32 *value)
+static void mt9p031_unregistered(struct v4l2_subdev *sd)
 {
-	return -EINVAL;
-}
+	struct sensor_info *info = to_state(sd);
 
-static int sensor_s_autogain(struct v4l2_subdev *sd, int value)
-{
-	return -EINVAL;
+	if (info->node)
+		video_unregister_device(info->node);
+	info->node = NULL;
 }
 
-static int sensor_g_autoexp(struct v4l2_subdev *sd, __s32 *value)
-{
-	return -EINVAL;
-}
+static const struct v4l2_subdev_internal_ops mt9p031_internal_ops = {
+	.registered = mt9p031_registered,
+	.unregistered = mt9p031_unregistered,
+};
 
-static int sensor_s_autoexp(struct v4l2_subdev *sd,
-		enum v4l2_exposure_auto_type value)
-{
-	return -EINVAL;
-}
+/* ----------------------------------------------------------------------- */
 
-static int sensor_g_autowb(struct v4l2_subdev *sd, int *value)
-{
-	struct sensor_info *info = to_state(sd);
-	
-	*value = info->autowb ;
-	return 0;
-}
+static struct dentry *mt9p031_debugfs_root;
 
-static int sensor_s_autowb(struct v4l2_subdev *sd, int value)
+static int mt9p031_frames_show(struct seq_file *s, void *unused)
 {
-	int ret;
-	struct sensor_info *info = to_state(sd);
-	
-	ret = sensor_write_array(sd, sensor_wb_auto_regs, ARRAY_SIZE(sensor_wb_auto_regs));
-	if (ret < 0) {
-		csi_dev_err("sensor_write_array err at sensor_s_autowb!\n");
-		return ret;
+	struct sensor_info *info = s->private;
+	struct mt9p031_frame_rec frames[MT9P031_FRAME_HISTORY];
+	struct mt9p031_timing t;
+	s64 period_min, period_max, period_avg = 0;
+	u32 frame_count, received, dropped, late, count;
+	unsigned long flags;
+	int i;
+
+	spin_lock_irqsave(&info->fs_lock, flags);
+	memcpy(frames, info->frames, sizeof(frames));
+	t = info->timing;
+	frame_count = info->frame_count;
+	received = info->frames_received;
+	dropped = info->frames_dropped;
+	late = info->fs_late;
+	period_min = info->period_min;
+	period_max = info->period_max;
+	count = info->period_count;
+	if (count)
+		period_avg = div_s64(info->period_sum, count);
+	spin_unlock_irqrestore(&info->fs_lock, flags);
+
+	seq_printf(s, "vsync irq:       %d\n", info->vsync_irq);
+	seq_printf(s, "frames:          %u\n", frame_count);
+	seq_printf(s, "received:        %u\n", received);
+	seq_printf(s, "dropped:         %u\n", dropped);
+	seq_printf(s, "late writes:     %u\n", late);
+	seq_printf(s, "blc recalcs:     %u\n", info->blc_recalcs);
+	seq_printf(s, "auto fps:        %s, min %d fps, vblank %u, %u changes\n",
+		   info->auto_fps ? "on" : "off", info->min_fps,
+		   info->afr_vblank ? info->afr_vblank : info->vblank, info->afr_changes);
+	seq_printf(s, "flicker:         %d Hz, detected %d Hz, 100 Hz %u%% 120 Hz %u%% after %u windows\n",
+		   info->flicker_hz, info->flicker_detected, info->flicker.score[0],
+		   info->flicker.score[1], info->flicker.windows);
+	seq_printf(s, "strobe:          %s, %d us asked, %lld us shared by all rows\n",
+		   info->strobe_on ? "on" : "off", info->strobe_width,
+		   t.shutter_width > t.height ?
+		   div_s64((s64)(t.shutter_width - t.height) * t.row_time_ns, 1000) : 0);
+	seq_printf(s, "windows:         %d alternating, %u switches\n",
+		   info->roi_count, info->roi_switches);
+	seq_printf(s, "metering:        %s, level %u target %d, %u ae steps\n",
+		   mt9p031_metering_menu[info->metering], info->ae_level,
+		   info->ae_target, info->ae_steps);
+	seq_printf(s, "watchdog:        %u restarts, %u resyncs, %u power cycles, %u failed\n",
+		   info->wd_restarts, info->wd_resyncs, info->wd_power_cycles, info->wd_failures);
+	seq_printf(s, "last outage:     %lld ns\n", info->wd_outage_ns);
+	seq_printf(s, "exposure:        %u ns\n", t.exposure_ns);
+	seq_printf(s, "readout:         %u ns\n", t.readout_ns);
+	seq_printf(s, "frame period:    %u us programmed\n", t.frame_period_us);
+	seq_printf(s, "measured period: min %lld avg %lld max %lld ns over %u frames\n",
+		   period_min, period_avg, period_max, count);
+	seq_printf(s, "jitter:          %lld ns peak to peak\n", period_max - period_min);
+
+	mutex_lock(&mt9p031_instances_lock);
+	seq_printf(s, "stereo:          %s, skew %lld ns, release spread %lld ns, %u resyncs\n",
+		   mt9p031_stereo_active ? "on" : "off", info->stereo_skew_ns,
+		   mt9p031_stereo_release_ns, mt9p031_stereo_resyncs);
+	mutex_unlock(&mt9p031_instances_lock);
+
+	seq_puts(s, "\nsequence  sof (ns)              exposure start (ns)   shutter  gains (g1 b r g2)    window            roi\n");
+	for (i = 0; i < MT9P031_FRAME_HISTORY; i++) {
+		struct mt9p031_frame_rec *rec =
+			&frames[(frame_count - i) % MT9P031_FRAME_HISTORY];
+		struct mt9p031_frame_settings *set = &rec->settings;
+		char window[24];
+
+		if (rec->sof == 0)
+			continue;
+		snprintf(window, sizeof(window), "%ux%u@%u,%u", set->width, set->height,
+			 set->col_start, set->row_start);
+		seq_printf(s, "%8u  %20lld  %20lld  %7u  %04x %04x %04x %04x  %-16s  %u%s\n",
+			   rec->sequence, rec->sof, rec->sof - rec->exposure_ns,
+			   set->shutter_width, set->gain[0], set->gain[1],
+			   set->gain[2], set->gain[3], window, set->roi,
+			   set->flags & MT9P031_FRAME_BAD ? " bad" : "");
 	}
-	
-	mdelay(10);
-	
-	info->autowb = value;
 	return 0;
 }
 
-static int sensor_g_hue(struct v4l2_subdev *sd, __s32 *value)
+static int mt9p031_frames_open(struct inode *inode, struct file *file)
 {
-	return -EINVAL;
+	return single_open(file, mt9p031_frames_show, inode->i_private);
 }
 
-static int sensor_s_hue(struct v4l2_subdev *sd, int value)
-{
-	return -EINVAL;
-}
+static const struct file_operations mt9p031_frames_fops = {
+	.owner = THIS_MODULE,
+	.open = mt9p031_frames_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
 
-static int sensor_g_gain(struct v4l2_subdev *sd, __s32 *value)
+/*
+ * The frame history as struct mt9p031_frame_info records, newest first,
+ * with timestamp holding the frame start.  Read without fs_lock, so
+ * polling it never holds off the vsync interrupt.
+ */
+static ssize_t mt9p031_metadata_read(struct file *file, char __user *buf,
+				     size_t count, loff_t *ppos)
 {
-	return -EINVAL;
+	struct sensor_info *info = file->private_data;
+	struct mt9p031_frame_rec frames[MT9P031_FRAME_HISTORY];
+	struct mt9p031_frame_info out[MT9P031_FRAME_HISTORY];
+	u32 frame_count;
+	unsigned int seq;
+	int i, n = 0;
+
+	do {
+		seq = read_seqcount_begin(&info->frames_seq);
+		frame_count = info->frame_count;
+		memcpy(frames, info->frames, sizeof(frames));
+	} while (read_seqcount_retry(&info->frames_seq, seq));
+
+	memset(out, 0, sizeof(out));
+	for (i = 0; i < MT9P031_FRAME_HISTORY; i++) {
+		struct mt9p031_frame_rec *rec =
+			&frames[(frame_count - i) % MT9P031_FRAME_HISTORY];
+
+		if (rec->sof == 0)
+			continue;
+		mt9p031_fill_frame_info(&out[n], rec);
+		out[n].timestamp = rec->sof;
+		n++;
+	}
+	return simple_read_from_buffer(buf, count, ppos, out, n * sizeof(out[0]));
 }
 
-static int sensor_s_gain(struct v4l2_subdev *sd, int value)
+static const struct file_operations mt9p031_metadata_fops = {
+	.owner = THIS_MODULE,
+	.open = simple_open,
+	.read = mt9p031_metadata_read,
+	.llseek = default_llseek,
+};
+
+/*
+ * Register map dumps and snapshots.  "registers" reads the live map,
+ * writing a name to "snapshot" saves the live map under it ("-name"
+ * drops it again), and "diff" lists the registers that differ between
+ * the two snapshots written to it, or a snapshot and the live map.
+ */
+static int mt9p031_live_map(struct sensor_info *info, u16 *regs)
 {
-	//8X:0x30 7X:0X2C 6X 0X28 5X 0x24 4X:0x20 3X 0x1A 2X:0x10 1X:0x00
-	int ret;
-	struct sensor_info *info = to_state(sd);
-	struct regval_list regs;
-	
-	regs.reg_num[0] = 0x30;
-	regs.reg_num[1] = 0x60;
-	regs.value[0] 	= 0x00; 
-	switch(value)
-	{
-		case 1://X1
-			regs.value[1] = 0x00;
-			break;
-		case 2://X2
-			regs.value[1] = 0x10;
-			break;
-		case 3://X3
-			regs.value[1] = 0x1A;
-			break;
-		case 4://X4
-			regs.value[1] = 0x20;
-			break;
-		case 5://X5
-			regs.value[1] = 0x24;
-			break;
-		case 6://X6
-			regs.value[1] = 0X28;
-			break;
-		case 7://X7
-			regs.value[1] = 0X2C;
-			break;
-		case 8://X8
-			regs.value[1] = 0x30;
-			break;
-		default:
-			break;
-	}
-	ret = sensor_write(sd, regs.reg_num, regs.value);
-	if (ret < 0) {
-		csi_dev_err("sensor_write err at sensor_s_gain!\n");
-		return ret;
-	}
-	return 0;
+	struct i2c_client *client = v4l2_get_subdevdata(&info->sd);
+
+	if (pm_runtime_enabled(&client->dev) &&
+	    pm_runtime_status_suspended(&client->dev))
+		return -EAGAIN;
+	return mt9p031_read_map(client, regs);
 }
-/* *********************************************end of ******************************************** */
 
-static int sensor_g_brightness(struct v4l2_subdev *sd, __s32 *value)
+static struct mt9p031_snapshot *mt9p031_snapshot_find(struct sensor_info *info,
+						      const char *name)
 {
-	struct sensor_info *info = to_state(sd);
-	
-	*value = info->brightness;
-	return 0;
+	struct mt9p031_snapshot *snap;
+
+	list_for_each_entry(snap, &info->snapshots, list)
+		if (strcmp(snap->name, name) == 0)
+			return snap;
+	return NULL;
 }
 
-static int sensor_s_brightness(struct v4l2_subdev *sd, int value)
+static void mt9p031_snapshots_free(struct sensor_info *info)
 {
-	int ret;
-	struct sensor_info *info = to_state(sd);
-	
-	switch (value) {
-		case -4:
-		  ret = sensor_write_array(sd, sensor_brightness_neg4_regs, ARRAY_SIZE(sensor_brightness_neg4_regs));
-			break;
-		case -3:
-			ret = sensor_write_array(sd, sensor_brightness_neg3_regs, ARRAY_SIZE(sensor_brightness_neg3_regs));
-			break;
-		case -2:
-			ret = sensor_write_array(sd, sensor_brightness_neg2_regs, ARRAY_SIZE(sensor_brightness_neg2_regs));
-			break;   
-		case -1:
-			ret = sensor_write_array(sd, sensor_brightness_neg1_regs, ARRAY_SIZE(sensor_brightness_neg1_regs));
-			break;
-		case 0:   
-			ret = sensor_write_array(sd, sensor_brightness_zero_regs, ARRAY_SIZE(sensor_brightness_zero_regs));
-			break;
-		case 1:
-			ret = sensor_write_array(sd, sensor_brightness_pos1_regs, ARRAY_SIZE(sensor_brightness_pos1_regs));
-			break;
-		case 2:
-			ret = sensor_write_array(sd, sensor_brightness_pos2_regs, ARRAY_SIZE(sensor_brightness_pos2_regs));
-			break;	
-		case 3:
-			ret = sensor_write_array(sd, sensor_brightness_pos3_regs, ARRAY_SIZE(sensor_brightness_pos3_regs));
-			break;
-		case 4:
-			ret = sensor_write_array(sd, sensor_brightness_pos4_regs, ARRAY_SIZE(sensor_brightness_pos4_regs));
-			break;
-		default:
-			return -EINVAL;
-	}
-	
-	if (ret < 0) {
-		csi_dev_err("sensor_write_array err at sensor_s_brightness!\n");
-		return ret;
+	struct mt9p031_snapshot *snap, *next;
+
+	list_for_each_entry_safe(snap, next, &info->snapshots, list) {
+		list_del(&snap->list);
+		kfree(snap);
 	}
-	mdelay(10);
-	info->brightness = value;
-	return 0;
+	info->snapshot_count = 0;
 }
 
-static int sensor_g_contrast(struct v4l2_subdev *sd, __s32 *value)
+static int mt9p031_registers_show(struct seq_file *s, void *unused)
 {
-	struct sensor_info *info = to_state(sd);
-	
-	*value = info->contrast;
-	return 0;
+	struct sensor_info *info = s->private;
+	u16 *regs;
+	int reg, ret;
+
+	regs = kmalloc(MT9P031_NUM_REGS * sizeof(*regs), GFP_KERNEL);
+	if (regs == NULL)
+		return -ENOMEM;
+	mutex_lock(&info->lock);
+	ret = mt9p031_live_map(info, regs);
+	mutex_unlock(&info->lock);
+	if (ret == 0)
+		for (reg = 0; reg < MT9P031_NUM_REGS; reg++)
+			seq_printf(s, "0x%02x 0x%04x\n", reg, regs[reg]);
+	kfree(regs);
+	return ret;
 }
 
-static int sensor_s_contrast(struct v4l2_subdev *sd, int value)
+static int mt9p031_registers_open(struct inode *inode, struct file *file)
 {
-	int ret;
-	struct sensor_info *info = to_state(sd);
-	
-	switch (value) {
-		case -4:
-		  ret = sensor_write_array(sd, sensor_contrast_neg4_regs, ARRAY_SIZE(sensor_contrast_neg4_regs));
-			break;
-		case -3:
-			ret = sensor_write_array(sd, sensor_contrast_neg3_regs, ARRAY_SIZE(sensor_contrast_neg3_regs));
-			break;
-		case -2:
-			ret = sensor_write_array(sd, sensor_contrast_neg2_regs, ARRAY_SIZE(sensor_contrast_neg2_regs));
-			break;   
-		case -1:
-			ret = sensor_write_array(sd, sensor_contrast_neg1_regs, ARRAY_SIZE(sensor_contrast_neg1_regs));
-			break;
-		case 0:   
-			ret = sensor_write_array(sd, sensor_contrast_zero_regs, ARRAY_SIZE(sensor_contrast_zero_regs));
-			break;
-		case 1:
-			ret = sensor_write_array(sd, sensor_contrast_pos1_regs, ARRAY_SIZE(sensor_contrast_pos1_regs));
-			break;
-		case 2:
-			ret = sensor_write_array(sd, sensor_contrast_pos2_regs, ARRAY_SIZE(sensor_contrast_pos2_regs));
-			break;	
-		case 3:
-			ret = sensor_write_array(sd, sensor_contrast_pos3_regs, ARRAY_SIZE(sensor_contrast_pos3_regs));
-			break;
-		case 4:
-			ret = sensor_write_array(sd, sensor_contrast_pos4_regs, ARRAY_SIZE(sensor_contrast_pos4_regs));
-			break;
-		default:
-			return -EINVAL;
-	}
-	
-	if (ret < 0) {
-		csi_dev_err("sensor_write_array err at sensor_s_contrast!\n");
-		return ret;
-	}
-	mdelay(10);
-	info->contrast = value;
-	return 0;
+	return single_open(file, mt9p031_registers_show, inode->i_private);
 }
 
-static int sensor_g_saturation(struct v4l2_subdev *sd, __s32 *value)
+static const struct file_operations mt9p031_registers_fops = {
+	.owner = THIS_MODULE,
+	.open = mt9p031_registers_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static int mt9p031_snapshot_show(struct seq_file *s, void *unused)
 {
-	struct sensor_info *info = to_state(sd);
-	
-	*value = info->saturation;
+	struct sensor_info *info = s->private;
+	struct mt9p031_snapshot *snap;
+
+	mutex_lock(&info->lock);
+	list_for_each_entry(snap, &info->snapshots, list)
+		seq_printf(s, "%s\n", snap->name);
+	mutex_unlock(&info->lock);
 	return 0;
 }
 
-static int sensor_s_saturation(struct v4l2_subdev *sd, int value)
+static int mt9p031_snapshot_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, mt9p031_snapshot_show, inode->i_private);
+}
+
+static ssize_t mt9p031_snapshot_write(struct file *file, const char __user *buf,
+				      size_t count, loff_t *ppos)
 {
+	struct sensor_info *info = ((struct seq_file *)file->private_data)->private;
+	struct mt9p031_snapshot *snap, *old;
+	char name[MT9P031_SNAPSHOT_NAME + 1];
+	char *p;
 	int ret;
-	struct sensor_info *info = to_state(sd);
-	
-	switch (value) {
-		case -4:
-		  ret = sensor_write_array(sd, sensor_saturation_neg4_regs, ARRAY_SIZE(sensor_saturation_neg4_regs));
-			break;
-		case -3:
-			ret = sensor_write_array(sd, sensor_saturation_neg3_regs, ARRAY_SIZE(sensor_saturation_neg3_regs));
-			break;
-		case -2:
-			ret = sensor_write_array(sd, sensor_saturation_neg2_regs, ARRAY_SIZE(sensor_saturation_neg2_regs));
-			break;   
-		case -1:
-			ret = sensor_write_array(sd, sensor_saturation_neg1_regs, ARRAY_SIZE(sensor_saturation_neg1_regs));
-			break;
-		case 0:   
-			ret = sensor_write_array(sd, sensor_saturation_zero_regs, ARRAY_SIZE(sensor_saturation_zero_regs));
-			break;
-		case 1:
-			ret = sensor_write_array(sd, sensor_saturation_pos1_regs, ARRAY_SIZE(sensor_saturation_pos1_regs));
-			break;
-		case 2:
-			ret = sensor_write_array(sd, sensor_saturation_pos2_regs, ARRAY_SIZE(sensor_saturation_pos2_regs));
-			break;	
-		case 3:
-			ret = sensor_write_array(sd, sensor_saturation_pos3_regs, ARRAY_SIZE(sensor_saturation_pos3_regs));
-			break;
-		case 4:
-			ret = sensor_write_array(sd, sensor_saturation_pos4_regs, ARRAY_SIZE(sensor_saturation_pos4_regs));
-			break;
-		default:
-			return -EINVAL;
+
+	if (count > MT9P031_SNAPSHOT_NAME)
+		return -EINVAL;
+	if (copy_from_user(name, buf, count))
+		return -EFAULT;
+	name[count] = '\0';
+	p = strim(name);
+	if (*p == '\0' || strcmp(p, "live") == 0 || strcmp(p, "-") == 0)
+		return -EINVAL;
+
+	if (*p == '-') {
+		mutex_lock(&info->lock);
+		snap = mt9p031_snapshot_find(info, p + 1);
+		if (snap) {
+			list_del(&snap->list);
+			info->snapshot_count--;
+		}
+		mutex_unlock(&info->lock);
+		if (snap == NULL)
+			return -ENOENT;
+		kfree(snap);
+		return count;
 	}
-	
-	if (ret < 0) {
-		csi_dev_err("sensor_write_array err at sensor_s_saturation!\n");
-		return ret;
+
+	snap = kzalloc(sizeof(*snap), GFP_KERNEL);
+	if (snap == NULL)
+		return -ENOMEM;
+	strlcpy(snap->name, p, sizeof(snap->name));
+
+	mutex_lock(&info->lock);
+	old = mt9p031_snapshot_find(info, snap->name);
+	if (old == NULL && info->snapshot_count >= MT9P031_MAX_SNAPSHOTS) {
+		ret = -ENOSPC;
+		goto out;
 	}
-	mdelay(10);
-	info->saturation = value;
-	return 0;
+	ret = mt9p031_live_map(info, snap->regs);
+	if (ret < 0)
+		goto out;
+	if (old) {
+		list_replace(&old->list, &snap->list);
+	} else {
+		list_add_tail(&snap->list, &info->snapshots);
+		info->snapshot_count++;
+	}
+	snap = old;
+out:
+	mutex_unlock(&info->lock);
+	kfree(snap);
+	return ret < 0 ? ret : count;
 }
 
-static int sensor_g_exp(struct v4l2_subdev *sd, __s32 *value)
+/*
+ * The warm start table, one "mode shutter green1 blue red green2" line
+ * per saved mode.  Writing such lines back, say at boot, carries it
+ * across reboots, a shutter of 0 forgets the mode.
+ */
+static int mt9p031_warm_show(struct seq_file *s, void *unused)
 {
-	struct sensor_info *info = to_state(sd);
-	
-	*value = info->exp;
+	struct sensor_info *info = s->private;
+	struct mt9p031_warm warm[MT9P031_NUM_MODES];
+	unsigned long flags;
+	int i;
+
+	spin_lock_irqsave(&info->fs_lock, flags);
+	memcpy(warm, info->warm, sizeof(warm));
+	spin_unlock_irqrestore(&info->fs_lock, flags);
+
+	for (i = 0; i < MT9P031_NUM_MODES; i++)
+		if (warm[i].shutter_width)
+			seq_printf(s, "%d %u %u %u %u %u\n", i, warm[i].shutter_width,
+				   warm[i].gain[0], warm[i].gain[1],
+				   warm[i].gain[2], warm[i].gain[3]);
 	return 0;
 }
 
-static int sensor_s_exp(struct v4l2_subdev *sd, int value)
+static int mt9p031_warm_open(struct inode *inode, struct file *file)
 {
-	int ret;
-	struct sensor_info *info = to_state(sd);
-	struct regval_list exp[1] = {0};
-	exp[0].reg_num[0] = 0x30;
-	exp[0].reg_num[1] = 0x12;
-	exp[0].value[0] = (value>>8)&0xFF;
-	exp[0].value[1] = value&0xFF;
-	//csi_dev_err("sensor_s_exp...set shutter %d\n",value);
-	ret = sensor_write_array(sd, exp, 1);
-	if (ret < 0) {
-		csi_dev_err("sensor_write_array err at sensor_s_exp!\n");
-		return ret;
+	return single_open(file, mt9p031_warm_show, inode->i_private);
+}
+
+static ssize_t mt9p031_warm_write(struct file *file, const char __user *buf,
+				  size_t count, loff_t *ppos)
+{
+	struct sensor_info *info = ((struct seq_file *)file->private_data)->private;
+	struct mt9p031_warm w;
+	unsigned long flags;
+	char line[64];
+	unsigned int mode, shutter, g[4];
+	int i;
+
+	if (count >= sizeof(line))
+		return -EINVAL;
+	if (copy_from_user(line, buf, count))
+		return -EFAULT;
+	line[count] = '\0';
+	if (sscanf(line, "%u %u %u %u %u %u", &mode, &shutter,
+		   &g[0], &g[1], &g[2], &g[3]) != 6 || mode >= MT9P031_NUM_MODES)
+		return -EINVAL;
+	w.shutter_width = shutter;
+	for (i = 0; i < 4; i++) {
+		if (g[i] > 0xffff)
+			return -EINVAL;
+		w.gain[i] = g[i];
 	}
-	mdelay(10);
-	info->exp = value;
-	return 0;
+
+	spin_lock_irqsave(&info->fs_lock, flags);
+	info->warm[mode] = w;
+	spin_unlock_irqrestore(&info->fs_lock, flags);
+	return count;
 }
 
-static int sensor_g_wb(struct v4l2_subdev *sd, int *value)
+static const struct file_operations mt9p031_warm_fops = {
+	.owner = THIS_MODULE,
+	.open = mt9p031_warm_open,
+	.read = seq_read,
+	.write = mt9p031_warm_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static const struct file_operations mt9p031_snapshot_fops = {
+	.owner = THIS_MODULE,
+	.open = mt9p031_snapshot_open,
+	.read = seq_read,
+	.write = mt9p031_snapshot_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+/* Copy the map @name stands for into @regs, "" or "live" reads the sensor */
+static int mt9p031_diff_side(struct sensor_info *info, const char *name, u16 *regs)
 {
-	struct sensor_info *info = to_state(sd);
-	enum v4l2_whiteblance *wb_type = (enum v4l2_whiteblance*)value;
-	
-	*wb_type = info->wb;
-	
+	struct mt9p031_snapshot *snap;
+
+	if (*name == '\0' || strcmp(name, "live") == 0)
+		return mt9p031_live_map(info, regs);
+	snap = mt9p031_snapshot_find(info, name);
+	if (snap == NULL)
+		return -ENOENT;
+	memcpy(regs, snap->regs, sizeof(snap->regs));
 	return 0;
 }
 
-static int sensor_s_wb(struct v4l2_subdev *sd,
-		enum v4l2_whiteblance value)
+static int mt9p031_diff_show(struct seq_file *s, void *unused)
 {
-	int ret;
-	struct sensor_info *info = to_state(sd);
-	
-	if (value == V4L2_WB_AUTO) {
-		ret = sensor_s_autowb(sd, 1);
-		return ret;
-	} 
-	else {
-		ret = sensor_s_autowb(sd, 0);
-		if(ret < 0) {
-			csi_dev_err("sensor_s_autowb error, return %x!\n",ret);
-			return ret;
+	struct sensor_info *info = s->private;
+	u16 *a, *b;
+	int reg, ret, n = 0;
+
+	a = kmalloc(2 * MT9P031_NUM_REGS * sizeof(*a), GFP_KERNEL);
+	if (a == NULL)
+		return -ENOMEM;
+	b = a + MT9P031_NUM_REGS;
+
+	mutex_lock(&info->lock);
+	ret = mt9p031_diff_side(info, info->diff_a, a);
+	if (ret == 0)
+		ret = mt9p031_diff_side(info, info->diff_b, b);
+	if (ret == 0)
+		seq_printf(s, "reg   %-15s %-15s\n",
+			   *info->diff_a ? info->diff_a : "live",
+			   *info->diff_b ? info->diff_b : "live");
+	mutex_unlock(&info->lock);
+
+	if (ret == 0) {
+		for (reg = 0; reg < MT9P031_NUM_REGS; reg++) {
+			if (a[reg] == b[reg])
+				continue;
+			seq_printf(s, "0x%02x  0x%04x          0x%04x\n", reg, a[reg], b[reg]);
+			n++;
 		}
-		
-		switch (value) {
-			case V4L2_WB_CLOUD:
-			  ret = sensor_write_array(sd, sensor_wb_cloud_regs, ARRAY_SIZE(sensor_wb_cloud_regs));
-				break;
-			case V4L2_WB_DAYLIGHT:
-				ret = sensor_write_array(sd, sensor_wb_daylight_regs, ARRAY_SIZE(sensor_wb_daylight_regs));
-				break;
-			case V4L2_WB_INCANDESCENCE:
-				ret = sensor_write_array(sd, sensor_wb_incandescence_regs, ARRAY_SIZE(sensor_wb_incandescence_regs));
-				break;    
-			case V4L2_WB_FLUORESCENT:
-				ret = sensor_write_array(sd, sensor_wb_fluorescent_regs, ARRAY_SIZE(sensor_wb_fluorescent_regs));
-				break;
-			case V4L2_WB_TUNGSTEN:   
-				ret = sensor_write_array(sd, sensor_wb_tungsten_regs, ARRAY_SIZE(sensor_wb_tungsten_regs));
-				break;
-			default:
-				return -EINVAL;
-		} 
-	}
-	
-	if (ret < 0) {
-		csi_dev_err("sensor_s_wb error, return %x!\n",ret);
-		return ret;
+		seq_printf(s, "%d registers differ\n", n);
 	}
-	mdelay(10);
-	info->wb = value;
-	return 0;
+	kfree(a);
+	return ret;
 }
 
-static int sensor_g_colorfx(struct v4l2_subdev *sd,
-		__s32 *value)
+static int mt9p031_diff_open(struct inode *inode, struct file *file)
 {
-	struct sensor_info *info = to_state(sd);
-	enum v4l2_colorfx *clrfx_type = (enum v4l2_colorfx*)value;
-	
-	*clrfx_type = info->clrfx;
-	return 0;
+	return single_open(file, mt9p031_diff_show, inode->i_private);
 }
 
-static int sensor_s_colorfx(struct v4l2_subdev *sd,
-		enum v4l2_colorfx value)
+/* "a b" compares two snapshots, "a" compares one with the live map */
+static ssize_t mt9p031_diff_write(struct file *file, const char __user *buf,
+				  size_t count, loff_t *ppos)
 {
-	int ret;
-	struct sensor_info *info = to_state(sd);
-	
-	switch (value) {
-	case V4L2_COLORFX_NONE:
-	  ret = sensor_write_array(sd, sensor_colorfx_none_regs, ARRAY_SIZE(sensor_colorfx_none_regs));
-		break;
-	case V4L2_COLORFX_BW:
-		ret = sensor_write_array(sd, sensor_colorfx_bw_regs, ARRAY_SIZE(sensor_colorfx_bw_regs));
-		break;  
-	case V4L2_COLORFX_SEPIA:
-		ret = sensor_write_array(sd, sensor_colorfx_sepia_regs, ARRAY_SIZE(sensor_colorfx_sepia_regs));
-		break;   
-	case V4L2_COLORFX_NEGATIVE:
-		ret = sensor_write_array(sd, sensor_colorfx_negative_regs, ARRAY_SIZE(sensor_colorfx_negative_regs));
-		break;
-	case V4L2_COLORFX_EMBOSS:   
-		ret = sensor_write_array(sd, sensor_colorfx_emboss_regs, ARRAY_SIZE(sensor_colorfx_emboss_regs));
-		break;
-	case V4L2_COLORFX_SKETCH:     
-		ret = sensor_write_array(sd, sensor_colorfx_sketch_regs, ARRAY_SIZE(sensor_colorfx_sketch_regs));
-		break;
-	case V4L2_COLORFX_SKY_BLUE:
-		ret = sensor_write_array(sd, sensor_colorfx_sky_blue_regs, ARRAY_SIZE(sensor_colorfx_sky_blue_regs));
-		break;
-	case V4L2_COLORFX_GRASS_GREEN:
-		ret = sensor_write_array(sd, sensor_colorfx_grass_green_regs, ARRAY_SIZE(sensor_colorfx_grass_green_regs));
-		break;
-	case V4L2_COLORFX_SKIN_WHITEN:
-		ret = sensor_write_array(sd, sensor_colorfx_skin_whiten_regs, ARRAY_SIZE(sensor_colorfx_skin_whiten_regs));
-		break;
-	case V4L2_COLORFX_VIVID:
-		ret = sensor_write_array(sd, sensor_colorfx_vivid_regs, ARRAY_SIZE(sensor_colorfx_vivid_regs));
-		break;
-	default:
+	struct sensor_info *info = ((struct seq_file *)file->private_data)->private;
+	char line[2 * MT9P031_SNAPSHOT_NAME + 2];
+	char a[MT9P031_SNAPSHOT_NAME], b[MT9P031_SNAPSHOT_NAME];
+	int n;
+
+	if (count >= sizeof(line))
 		return -EINVAL;
-	}
-	
-	if (ret < 0) {
-		csi_dev_err("sensor_s_colorfx error, return %x!\n",ret);
-		return ret;
-	}
-	mdelay(10);
-	info->clrfx = value;
-	return 0;
+	if (copy_from_user(line, buf, count))
+		return -EFAULT;
+	line[count] = '\0';
+	n = sscanf(line, "%15s %15s", a, b);
+	if (n < 1)
+		return -EINVAL;
+	if (n < 2)
+		b[0] = '\0';
+
+	mutex_lock(&info->lock);
+	strlcpy(info->diff_a, a, sizeof(info->diff_a));
+	strlcpy(info->diff_b, b, sizeof(info->diff_b));
+	mutex_unlock(&info->lock);
+	return count;
 }
 
-static int sensor_g_flash_mode(struct v4l2_subdev *sd,
-    __s32 *value)
+static const struct file_operations mt9p031_diff_fops = {
+	.owner = THIS_MODULE,
+	.open = mt9p031_diff_open,
+	.read = seq_read,
+	.write = mt9p031_diff_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+/*
+ * Everything a frame source needs to stand in for this sensor: window,
+ * skipping and binning, blanking, clocks, shutter, gains, mirroring, test
+ * pattern and the resulting size, CFA order and frame interval.  Taken
+ * from the live register map, so it shows what was programmed, not what
+ * the driver meant to program.  One "key value" pair per line.
+ */
+static int mt9p031_emulation_show(struct seq_file *s, void *unused)
 {
-	struct sensor_info *info = to_state(sd);
-	enum v4l2_flash_mode *flash_mode = (enum v4l2_flash_mode*)value;
-	
-	*flash_mode = info->flash_mode;
-	return 0;
+	static const char * const cfa[] = { "GRBG", "RGGB", "BGGR", "GBRG" };
+	struct sensor_info *info = s->private;
+	struct mt9p031_timing_regs r;
+	struct mt9p031_timing t;
+	enum v4l2_mbus_pixelcode code;
+	u16 *regs;
+	int ret, i;
+
+	regs = kmalloc(MT9P031_NUM_REGS * sizeof(*regs), GFP_KERNEL);
+	if (regs == NULL)
+		return -ENOMEM;
+	mutex_lock(&info->lock);
+	ret = mt9p031_live_map(info, regs);
+	mutex_unlock(&info->lock);
+	if (ret < 0)
+		goto out;
+
+	r.pll_ctrl = regs[REG_MT9P031_PLL_CTRL];
+	r.pll_conf1 = regs[REG_MT9P031_PLL_CONF1];
+	r.pll_conf2 = regs[REG_MT9P031_PLL_CONF2];
+	r.pclk_ctrl = regs[REG_MT9P031_PCLK_CTRL];
+	r.height = regs[REG_MT9P031_HEIGHT];
+	r.width = regs[REG_MT9P031_WIDTH];
+	r.hblank = regs[REG_MT9P031_HBLANK];
+	r.vblank = regs[REG_MT9P031_VBLANK];
+	r.row_addr_mode = regs[REG_MT9P031_ROW_ADDR_MODE];
+	r.col_addr_mode = regs[REG_MT9P031_COL_ADDR_MODE];
+	r.shutter_width_u = regs[REG_MT9P031_SHUTTER_WIDTH_U];
+	r.shutter_width_l = regs[REG_MT9P031_SHUTTER_WIDTH_L];
+	r.shutter_delay = regs[REG_MT9P031_SHUTTER_DELAY];
+	mt9p031_calc_timing(info->ccm_info->mclk, &r, &t);
+	code = mt9p031_bayer_code_regs(regs[REG_MT9P031_ROWSTART], regs[REG_MT9P031_COLSTART],
+				       r.height, r.width, (r.col_addr_mode >> 4) & 0x3,
+				       regs[REG_MT9P031_READ_MODE2]);
+	for (i = 0; i < ARRAY_SIZE(cfa); i++)
+		if (mt9p031_bayer_codes[i / 2][i % 2] == code)
+			break;
+
+	seq_printf(s, "extclk %u\n", info->ccm_info->mclk);
+	seq_printf(s, "pixel_rate %u\n", t.pixel_rate);
+	seq_printf(s, "row_start %u\n", regs[REG_MT9P031_ROWSTART]);
+	seq_printf(s, "col_start %u\n", regs[REG_MT9P031_COLSTART]);
+	seq_printf(s, "row_size %u\n", r.height + 1);
+	seq_printf(s, "col_size %u\n", r.width + 1);
+	seq_printf(s, "row_skip %u\n", (r.row_addr_mode & 0x7) + 1);
+	seq_printf(s, "row_bin %u\n", ((r.row_addr_mode >> 4) & 0x3) + 1);
+	seq_printf(s, "col_skip %u\n", (r.col_addr_mode & 0x7) + 1);
+	seq_printf(s, "col_bin %u\n", ((r.col_addr_mode >> 4) & 0x3) + 1);
+	seq_printf(s, "width %u\n", t.width);
+	seq_printf(s, "height %u\n", t.height);
+	seq_printf(s, "mbus_code 0x%04x\n", code);
+	seq_printf(s, "cfa %s\n", i < ARRAY_SIZE(cfa) ? cfa[i] : "?");
+	seq_printf(s, "row_mirror %u\n", !!(regs[REG_MT9P031_READ_MODE2] & MT9P031_READ_MODE2_ROW_MIRROR));
+	seq_printf(s, "col_mirror %u\n", !!(regs[REG_MT9P031_READ_MODE2] & MT9P031_READ_MODE2_COL_MIRROR));
+	seq_printf(s, "line_length %u\n", t.line_length);
+	seq_printf(s, "frame_length %u\n", t.frame_length);
+	seq_printf(s, "hblank %u\n", t.hblank);
+	seq_printf(s, "vblank %u\n", t.vblank);
+	seq_printf(s, "row_time_ns %u\n", t.row_time_ns);
+	seq_printf(s, "frame_interval_us %u\n", t.frame_period_us);
+	seq_printf(s, "readout_ns %u\n", t.readout_ns);
+	seq_printf(s, "shutter_width %u\n", t.shutter_width);
+	seq_printf(s, "exposure_ns %u\n", t.exposure_ns);
+	seq_printf(s, "gain_green1 0x%04x\n", regs[REG_MT9P031_GREEN_1_GAIN]);
+	seq_printf(s, "gain_blue 0x%04x\n", regs[REG_MT9P031_BLUE_GAIN]);
+	seq_printf(s, "gain_red 0x%04x\n", regs[REG_MT9P031_RED_GAIN]);
+	seq_printf(s, "gain_green2 0x%04x\n", regs[REG_MT9P031_GREEN_2_GAIN]);
+	seq_printf(s, "test_pattern %u\n",
+		   (regs[REG_MT9P031_TEST_PATTERN] & MT9P031_TEST_PATTERN_ENABLE) ?
+		   ((regs[REG_MT9P031_TEST_PATTERN] >> MT9P031_TEST_PATTERN_SHIFT) & 0xf) + 1 : 0);
+	seq_printf(s, "test_pattern_green %u\n", regs[REG_MT9P031_TEST_PATTERN_GREEN]);
+	seq_printf(s, "test_pattern_red %u\n", regs[REG_MT9P031_TEST_PATTERN_RED]);
+	seq_printf(s, "test_pattern_blue %u\n", regs[REG_MT9P031_TEST_PATTERN_BLUE]);
+	seq_printf(s, "test_pattern_bar_width %u\n", regs[REG_MT9P031_TEST_PATTERN_BAR_WIDTH]);
+	seq_printf(s, "streaming %u\n", info->streaming);
+out:
+	kfree(regs);
+	return ret;
 }
 
-static int sensor_s_flash_mode(struct v4l2_subdev *sd,
-    enum v4l2_flash_mode value)
+static int mt9p031_emulation_open(struct inode *inode, struct file *file)
 {
-	struct sensor_info *info = to_state(sd);
-	struct csi_dev *dev=(struct csi_dev *)dev_get_drvdata(sd->v4l2_dev->dev);
-	int flash_on,flash_off;
-	
-	flash_on = (dev->flash_pol!=0)?1:0;
-	flash_off = (flash_on==1)?0:1;
-	
-	switch (value) {
-	case V4L2_FLASH_MODE_OFF:
-		csi_gpio_write(sd,&dev->flash_io,flash_off);
-		break;
-	case V4L2_FLASH_MODE_AUTO:
-		return -EINVAL;
-		break;  
-	case V4L2_FLASH_MODE_ON:
-		csi_gpio_write(sd,&dev->flash_io,flash_on);
-		break;   
-	case V4L2_FLASH_MODE_TORCH:
-		return -EINVAL;
-		break;
-	case V4L2_FLASH_MODE_RED_EYE:   
-		return -EINVAL;
-		break;
-	default:
-		return -EINVAL;
-	}
-	
-	info->flash_mode = value;
+	return single_open(file, mt9p031_emulation_show, inode->i_private);
+}
+
+static const struct file_operations mt9p031_emulation_fops = {
+	.owner = THIS_MODULE,
+	.open = mt9p031_emulation_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+/* Bus time of @bits at @hz, in us */
+static u32 mt9p031_bus_us(u32 bits, u32 hz)
+{
+	return div_u64((u64)bits * 1000000, hz);
+}
+
+static void mt9p031_bus_show_one(struct seq_file *s, const struct mt9p031_bus_stats *st,
+				 const struct mt9p031_bus_budget *budget)
+{
+	seq_printf(s, "%-24.24s %6u %5u  %5u %6u %7u %7u %7u  %5u %7u %5u\n",
+		   st->name, st->calls, st->last.xfers, st->worst.xfers, st->worst.bytes,
+		   mt9p031_bus_us(st->worst.bits, 100000),
+		   mt9p031_bus_us(st->worst.bits, 400000),
+		   st->worst.delay_us / 1000, budget->xfers, budget->delay_ms, st->over);
+}
+
+static int mt9p031_bus_show(struct seq_file *s, void *unused)
+{
+	struct sensor_info *info = s->private;
+	int i;
+
+	seq_printf(s, "total: %u transfers, %u bytes, %u us at 100kHz, %u us at 400kHz, %u ms delays\n\n",
+		   info->bus.xfers, info->bus.bytes,
+		   mt9p031_bus_us(info->bus.bits, 100000),
+		   mt9p031_bus_us(info->bus.bits, 400000), info->bus.delay_us / 1000);
+	seq_puts(s, "                                    ------------ worst ------------------------  ----- budget -----\n");
+	seq_puts(s, "operation                 calls  last  xfers  bytes  us@100k us@400k delay ms  xfers delay ms  over\n");
+	for (i = 0; i < MT9P031_NUM_OPS; i++)
+		if (info->bus_ops[i].calls)
+			mt9p031_bus_show_one(s, &info->bus_ops[i], &mt9p031_bus_budgets[i]);
+	for (i = 0; i < MT9P031_BUS_CTRLS && info->bus_ctrls[i].name; i++)
+		mt9p031_bus_show_one(s, &info->bus_ctrls[i], &mt9p031_ctrl_budget);
 	return 0;
 }
 
-static int sensor_g_ctrl(struct v4l2_subdev *sd, struct v4l2_control *ctrl)
+static int mt9p031_bus_open(struct inode *inode, struct file *file)
 {
-#if 0
-	switch (ctrl->id) {
-	case V4L2_CID_BRIGHTNESS:
-		return sensor_g_brightness(sd, &ctrl->value);
-	case V4L2_CID_CONTRAST:
-		return sensor_g_contrast(sd, &ctrl->value);
-	case V4L2_CID_SATURATION:
-		return sensor_g_saturation(sd, &ctrl->value);
-	case V4L2_CID_HUE:
-		return sensor_g_hue(sd, &ctrl->value);	
-	case V4L2_CID_VFLIP:
-		return sensor_g_vflip(sd, &ctrl->value);
-	case V4L2_CID_HFLIP:
-		return sensor_g_hflip(sd, &ctrl->value);
-	case V4L2_CID_GAIN:
-		return sensor_g_gain(sd, &ctrl->value);
-	case V4L2_CID_AUTOGAIN:
-		return sensor_g_autogain(sd, &ctrl->value);
-	case V4L2_CID_EXPOSURE:
-		return sensor_g_exp(sd, &ctrl->value);
-	case V4L2_CID_EXPOSURE_AUTO:
-		return sensor_g_autoexp(sd, &ctrl->value);
-	case V4L2_CID_DO_WHITE_BALANCE:
-		return sensor_g_wb(sd, &ctrl->value);
-	case V4L2_CID_AUTO_WHITE_BALANCE:
-		return sensor_g_autowb(sd, &ctrl->value);
-	case V4L2_CID_COLORFX:
-		return sensor_g_colorfx(sd,	&ctrl->value);
-	case V4L2_CID_CAMERA_FLASH_MODE:
-		return sensor_g_flash_mode(sd, &ctrl->value);
-	}
-	#endif
-	return -EINVAL;
+	return single_open(file, mt9p031_bus_show, inode->i_private);
 }
 
-static int sensor_s_ctrl(struct v4l2_subdev *sd, struct v4l2_control *ctrl)
+static const struct file_operations mt9p031_bus_fops = {
+	.owner = THIS_MODULE,
+	.open = mt9p031_bus_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static int mt9p031_i2c_show(struct seq_file *s, void *unused)
 {
-	//csi_dev_err("sensor_s_ctrl test 0x%x-->0x%x\n",ctrl->id,ctrl->value);
-	switch(ctrl->id)
-	{
-		case V4L2_CID_GAIN:
-			printk("gain will be set %d\n",ctrl->value);
-			return sensor_s_gain(sd, ctrl->value);
-		case V4L2_CID_EXPOSURE:
-			return sensor_s_exp(sd, ctrl->value);
-		case V4L2_CID_VFLIP:
-			return sensor_s_vflip(sd, ctrl->value);
-		case V4L2_CID_HFLIP:
-			return sensor_s_hflip(sd, ctrl->value);
+	struct sensor_info *info = s->private;
+	u32 retries = 0, errors = 0;
+	int reg;
+
+	for (reg = 0; reg < 256; reg++) {
+		retries += info->i2c_retries[reg];
+		errors += info->i2c_errors[reg];
 	}
-#if 0
-	switch (ctrl->id) {
-	case V4L2_CID_BRIGHTNESS:
-		return sensor_s_brightness(sd, ctrl->value);
-	case V4L2_CID_CONTRAST:
-		return sensor_s_contrast(sd, ctrl->value);
-	case V4L2_CID_SATURATION:
-		return sensor_s_saturation(sd, ctrl->value);
-	case V4L2_CID_HUE:
-		return sensor_s_hue(sd, ctrl->value);		
-	case V4L2_CID_VFLIP:
-		return sensor_s_vflip(sd, ctrl->value);
-	case V4L2_CID_HFLIP:
-		return sensor_s_hflip(sd, ctrl->value);
-	case V4L2_CID_GAIN:
-		return sensor_s_gain(sd, ctrl->value);
-	case V4L2_CID_AUTOGAIN:
-		return sensor_s_autogain(sd, ctrl->value);
-	case V4L2_CID_EXPOSURE:
-		return sensor_s_exp(sd, ctrl->value);
-	case V4L2_CID_EXPOSURE_AUTO:
-		return sensor_s_autoexp(sd,
-				(enum v4l2_exposure_auto_type) ctrl->value);
-	case V4L2_CID_DO_WHITE_BALANCE:
-		return sensor_s_wb(sd,
-				(enum v4l2_whiteblance) ctrl->value);	
-	case V4L2_CID_AUTO_WHITE_BALANCE:
-		return sensor_s_autowb(sd, ctrl->value);
-	case V4L2_CID_COLORFX:
-		return sensor_s_colorfx(sd,
-				(enum v4l2_colorfx) ctrl->value);
-	case V4L2_CID_CAMERA_FLASH_MODE:
-	  return sensor_s_flash_mode(sd,
-	      (enum v4l2_flash_mode) ctrl->value);
+	seq_printf(s, "retries:    %u\n", retries);
+	seq_printf(s, "errors:     %u\n", errors);
+	if (errors)
+		seq_printf(s, "last error: reg 0x%02x, %d\n",
+			   info->i2c_last_reg, info->i2c_last_err);
+
+	seq_puts(s, "\nreg   retries    errors\n");
+	for (reg = 0; reg < 256; reg++) {
+		if (info->i2c_retries[reg] == 0 && info->i2c_errors[reg] == 0)
+			continue;
+		seq_printf(s, "0x%02x  %7u  %8u\n", reg,
+			   info->i2c_retries[reg], info->i2c_errors[reg]);
 	}
-	#endif
-	return -EINVAL;
+	return 0;
 }
 
-static int sensor_g_chip_ident(struct v4l2_subdev *sd,
-		struct v4l2_dbg_chip_ident *chip)
+static int mt9p031_i2c_open(struct inode *inode, struct file *file)
 {
-	struct i2c_client *client = v4l2_get_subdevdata(sd);
-
-	return v4l2_chip_ident_i2c_client(client, chip, V4L2_IDENT_SENSOR, 0);
+	return single_open(file, mt9p031_i2c_show, inode->i_private);
 }
 
+static const struct file_operations mt9p031_i2c_fops = {
+	.owner = THIS_MODULE,
+	.open = mt9p031_i2c_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
 
-/* ----------------------------------------------------------------------- */
+/* Module wide: the mode table check and the solver's cost */
+static int mt9p031_modes_show(struct seq_file *s, void *unused)
+{
+	int fails;
 
-static const struct v4l2_subdev_core_ops sensor_core_ops = {
-	.g_chip_ident = sensor_g_chip_ident,
-	.g_ctrl = sensor_g_ctrl,
-	.s_ctrl = sensor_s_ctrl,
-	.queryctrl = sensor_queryctrl,
-	.reset = sensor_reset,
-	.init = sensor_init,
-	.s_power = sensor_power,
-	.ioctl = sensor_ioctl,
-};
+	fails = mt9p031_check_modes(s, ccm_info_con.mclk);
+	seq_printf(s, "modes:      %d, %d checks failed\n", MT9P031_NUM_MODES, fails);
+	seq_printf(s, "solve:      %u ns per call\n",
+		   mt9p031_bench_solve(ccm_info_con.mclk, 10));
+	return 0;
+}
 
-static const struct v4l2_subdev_video_ops sensor_video_ops = {
-	.enum_mbus_fmt = sensor_enum_fmt,//linux-3.0
-	.try_mbus_fmt = sensor_try_fmt,//linux-3.0
-	.s_mbus_fmt = sensor_s_fmt,//linux-3.0
-	.s_parm = sensor_s_parm,//linux-3.0
-	.g_parm = sensor_g_parm,//linux-3.0
-};
+static int mt9p031_modes_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, mt9p031_modes_show, inode->i_private);
+}
 
-static const struct v4l2_subdev_ops sensor_ops = {
-	.core = &sensor_core_ops,
-	.video = &sensor_video_ops,
+static const struct file_operations mt9p031_modes_fops = {
+	.owner = THIS_MODULE,
+	.open = mt9p031_modes_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
 };
 
-/* ----------------------------------------------------------------------- */
+static void mt9p031_debugfs_init(struct i2c_client *client, struct sensor_info *info)
+{
+	if (mt9p031_debugfs_root == NULL)
+		return;
+
+	info->debugfs = debugfs_create_dir(dev_name(&client->dev), mt9p031_debugfs_root);
+	if (info->debugfs == NULL)
+		return;
+	debugfs_create_file("frames", S_IRUGO, info->debugfs, info, &mt9p031_frames_fops);
+	debugfs_create_file("i2c", S_IRUGO, info->debugfs, info, &mt9p031_i2c_fops);
+	debugfs_create_file("bus", S_IRUGO, info->debugfs, info, &mt9p031_bus_fops);
+	debugfs_create_file("emulation", S_IRUGO, info->debugfs, info, &mt9p031_emulation_fops);
+	debugfs_create_file("metadata", S_IRUGO, info->debugfs, info, &mt9p031_metadata_fops);
+	debugfs_create_file("registers", S_IRUSR, info->debugfs, info, &mt9p031_registers_fops);
+	debugfs_create_file("snapshot", S_IRUGO | S_IWUSR, info->debugfs, info, &mt9p031_snapshot_fops);
+	debugfs_create_file("warm", S_IRUGO | S_IWUSR, info->debugfs, info, &mt9p031_warm_fops);
+	debugfs_create_file("diff", S_IRUGO | S_IWUSR, info->debugfs, info, &mt9p031_diff_fops);
+}
 
 static int sensor_probe(struct i2c_client *client,
 			const struct i2c_device_id *id)
 {
 	struct v4l2_subdev *sd;
 	struct sensor_info *info;
-//	int ret;
+	struct mt9p031_config cfg;
+	int ret;
 	printk(KERN_ERR "sensor_probe start\n");
 	info = kzalloc(sizeof(struct sensor_info), GFP_KERNEL);
 	if (info == NULL)
 		return -ENOMEM;
 	sd = &info->sd;
 	v4l2_i2c_subdev_init(sd, client, &sensor_ops);
+	sd->internal_ops = &mt9p031_internal_ops;
 
 	info->fmt = &sensor_formats[0];
 	info->ccm_info = &ccm_info_con;
+	if (mt9p031_solve(info->ccm_info->mclk, HD_WIDTH, HD_HEIGHT, NULL, &cfg) == 0) {
+		mt9p031_commit_config(info, &cfg);
+	} else {
+		/* max_pixclk below anything the PLL can do, keep the old 74MHz */
+		csi_dev_err("no PLL setting under max_pixclk=%u\n", max_pixclk);
+		info->mode = mt9p031_calc_size(HD_WIDTH);
+		info->pll.m = 37;
+		info->pll.n = 4;
+		info->pll.p1 = 3;
+		info->hblank = mt9p031_supported_formats[info->mode].hblank;
+		info->vblank = mt9p031_supported_formats[info->mode].vblank;
+		info->width = mt9p031_supported_formats[info->mode].width;
+		info->height = mt9p031_supported_formats[info->mode].height;
+	}
+	info->read_mode2 = 0x0040;
+	info->output_control = 0x1F82;
+	info->test_pattern = 0;
+	info->tp_bar_width = 1;
+	info->blc_auto = 1;
+	info->blc_target = MT9P031_ROW_BLACK_TARGET_DEF;
+	info->blc_analog_offset = MT9P031_BLC_ANALOG_OFFSET_DEF;
+	info->blc_digital_offset = MT9P031_ROW_BLACK_DEF_OFFSET_DEF;
+	info->blc_sample_size = 1;
+	info->blc_settle_ratio = 150;
+	info->min_fps = 5;
+	info->warm_mode = -1;
+	info->metering = MT9P031_METERING_CENTER;
+	info->ae_target = 16384;
+	info->meter.spot_x = 500;
+	info->meter.spot_y = 500;
+	info->meter.spot_width = 100;
+	info->meter.spot_height = 100;
+	info->meter.cols = 1;
+	info->meter.rows = 1;
+	info->meter.weight[0] = 1;
+	info->streaming = stream_on_init;
+	ret = mt9p031_init_controls(info);
+	if (ret < 0) {
+		csi_dev_err("control handler init failed %d\n", ret);
+		kfree(info);
+		return ret;
+	}
+	mutex_init(&info->lock);
+	spin_lock_init(&info->fs_lock);
+	seqcount_init(&info->frames_seq);
+	mt9p031_settings_reset(&info->settings);
+	info->settings_next = info->settings;
+	INIT_DELAYED_WORK(&info->wd_work, mt9p031_wd_work_fn);
+	INIT_LIST_HEAD(&info->snapshots);
+	info->vsync_gpio = -1;
+	info->pm_then = -1;
+	mutex_lock(&mt9p031_instances_lock);
+	list_add_tail(&info->list, &mt9p031_instances);
+	mutex_unlock(&mt9p031_instances_lock);
 	
 	info->brightness = 0;
 	info->contrast = 0;
@@ -2352,16 +6562,24 @@ static int sensor_probe(struct i2c_client *client,
 	info->hue = 0;
 	info->hflip = 0;
 	info->vflip = 0;
-	info->gain = 0;
+	info->gain = 1;
 	info->autogain = 1;
 	info->exp = 0;
-	info->autoexp = 0;
+	info->exp_req = 0;
+	info->autoexp = V4L2_EXPOSURE_MANUAL;
 	info->autowb = 1;
 	info->wb = 0;
 	info->clrfx = 0;
 	
 //	info->clkrc = 1;	/* 30fps */
 
+	mt9p031_debugfs_init(client, info);
+
+	pm_runtime_set_suspended(&client->dev);
+	pm_runtime_set_autosuspend_delay(&client->dev, autosuspend_ms);
+	pm_runtime_use_autosuspend(&client->dev);
+	pm_runtime_enable(&client->dev);
+
 	printk(KERN_ERR "sensor_probe end\n");
 
 	return 0;
@@ -2371,9 +6589,31 @@ static int sensor_probe(struct i2c_client *client,
 static int sensor_remove(struct i2c_client *client)
 {
 	struct v4l2_subdev *sd = i2c_get_clientdata(client);
+	struct sensor_info *info = to_state(sd);
 
+	mutex_lock(&mt9p031_instances_lock);
+	list_del(&info->list);
+	mt9p031_stereo_active = 0;
+	mutex_unlock(&mt9p031_instances_lock);
+	cancel_delayed_work_sync(&mt9p031_stereo_work);
+	cancel_delayed_work_sync(&info->wd_work);
+
+	if (info->vsync_irq > 0)
+		free_irq(info->vsync_irq, info);
+	if (info->vsync_gpio >= 0)
+		gpio_free(info->vsync_gpio);
+	/* a power down still waiting for the autosuspend delay happens now */
+	if (!info->powered)
+		pm_runtime_suspend(&client->dev);
+	pm_runtime_disable(&client->dev);
+	pm_runtime_set_suspended(&client->dev);
+	pm_runtime_dont_use_autosuspend(&client->dev);
+
+	debugfs_remove_recursive(info->debugfs);
+	mt9p031_snapshots_free(info);
 	v4l2_device_unregister_subdev(sd);
-	kfree(to_state(sd));
+	v4l2_ctrl_handler_free(&info->hdl);
+	kfree(info);
 	return 0;
 }
 
@@ -2390,6 +6630,7 @@ static struct i2c_driver sensor_driver =
 	{
 	.owner = THIS_MODULE,
 	.name = "mt9p031",
+	.pm = &mt9p031_pm_ops,
 	},
 	.probe = sensor_probe,
 	.remove = sensor_remove,
@@ -2397,12 +6638,21 @@ static struct i2c_driver sensor_driver =
 };
 static __init int init_sensor(void)
 {
+	int fails = mt9p031_check_modes(NULL, ccm_info_con.mclk);
+
+	if (fails)
+		csi_dev_err("%d mode table checks failed\n", fails);
+	mt9p031_debugfs_root = debugfs_create_dir("mt9p031", NULL);
+	if (mt9p031_debugfs_root)
+		debugfs_create_file("modes", S_IRUGO, mt9p031_debugfs_root, NULL,
+				    &mt9p031_modes_fops);
 	return i2c_add_driver(&sensor_driver);
 }
 
 static __exit void exit_sensor(void)
 {
   i2c_del_driver(&sensor_driver);
+  debugfs_remove_recursive(mt9p031_debugfs_root);
 }
 
 module_init(init_sensor);